@@ -0,0 +1,196 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>          // uint*
+#include <cstring>          // memset
+#include <cstdio>           // fprintf
+#include <algorithm>        // max
+#include <linux/io_uring.h>
+#include <sys/mman.h>       // mmap
+#include <sys/syscall.h>
+#include <errno.h>
+#include <unistd.h>
+#include "async_io.h"
+
+static int io_uring_setup(unsigned entries, io_uring_params* p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                      flags, NULL, 0);
+}
+
+async_io::async_io()
+  : ring_fd(-1), entries(0), inflight(0), to_submit(0),
+    sq_ring(NULL), sq_ring_size(0), sqes(NULL), sqes_size(0),
+    cq_ring(NULL), cq_ring_size(0) {
+}
+
+async_io::~async_io() {
+  if (ring_fd >= 0) {
+    if (cq_ring != sq_ring) {
+      munmap(cq_ring, cq_ring_size);
+    }
+    munmap(sq_ring, sq_ring_size);
+    munmap(sqes, sqes_size);
+    close(ring_fd);
+  }
+}
+
+int async_io::init(unsigned num_entries) {
+  entries = num_entries;
+
+  io_uring_params p;
+  std::memset(&p, 0, sizeof(p));
+  int fd = io_uring_setup(num_entries, &p);
+  if (fd < 0) {
+    // Synchronous fallback
+    return 0;
+  }
+  entries = p.sq_entries;
+
+  sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+  }
+
+  sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED) {
+    fprintf(stderr, "mmap io_uring sq failed err %s\n", strerror(errno));
+    close(fd);
+    return 1;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring = sq_ring;
+  } else {
+    cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) {
+      fprintf(stderr, "mmap io_uring cq failed err %s\n", strerror(errno));
+      munmap(sq_ring, sq_ring_size);
+      close(fd);
+      return 1;
+    }
+  }
+  sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+  sqes = (io_uring_sqe*)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    fprintf(stderr, "mmap io_uring sqes failed err %s\n", strerror(errno));
+    if (cq_ring != sq_ring) {
+      munmap(cq_ring, cq_ring_size);
+    }
+    munmap(sq_ring, sq_ring_size);
+    close(fd);
+    return 1;
+  }
+
+  uint8_t* sq = (uint8_t*)sq_ring;
+  sq_head  = (unsigned*)(sq + p.sq_off.head);
+  sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+  sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+  sq_array = (unsigned*)(sq + p.sq_off.array);
+
+  uint8_t* cq = (uint8_t*)cq_ring;
+  cq_head  = (unsigned*)(cq + p.cq_off.head);
+  cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+  cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+  cqes     = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  ring_fd = fd;
+  return 0;
+}
+
+int async_io::queue(uint8_t opcode, int fd, void* buf, size_t len,
+                    uint64_t offset, uint64_t user_data) {
+  if (inflight + to_submit >= entries) {
+    return -1;
+  }
+
+  if (ring_fd < 0) {
+    ssize_t ret = opcode == IORING_OP_READ ? pread(fd, buf, len, offset) :
+                                             pwrite(fd, buf, len, offset);
+    done.push_back({ user_data, ret < 0 ? -errno : ret });
+    inflight++;
+    return 0;
+  }
+
+  unsigned tail  = *sq_tail;
+  unsigned index = tail & *sq_mask;
+  io_uring_sqe* sqe = &sqes[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode    = opcode;
+  sqe->fd        = fd;
+  sqe->addr      = (uint64_t)buf;
+  sqe->len       = (uint32_t)len;
+  sqe->off       = offset;
+  sqe->user_data = user_data;
+  sq_array[index] = index;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  to_submit++;
+  return 0;
+}
+
+int async_io::queue_read(int fd, void* buf, size_t len, uint64_t offset,
+                         uint64_t user_data) {
+  return queue(IORING_OP_READ, fd, buf, len, offset, user_data);
+}
+
+int async_io::queue_write(int fd, const void* buf, size_t len,
+                          uint64_t offset, uint64_t user_data) {
+  return queue(IORING_OP_WRITE, fd, (void*)buf, len, offset, user_data);
+}
+
+int async_io::submit() {
+  if (ring_fd < 0 || to_submit == 0) {
+    return 0;
+  }
+  int ret = io_uring_enter(ring_fd, to_submit, 0, 0);
+  if (ret < 0) {
+    fprintf(stderr, "io_uring_enter failed err %s\n", strerror(errno));
+    return 1;
+  }
+  inflight  += ret;
+  to_submit -= ret;
+  return 0;
+}
+
+size_t async_io::reap(unsigned min_complete, async_io_completion* out,
+                      size_t max) {
+  size_t count = 0;
+
+  if (ring_fd < 0) {
+    while (count < max && !done.empty()) {
+      out[count++] = done.back();
+      done.pop_back();
+      inflight--;
+    }
+    return count;
+  }
+
+  while (count < max) {
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      if (count >= min_complete) {
+        break;
+      }
+      if (io_uring_enter(ring_fd, 0, min_complete - count,
+                         IORING_ENTER_GETEVENTS) < 0 &&
+          errno != EINTR && errno != EAGAIN) {
+        fprintf(stderr, "io_uring_enter failed err %s\n", strerror(errno));
+        break;
+      }
+      continue;
+    }
+    io_uring_cqe* cqe = &cqes[head & *cq_mask];
+    out[count++] = { cqe->user_data, cqe->res };
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    inflight--;
+  }
+  return count;
+}
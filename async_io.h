@@ -0,0 +1,81 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __ASYNC_IO_H__
+#define __ASYNC_IO_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct async_io_completion {
+  uint64_t user_data;
+  int64_t  result;     // Bytes transferred or -errno
+};
+
+// Minimal io_uring wrapper for large layer writes and batched reads. Uses
+// the raw system calls so there is no liburing dependency. When the kernel
+// (or a container seccomp profile) does not allow io_uring, requests are
+// executed synchronously with pread/pwrite at queue time instead.
+class async_io {
+public:
+  async_io();
+  ~async_io();
+
+  // Set up a ring with room for 'entries' requests in flight
+  int init(unsigned entries);
+
+  bool is_uring() const { return ring_fd >= 0; }
+  unsigned in_flight() const { return inflight; }
+  unsigned capacity() const { return entries; }
+
+  // Queue a request, returns -1 if the ring is full. Queued requests are
+  // not started until submit().
+  int queue_read(int fd, void* buf, size_t len, uint64_t offset,
+                 uint64_t user_data);
+  int queue_write(int fd, const void* buf, size_t len, uint64_t offset,
+                  uint64_t user_data);
+
+  int submit();
+
+  // Reap completions, blocking until at least min_complete are available.
+  // Returns the number of completions stored in 'out', fewer than
+  // min_complete only if waiting on the ring failed.
+  size_t reap(unsigned min_complete, async_io_completion* out, size_t max);
+
+private:
+  int queue(uint8_t opcode, int fd, void* buf, size_t len, uint64_t offset,
+            uint64_t user_data);
+
+  int       ring_fd;
+  unsigned  entries;
+  unsigned  inflight;
+  unsigned  to_submit;
+
+  // Submission queue
+  void*     sq_ring;
+  size_t    sq_ring_size;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  io_uring_sqe* sqes;
+  size_t    sqes_size;
+
+  // Completion queue
+  void*     cq_ring;
+  size_t    cq_ring_size;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  io_uring_cqe* cqes;
+
+  // Results of synchronous fallback requests
+  std::vector<async_io_completion> done;
+};
+
+#endif // __ASYNC_IO_H__
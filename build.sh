@@ -7,16 +7,32 @@ set -e
 set -x
 
 # Run first to smoke test
-g++ -g -Wall -Wextra -Werror -march=native -DPRINT_DIGEST_DEBUG create_labels.cpp memory_handling.cpp main.cpp -o test_debug -I./blst/src ./blst/libblst.a -pthread
+g++ -g -Wall -Wextra -Werror -march=native -DPRINT_DIGEST_DEBUG create_labels.cpp sha256_multi.cpp sha256_dispatch.cpp memory_handling.cpp parents_cache.cpp compact_parents.cpp topology.cpp async_io.cpp layer_gather.cpp checkpoint.cpp layer_pipeline.cpp layer_tree.cpp replica_encode.cpp label_verify.cpp label_context.cpp label_tune.cpp label_metrics.cpp perf_counters.cpp main.cpp -o test_debug -I./blst/src ./blst/libblst.a -pthread
 
 # Run in parallel
-#g++ -g -Wall -Wextra -Werror -march=native -O3 create_labels.cpp memory_handling.cpp main.cpp -o test -I./blst/src ./blst/libblst.a -lprofiler -pthread &
+#g++ -g -Wall -Wextra -Werror -march=native -O3 create_labels.cpp sha256_multi.cpp sha256_dispatch.cpp memory_handling.cpp parents_cache.cpp compact_parents.cpp topology.cpp async_io.cpp layer_gather.cpp checkpoint.cpp layer_pipeline.cpp layer_tree.cpp replica_encode.cpp label_verify.cpp label_context.cpp label_tune.cpp label_metrics.cpp perf_counters.cpp main.cpp -o test -I./blst/src ./blst/libblst.a -lprofiler -pthread &
 
-#g++ -g -Wall -Wextra -Werror -march=native -O3 -DNO_EXP_LAYER create_labels.cpp memory_handling.cpp main.cpp -o test_layer_1 -I./blst/src ./blst/libblst.a -lprofiler -ltcmalloc -pthread &
+#g++ -g -Wall -Wextra -Werror -march=native -O3 -DNO_EXP_LAYER create_labels.cpp sha256_multi.cpp sha256_dispatch.cpp memory_handling.cpp parents_cache.cpp compact_parents.cpp topology.cpp async_io.cpp layer_gather.cpp checkpoint.cpp layer_pipeline.cpp layer_tree.cpp replica_encode.cpp label_verify.cpp label_context.cpp label_tune.cpp label_metrics.cpp perf_counters.cpp main.cpp -o test_layer_1 -I./blst/src ./blst/libblst.a -lprofiler -ltcmalloc -pthread &
 
-g++ -Wall -Wextra -Werror -march=native -O3 -fomit-frame-pointer create_labels.cpp memory_handling.cpp gbench_create_labels.cpp -o bench -I./blst/src ./blst/libblst.a -lbenchmark -pthread &
+#g++ -g -Wall -Wextra -Werror -march=native -O3 -DLABEL_METRICS create_labels.cpp sha256_multi.cpp sha256_dispatch.cpp memory_handling.cpp parents_cache.cpp compact_parents.cpp topology.cpp async_io.cpp layer_gather.cpp checkpoint.cpp layer_pipeline.cpp layer_tree.cpp replica_encode.cpp label_verify.cpp label_context.cpp label_tune.cpp label_metrics.cpp perf_counters.cpp main.cpp -o test_metrics -I./blst/src ./blst/libblst.a -pthread &
 
-#clang++-10 -Wall -Wextra -Werror -march=native -O3 -fomit-frame-pointer create_labels.cpp memory_handling.cpp gbench_create_labels.cpp -o bench_clang -I./blst/src ./blst/libblst.a -lbenchmark -pthread &
+g++ -Wall -Wextra -Werror -march=native -O3 -fomit-frame-pointer create_labels.cpp sha256_multi.cpp sha256_dispatch.cpp memory_handling.cpp parents_cache.cpp compact_parents.cpp topology.cpp async_io.cpp layer_gather.cpp checkpoint.cpp layer_pipeline.cpp layer_tree.cpp replica_encode.cpp label_verify.cpp label_context.cpp label_tune.cpp label_metrics.cpp perf_counters.cpp gbench_create_labels.cpp -o bench -I./blst/src ./blst/libblst.a -lbenchmark -pthread &
+
+g++ -Wall -Wextra -Werror -march=native -O3 sha256_multi.cpp sha256_dispatch.cpp memory_handling.cpp parents_cache.cpp compact_parents.cpp topology.cpp gen_parents_cache.cpp -o gen_parents_cache ./blst/libblst.a -pthread &
+
+g++ -Wall -Wextra -Werror -march=native -O3 -DLABEL_METRICS create_labels.cpp sha256_multi.cpp sha256_dispatch.cpp memory_handling.cpp parents_cache.cpp compact_parents.cpp topology.cpp async_io.cpp layer_gather.cpp checkpoint.cpp layer_pipeline.cpp layer_tree.cpp replica_encode.cpp label_context.cpp label_metrics.cpp perf_counters.cpp label_daemon.cpp sdr_daemon.cpp -o sdr_daemon -I./blst/src ./blst/libblst.a -pthread &
+
+g++ -Wall -Wextra -Werror -O2 sdr_client.cpp -o sdr_client &
+
+# The library is shipped to other machines, so it is built for a baseline
+# target. The SHA-256 backends are still picked from the CPU at runtime.
+LIB_MARCH=-march=x86-64-v2
+if [ "$(uname -m)" = aarch64 ]; then
+  LIB_MARCH=-march=armv8-a
+fi
+g++ -Wall -Wextra -Werror $LIB_MARCH -O3 -fPIC -shared -fvisibility=hidden -Wl,-soname,libsdrlabel.so.1 -Wl,--version-script=sdr_label.map create_labels.cpp sha256_multi.cpp sha256_dispatch.cpp memory_handling.cpp parents_cache.cpp compact_parents.cpp topology.cpp async_io.cpp layer_gather.cpp checkpoint.cpp layer_pipeline.cpp layer_tree.cpp replica_encode.cpp label_context.cpp label_metrics.cpp perf_counters.cpp sdr_label.cpp -o libsdrlabel.so -I./blst/src ./blst/libblst.a -pthread &
+
+#clang++-10 -Wall -Wextra -Werror -march=native -O3 -fomit-frame-pointer create_labels.cpp sha256_multi.cpp sha256_dispatch.cpp memory_handling.cpp parents_cache.cpp compact_parents.cpp topology.cpp async_io.cpp layer_gather.cpp checkpoint.cpp layer_pipeline.cpp layer_tree.cpp replica_encode.cpp label_verify.cpp label_context.cpp label_tune.cpp label_metrics.cpp perf_counters.cpp gbench_create_labels.cpp -o bench_clang -I./blst/src ./blst/libblst.a -lbenchmark -pthread &
 
 wait
 
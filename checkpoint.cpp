@@ -0,0 +1,134 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>          // uint*
+#include <cstddef>          // offsetof
+#include <cstdio>           // fprintf, rename
+#include <cstring>          // memcpy, strerror
+#include <fcntl.h>          // open
+#include <errno.h>
+#include <unistd.h>         // pread, fdatasync
+#include "checkpoint.h"
+#include "create_labels.h"
+
+static uint64_t checkpoint_checksum(const checkpoint_data_t& data) {
+  const uint8_t* p = (const uint8_t*)&data;
+  uint64_t hash = 0xcbf29ce484222325UL;
+  for (size_t i = 0; i < offsetof(checkpoint_data_t, checksum); i++) {
+    hash = (hash ^ p[i]) * 0x100000001b3UL;
+  }
+  return hash;
+}
+
+int checkpoint::open(const char* output_dir, size_t sector_size,
+                     size_t num_layers, const uint8_t* replica_id) {
+  path = std::string(output_dir) + "/sdr-checkpoint";
+  next_persisted = 0;
+
+  std::memset(&data, 0, sizeof(data));
+  data.magic       = CHECKPOINT_MAGIC;
+  data.sector_size = sector_size;
+  data.num_layers  = num_layers;
+  std::memcpy(data.replica_id, replica_id, sizeof(data.replica_id));
+  data.layer       = 1;
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      fprintf(stderr, "open %s failed err %s\n", path.c_str(), strerror(errno));
+      return 1;
+    }
+    return save();
+  }
+
+  checkpoint_data_t saved;
+  ssize_t ret = pread(fd, &saved, sizeof(saved), 0);
+  close(fd);
+
+  // Only resume a checkpoint for the same sector and replica
+  if (ret != sizeof(saved) ||
+      saved.magic != CHECKPOINT_MAGIC ||
+      saved.checksum != checkpoint_checksum(saved) ||
+      saved.sector_size != sector_size ||
+      saved.num_layers != num_layers ||
+      std::memcmp(saved.replica_id, replica_id, sizeof(saved.replica_id)) ||
+      saved.layer < 1 || saved.layer > num_layers + 1 ||
+      saved.nodes_persisted > sector_size / NODE_SIZE) {
+    fprintf(stderr, "Ignoring checkpoint %s, it does not match this sector\n",
+            path.c_str());
+    return save();
+  }
+
+  data = saved;
+  fprintf(stderr, "Resuming from checkpoint at layer %ld node %ld\n",
+          data.layer, data.nodes_persisted);
+  return 0;
+}
+
+int checkpoint::persisted(uint64_t layer, uint64_t nodes, uint64_t labeled) {
+  std::lock_guard<std::mutex> lock(mtx);
+  if (layer == data.layer + 1) {
+    next_persisted = nodes;
+    return 0;
+  }
+  if (layer != data.layer) {
+    return 0;
+  }
+  data.nodes_persisted = nodes;
+  data.nodes_labeled   = labeled;
+  return save();
+}
+
+int checkpoint::layer_done(uint64_t layer) {
+  std::lock_guard<std::mutex> lock(mtx);
+  if (layer != data.layer) {
+    return 0;
+  }
+  data.layer++;
+  data.nodes_persisted = next_persisted;
+  data.nodes_labeled   = next_persisted;
+  next_persisted       = 0;
+  return save();
+}
+
+int checkpoint::remove() {
+  if (unlink(path.c_str()) != 0 && errno != ENOENT) {
+    fprintf(stderr, "unlink %s failed err %s\n", path.c_str(), strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+int checkpoint::save() {
+  data.checksum = checkpoint_checksum(data);
+
+  std::string tmp_path = path + ".tmp";
+  int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "open %s failed err %s\n", tmp_path.c_str(),
+            strerror(errno));
+    return 1;
+  }
+  if (write(fd, &data, sizeof(data)) != sizeof(data) || fdatasync(fd) != 0) {
+    fprintf(stderr, "write %s failed err %s\n", tmp_path.c_str(),
+            strerror(errno));
+    close(fd);
+    return 1;
+  }
+  close(fd);
+
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    fprintf(stderr, "rename %s failed err %s\n", path.c_str(), strerror(errno));
+    return 1;
+  }
+
+  // Make the rename itself durable
+  std::string dir = path.substr(0, path.find_last_of('/'));
+  int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+  return 0;
+}
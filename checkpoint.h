@@ -0,0 +1,66 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// "SDRCKPT1"
+const uint64_t CHECKPOINT_MAGIC = 0x3154504b43524453UL;
+
+// Persist a checkpoint every time this many more bytes of the current
+// layer are durable on disk
+const size_t CHECKPOINT_INTERVAL = (1UL << 30);
+
+// On disk checkpoint record. Layers before 'layer' are complete in their
+// layer files, nodes [0, nodes_persisted) of 'layer' are durable in its file.
+struct checkpoint_data_t {
+  uint64_t magic;
+  uint64_t sector_size;
+  uint64_t num_layers;
+  uint8_t  replica_id[32];
+  uint64_t layer;            // Layer in progress, num_layers + 1 when done
+  uint64_t nodes_persisted;  // Resume point within 'layer'
+  uint64_t nodes_labeled;    // Consumer position when written, informational
+  uint64_t checksum;         // FNV-1a of the fields above
+};
+
+// Checkpoint file <output_dir>/sdr-checkpoint, updated by the layer writer
+// threads so the labeling threads never wait on it. Every update is written
+// to a temporary file, synced and renamed over the previous one.
+class checkpoint {
+public:
+  // Load an existing checkpoint for this sector and replica_id, or start a
+  // new one at layer 1. Returns non-zero on I/O errors.
+  int open(const char* output_dir, size_t sector_size, size_t num_layers,
+           const uint8_t* replica_id);
+
+  // Resume point
+  uint64_t layer() const { return data.layer; }
+  uint64_t nodes_persisted() const { return data.nodes_persisted; }
+
+  // Nodes [0, nodes) of 'layer' are synced to its layer file
+  int persisted(uint64_t layer, uint64_t nodes, uint64_t labeled);
+
+  // 'layer' is complete and synced, move on to the next
+  int layer_done(uint64_t layer);
+
+  // Delete the checkpoint file after a complete run
+  int remove();
+
+private:
+  int save();
+
+  std::mutex        mtx;
+  std::string       path;
+  checkpoint_data_t data;
+  // Progress of the following layer reported while 'layer' is still
+  // being flushed, saved once 'layer' completes
+  uint64_t          next_persisted;
+};
+
+#endif // __CHECKPOINT_H__
@@ -0,0 +1,350 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>       // uint*
+#include <cstdio>        // fprintf
+#include <cstring>       // memcpy
+#include <vector>
+#include <fcntl.h>       // open
+#include <sys/mman.h>    // mmap
+#include <sys/stat.h>    // fstat
+#include <errno.h>
+#include <unistd.h>
+#include "compact_parents.h"
+
+// Expander parents of every 2^12th node are checked when encoding a flat
+// cache without storing them, all parents of every 2^12th node (more for
+// tiny sectors) when a cache is attached
+const uint64_t COMPACT_CHECK_INTERVAL = 1 << 12;
+
+compact_parents::compact_parents()
+  : data(NULL), total_size(0), num_nodes(0), mode(COMPACT_EXP_PACKED),
+    exp_bits(0), index(NULL), base(NULL), exp(NULL), graph(NULL) {}
+
+compact_parents::~compact_parents() {
+  release();
+}
+
+void compact_parents::release() {
+  if (data != NULL && munmap(data, total_size) != 0) {
+    fprintf(stderr, "munmap compact parents failed err %s\n", strerror(errno));
+  }
+  delete graph;
+  data       = NULL;
+  total_size = 0;
+  num_nodes  = 0;
+  mode       = COMPACT_EXP_PACKED;
+  exp_bits   = 0;
+  index      = NULL;
+  base       = NULL;
+  exp        = NULL;
+  graph      = NULL;
+}
+
+static void put_varint(std::vector<uint8_t>& out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back((uint8_t)(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back((uint8_t)v);
+}
+
+// Little endian bit stream, starts and ends on a byte boundary
+struct bit_writer {
+  uint8_t* out;
+  uint64_t acc;
+  size_t   bits;
+
+  explicit bit_writer(uint8_t* out) : out(out), acc(0), bits(0) {}
+
+  void put(uint32_t v, size_t n) {
+    acc |= (uint64_t)v << bits;
+    bits += n;
+    while (bits >= 8) {
+      *out++ = (uint8_t)acc;
+      acc >>= 8;
+      bits -= 8;
+    }
+  }
+};
+
+int compact_parents::generate(size_t sector_size, sdr_api_version api,
+                              compact_exp_mode exp_mode, size_t num_threads) {
+  return build(NULL, sector_size, api, exp_mode, num_threads);
+}
+
+int compact_parents::encode(const uint32_t* parents_cache, size_t sector_size,
+                            sdr_api_version api, compact_exp_mode exp_mode,
+                            size_t num_threads) {
+  return build(parents_cache, sector_size, api, exp_mode, num_threads);
+}
+
+int compact_parents::build(const uint32_t* parents_cache, size_t sector_size,
+                           sdr_api_version api, compact_exp_mode exp_mode,
+                           size_t num_threads) {
+  release();
+  sdr_graph src_graph(sector_size, api);
+  uint64_t nodes  = src_graph.num_nodes;
+  if (nodes == 0) {
+    return 1;
+  }
+  uint32_t bits   = 64 - __builtin_clzll((nodes - 1) | 1);
+  uint64_t blocks = (nodes + COMPACT_BLOCK_NODES - 1) / COMPACT_BLOCK_NODES;
+  uint64_t chunks = (nodes + NODES_PER_WORK_ITEM - 1) / NODES_PER_WORK_ITEM;
+  size_t   exp_size = exp_mode == COMPACT_EXP_PACKED ?
+                      (nodes * PARENT_COUNT_EXP * bits + 7) / 8 + 8 : 0;
+
+  // Chunks are encoded in parallel, block offsets are relative to the
+  // chunk until they are concatenated. NODES_PER_WORK_ITEM is a multiple of
+  // COMPACT_BLOCK_NODES and of 8 nodes, so chunks own whole blocks and
+  // whole bytes of the expander section.
+  std::vector<std::vector<uint8_t>> chunk_base(chunks);
+  std::vector<uint64_t>             block_offset(blocks + 1);
+  std::vector<uint8_t>              exp_packed(exp_size, 0);
+  std::atomic<uint64_t>             mismatch(nodes);
+
+  parallel_nodes(nodes, num_threads, [&](uint64_t first, uint64_t last) {
+    std::vector<uint8_t>& out = chunk_base[first / NODES_PER_WORK_ITEM];
+    out.reserve((last - first) * PARENT_COUNT_BASE * 2);
+    bit_writer exp_out(exp_packed.data() +
+                       first * PARENT_COUNT_EXP * bits / 8);
+
+    for (uint64_t node = first; node < last; node++) {
+      uint32_t parents[PARENT_COUNT];
+      if (parents_cache != NULL) {
+        std::memcpy(parents, parents_cache + node * PARENT_COUNT,
+                    sizeof(parents));
+        if (exp_mode == COMPACT_EXP_RECOMPUTE &&
+            node % COMPACT_CHECK_INTERVAL == 0) {
+          uint32_t exp_parents[PARENT_COUNT_EXP];
+          src_graph.expander_parents(exp_parents, node);
+          if (std::memcmp(exp_parents, parents + PARENT_COUNT_BASE,
+                          sizeof(exp_parents)) != 0) {
+            mismatch.store(node);
+          }
+        }
+      } else {
+        src_graph.base_parents(parents, node);
+        if (exp_mode == COMPACT_EXP_PACKED) {
+          src_graph.expander_parents(parents + PARENT_COUNT_BASE, node);
+        }
+      }
+
+      if (node % COMPACT_BLOCK_NODES == 0) {
+        block_offset[node / COMPACT_BLOCK_NODES] = out.size();
+      }
+      for (size_t k = 0; k < PARENT_COUNT_BASE; k++) {
+        put_varint(out, node - parents[k]);
+      }
+      if (exp_mode == COMPACT_EXP_PACKED) {
+        for (size_t k = PARENT_COUNT_BASE; k < PARENT_COUNT; k++) {
+          exp_out.put(parents[k], bits);
+        }
+      }
+    }
+  });
+
+  if (mismatch.load() != nodes) {
+    fprintf(stderr,
+            "ERROR - parents cache does not match the graph at node %ld\n",
+            mismatch.load());
+    return 1;
+  }
+
+  // Concatenate the chunks and rebase the index
+  uint64_t base_size = 0;
+  for (uint64_t c = 0; c < chunks; c++) {
+    uint64_t first_block = c * NODES_PER_WORK_ITEM / COMPACT_BLOCK_NODES;
+    uint64_t last_block  = std::min(first_block + NODES_PER_WORK_ITEM /
+                                    COMPACT_BLOCK_NODES, blocks);
+    for (uint64_t b = first_block; b < last_block; b++) {
+      block_offset[b] += base_size;
+    }
+    base_size += chunk_base[c].size();
+  }
+  block_offset[blocks] = base_size;
+
+  compact_parents_header_t header = {};
+  header.magic        = COMPACT_PARENTS_MAGIC;
+  header.version      = COMPACT_PARENTS_VERSION;
+  header.sector_size  = sector_size;
+  header.api          = api;
+  header.exp_mode     = exp_mode;
+  header.exp_bits     = bits;
+  header.index_offset = 64;
+  header.base_offset  = header.index_offset + (blocks + 1) * sizeof(uint64_t);
+  header.exp_offset   = (header.base_offset + base_size + 7) & ~7UL;
+  header.total_size   = header.exp_offset + exp_size;
+
+  uint8_t* mapping = (uint8_t*)mmap(NULL, header.total_size,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "mmap compact parents failed err %s\n", strerror(errno));
+    return 1;
+  }
+  std::memcpy(mapping, &header, sizeof(header));
+  std::memcpy(mapping + header.index_offset, block_offset.data(),
+              (blocks + 1) * sizeof(uint64_t));
+  uint8_t* base_out = mapping + header.base_offset;
+  for (const std::vector<uint8_t>& chunk : chunk_base) {
+    std::memcpy(base_out, chunk.data(), chunk.size());
+    base_out += chunk.size();
+  }
+  std::memcpy(mapping + header.exp_offset, exp_packed.data(), exp_size);
+
+  return attach(mapping, header.total_size);
+}
+
+// Whether the header describes sections that fit inside the file image
+static bool compact_header_valid(const compact_parents_header_t& header,
+                                 size_t mapping_size) {
+  if (header.magic != COMPACT_PARENTS_MAGIC ||
+      header.version != COMPACT_PARENTS_VERSION ||
+      header.total_size != mapping_size ||
+      get_sector_config(header.sector_size) == NULL ||
+      (header.api != SDR_API_V1_0 && header.api != SDR_API_V1_1) ||
+      (header.exp_mode != COMPACT_EXP_PACKED &&
+       header.exp_mode != COMPACT_EXP_RECOMPUTE)) {
+    return false;
+  }
+  // Expander parents need log2(node_count) bits
+  uint64_t nodes  = header.sector_size / NODE_SIZE;
+  uint32_t bits   = 64 - __builtin_clzll((nodes - 1) | 1);
+  if (header.exp_bits < bits || header.exp_bits > 32) {
+    return false;
+  }
+  uint64_t blocks = (nodes + COMPACT_BLOCK_NODES - 1) / COMPACT_BLOCK_NODES;
+  size_t   exp_size = header.exp_mode == COMPACT_EXP_PACKED ?
+                      (nodes * PARENT_COUNT_EXP * header.exp_bits + 7) / 8 + 8 :
+                      0;
+  // Sections are compared against the room left after their offset so
+  // corrupt offsets can't overflow the sums
+  return header.index_offset >= sizeof(header) &&
+         header.index_offset % sizeof(uint64_t) == 0 &&
+         header.index_offset <= mapping_size &&
+         (blocks + 1) * sizeof(uint64_t) <=
+           mapping_size - header.index_offset &&
+         header.base_offset >=
+           header.index_offset + (blocks + 1) * sizeof(uint64_t) &&
+         header.base_offset <= header.exp_offset &&
+         header.exp_offset <= mapping_size &&
+         exp_size <= mapping_size - header.exp_offset;
+}
+
+// Take ownership of a mapping holding a file image and set up the section
+// pointers. The header and block index are checked against the file, then
+// a sample of decoded parents against the graph.
+int compact_parents::attach(uint8_t* mapping, size_t mapping_size) {
+  compact_parents_header_t header = {};
+  if (mapping_size >= sizeof(header)) {
+    std::memcpy(&header, mapping, sizeof(header));
+  }
+  data       = mapping;
+  total_size = mapping_size;
+
+  if (!compact_header_valid(header, mapping_size)) {
+    fprintf(stderr, "ERROR - invalid compact parents cache\n");
+    release();
+    return 1;
+  }
+
+  graph     = new sdr_graph(header.sector_size,
+                            (sdr_api_version)header.api);
+  num_nodes = graph->num_nodes;
+  mode      = (compact_exp_mode)header.exp_mode;
+  exp_bits  = header.exp_bits;
+  index     = (const uint64_t*)(data + header.index_offset);
+  base      = data + header.base_offset;
+  exp       = data + header.exp_offset;
+
+  // Block offsets must ascend and end inside the base section
+  uint64_t blocks = (num_nodes + COMPACT_BLOCK_NODES - 1) /
+                    COMPACT_BLOCK_NODES;
+  bool index_valid = index[0] == 0 &&
+                     index[blocks] <= header.exp_offset - header.base_offset;
+  for (uint64_t b = 0; index_valid && b < blocks; b++) {
+    index_valid = index[b] <= index[b + 1];
+  }
+  if (!index_valid) {
+    fprintf(stderr, "ERROR - invalid compact parents cache index\n");
+    release();
+    return 1;
+  }
+
+  uint64_t step    = std::max(std::min(COMPACT_CHECK_INTERVAL,
+                                       num_nodes / 64), (uint64_t)1);
+  uint64_t samples = (num_nodes + step - 1) / step;
+  std::atomic<uint64_t> mismatch(num_nodes);
+  parallel_nodes(samples, 0, [&](uint64_t first, uint64_t end) {
+    reader parents_reader(*this);
+    for (uint64_t i = first; i < end; i++) {
+      uint64_t node = i * step;
+      uint32_t expected[PARENT_COUNT];
+      uint32_t parents[PARENT_COUNT];
+      graph->parents(expected, node);
+      parents_reader.get(node, parents, true);
+      if (std::memcmp(expected, parents, sizeof(expected)) != 0) {
+        mismatch.store(node);
+        break;
+      }
+    }
+  });
+  if (mismatch.load() != num_nodes) {
+    fprintf(stderr,
+            "ERROR - compact parents cache does not match the graph at node "
+            "%ld\n", mismatch.load());
+    release();
+    return 1;
+  }
+
+  if (mlock(data, total_size) != 0) {
+    fprintf(stderr, "mlock compact parents failed err %s\n", strerror(errno));
+  }
+  return 0;
+}
+
+int compact_parents::save(const char* filename) const {
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "open %s failed err %s\n", filename, strerror(errno));
+    return 1;
+  }
+  size_t done = 0;
+  while (done < total_size) {
+    ssize_t ret = write(fd, data + done, total_size - done);
+    if (ret < 0) {
+      fprintf(stderr, "write %s failed err %s\n", filename, strerror(errno));
+      close(fd);
+      return 1;
+    }
+    done += ret;
+  }
+  close(fd);
+  return 0;
+}
+
+int compact_parents::load(const char* filename) {
+  release();
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "open %s failed err %s\n", filename, strerror(errno));
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (size_t)st.st_size < sizeof(compact_parents_header_t)) {
+    fprintf(stderr, "ERROR - %s is not a compact parents cache\n", filename);
+    close(fd);
+    return 1;
+  }
+  uint8_t* mapping = (uint8_t*)mmap(NULL, st.st_size, PROT_READ,
+                                    MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "mmap %s failed err %s\n", filename, strerror(errno));
+    return 1;
+  }
+  return attach(mapping, st.st_size);
+}
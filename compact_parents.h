@@ -0,0 +1,154 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __COMPACT_PARENTS_H__
+#define __COMPACT_PARENTS_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include "create_labels.h"
+#include "parents_cache.h"
+
+// Compact parents cache
+//
+// The flat cache takes PARENT_COUNT * 4 = 56 bytes per node. Base parents
+// are mostly close to their node, so they are stored as LEB128 varints of
+// node - parent, about 10 bytes per node. Nodes are grouped in blocks of
+// COMPACT_BLOCK_NODES with the byte offset of each block in an index for
+// random access. Expander parents are uniform over the sector and either
+// bit packed at log2(node_count) bits each, or not stored at all and
+// recomputed from the Feistel permutation when decoded.
+//
+// File layout: compact_parents_header_t, block index (uint64_t per block
+// plus the end offset), varint base parents, packed expander parents.
+
+const uint32_t COMPACT_PARENTS_MAGIC   = 0x50434453; // "SDCP"
+const uint32_t COMPACT_PARENTS_VERSION = 1;
+const size_t   COMPACT_BLOCK_NODES     = 64;
+// Producer threads are multiplied by this when expanders are recomputed,
+// a node costs about 50 BLAKE2b compressions
+const size_t   COMPACT_RECOMPUTE_PRODUCER_SCALE = 4;
+
+enum compact_exp_mode {
+  COMPACT_EXP_PACKED,      // Bit packed expander parents
+  COMPACT_EXP_RECOMPUTE    // Recomputed by the reader
+};
+
+struct compact_parents_header_t {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t sector_size;
+  uint32_t api;             // sdr_api_version
+  uint32_t exp_mode;        // compact_exp_mode
+  uint32_t exp_bits;        // Bits per packed expander parent
+  uint32_t reserved;
+  uint64_t index_offset;    // Byte offsets from the start of the file
+  uint64_t base_offset;
+  uint64_t exp_offset;
+  uint64_t total_size;
+};
+
+class compact_parents {
+public:
+  compact_parents();
+  ~compact_parents();
+
+  // Build straight from the graph, never holding the flat cache
+  int generate(size_t sector_size, sdr_api_version api,
+               compact_exp_mode mode, size_t num_threads = 0);
+  // Build from a flat cache. In COMPACT_EXP_RECOMPUTE mode a sample of the
+  // expander parents is checked against the graph.
+  int encode(const uint32_t* parents_cache, size_t sector_size,
+             sdr_api_version api, compact_exp_mode mode,
+             size_t num_threads = 0);
+
+  int save(const char* filename) const;
+  // Maps, checks and locks the file
+  int load(const char* filename);
+  void release();
+
+  size_t           size() const { return total_size; }
+  uint64_t         node_count() const { return num_nodes; }
+  compact_exp_mode exp_mode() const { return mode; }
+
+  // Sequential decoder, one per thread. Decoding consecutive nodes
+  // continues from the previous one, any other node seeks via the index.
+  class reader {
+  public:
+    explicit reader(const compact_parents& cp)
+      : cp(cp), next_node(cp.num_nodes), pos(NULL) {}
+
+    // Parents of node in the flat cache order, written to parents.
+    // Expander parents are skipped when expanders is false.
+    const uint32_t* get(uint64_t node, uint32_t* parents, bool expanders) {
+      if (node != next_node) {
+        seek(node);
+      }
+      for (size_t k = 0; k < PARENT_COUNT_BASE; k++) {
+        parents[k] = (uint32_t)(node - read_varint());
+      }
+      next_node = node + 1;
+
+      if (expanders) {
+        if (cp.mode == COMPACT_EXP_RECOMPUTE) {
+          cp.graph->expander_parents(parents + PARENT_COUNT_BASE, node);
+        } else {
+          unpack_expanders(parents + PARENT_COUNT_BASE, node);
+        }
+      }
+      return parents;
+    }
+
+  private:
+    uint64_t read_varint() {
+      uint64_t v = *pos & 0x7F;
+      for (size_t shift = 7; *pos++ & 0x80; shift += 7) {
+        v |= (uint64_t)(*pos & 0x7F) << shift;
+      }
+      return v;
+    }
+
+    void seek(uint64_t node) {
+      pos = cp.base + cp.index[node / COMPACT_BLOCK_NODES];
+      size_t skip = (node % COMPACT_BLOCK_NODES) * PARENT_COUNT_BASE;
+      for (size_t i = 0; i < skip; i++) {
+        while (*pos++ & 0x80);
+      }
+    }
+
+    // exp_bits <= 32, so shift + exp_bits fits one unaligned 64 bit load.
+    // The section is padded by 8 bytes for the last node.
+    void unpack_expanders(uint32_t* parents, uint64_t node) const {
+      uint64_t bit  = node * PARENT_COUNT_EXP * cp.exp_bits;
+      uint64_t mask = (1ULL << cp.exp_bits) - 1;
+      for (size_t k = 0; k < PARENT_COUNT_EXP; k++, bit += cp.exp_bits) {
+        uint64_t word;
+        std::memcpy(&word, cp.exp + bit / 8, 8);
+        parents[k] = (uint32_t)((word >> (bit % 8)) & mask);
+      }
+    }
+
+    const compact_parents& cp;
+    uint64_t               next_node;
+    const uint8_t*         pos;
+  };
+
+private:
+  int build(const uint32_t* parents_cache, size_t sector_size,
+            sdr_api_version api, compact_exp_mode mode, size_t num_threads);
+  int attach(uint8_t* mapping, size_t mapping_size);
+
+  uint8_t*         data;        // Whole file image
+  size_t           total_size;
+  uint64_t         num_nodes;
+  compact_exp_mode mode;
+  uint32_t         exp_bits;
+  const uint64_t*  index;
+  const uint8_t*   base;
+  const uint8_t*   exp;
+  sdr_graph*       graph;       // For COMPACT_EXP_RECOMPUTE
+};
+
+#endif // __COMPACT_PARENTS_H__
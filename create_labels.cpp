@@ -9,10 +9,20 @@
 #include <iomanip>       // printing
 #include <byteswap.h>    // bswap_64 TODO - make more portable?
 #include <thread>
+#include <system_error>
 #include <atomic>
-#include <unistd.h>      // usleep
-#include <sys/mman.h>    // mlock
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <sys/mman.h>    // mmap
+#include <errno.h>
 #include "create_labels.h"
+#include "compact_parents.h"
+#include "layer_gather.h"
+#include "label_metrics.h"
+#include "sha256_multi.h"
+#include "wait_policy.h"
 
 //#define PRINT_DIGEST_DEBUG
 
@@ -21,6 +31,65 @@ const uint32_t SHA256_INITIAL_DIGEST[8] = {
   0x510e527fU, 0x9b05688cU, 0x1f83d9abU, 0x5be0cd19U
 };
 
+// Process wide tunables, set from any thread and read once per layer
+static std::atomic<label_wait_policy_t>
+                           label_wait_policy(WAIT_POLICY_ADAPTIVE);
+static std::atomic<size_t> label_gather_lookahead(LABEL_GATHER_LOOKAHEAD);
+static std::atomic<size_t> label_exp_prefetch(LABEL_EXP_PREFETCH);
+static std::atomic<size_t> label_layer1_prefetch(LABEL_LAYER1_PREFETCH);
+// The parameters are set and read whole under label_params_lock
+static std::mutex          label_params_lock;
+static label_params_t      label_params_layer1 = LABEL_PARAMS_LAYER1;
+static label_params_t      label_params_exp    = LABEL_PARAMS_EXP;
+// Placement is per calling thread so concurrent sectors can each have one
+static thread_local const label_placement_t* label_placement = NULL;
+static thread_local const std::atomic<bool>* label_cancel    = NULL;
+static thread_local label_stats_t            label_stats;
+
+void set_label_wait_policy(label_wait_policy_t policy) {
+  label_wait_policy = policy;
+}
+
+void set_label_gather_lookahead(size_t nodes) {
+  label_gather_lookahead = nodes;
+}
+
+void set_label_exp_prefetch(size_t chunk_nodes, size_t distance) {
+  std::lock_guard<std::mutex> guard(label_params_lock);
+  label_params_exp.producer_stride = std::max(chunk_nodes, (size_t)1);
+  label_exp_prefetch               = distance;
+}
+
+void set_label_layer1_prefetch(size_t distance) {
+  label_layer1_prefetch = distance;
+}
+
+void set_label_params(bool layer1, const label_params_t& params) {
+  std::lock_guard<std::mutex> guard(label_params_lock);
+  label_params_t& dst = layer1 ? label_params_layer1 : label_params_exp;
+  dst.lookahead       = std::max(params.lookahead, (size_t)1);
+  // Layer 1 runs without producers at 0
+  dst.num_producers   = std::max(params.num_producers, (size_t)!layer1);
+  dst.producer_stride = std::max(params.producer_stride, (size_t)1);
+}
+
+label_params_t get_label_params(bool layer1) {
+  std::lock_guard<std::mutex> guard(label_params_lock);
+  return layer1 ? label_params_layer1 : label_params_exp;
+}
+
+const label_stats_t& get_label_stats() {
+  return label_stats;
+}
+
+void set_label_placement(const label_placement_t* placement) {
+  label_placement = placement;
+}
+
+void set_label_cancel(const std::atomic<bool>* cancel) {
+  label_cancel = cancel;
+}
+
 void print_digest(uint32_t* digest) {
   for (int i = 0; i < 8; ++i) {
     std::cout << std::hex << std::setfill('0') << std::setw(8)
@@ -42,25 +111,163 @@ void print_bytes(const char *name, uint8_t* buf, size_t size) {
   std::cout << std::endl;
 }
 
+// Hash 'blocks' blocks for every lane. A single lane goes straight to the
+// single stream block function, wider configurations use the multi-buffer
+// kernel so all sectors advance through the rounds together. 'lanes' may
+// be lower than LANES for a partial group.
+template<size_t LANES>
+inline
+void sha256_block_lanes(uint32_t* const* h, const uint8_t* const* in,
+                        size_t blocks, size_t lanes = LANES) {
+  if constexpr (LANES == 1) {
+    sha256_block(h[0], in[0], blocks);
+  } else {
+    sha256_block_multi(h, in, blocks, lanes);
+  }
+}
+
+// Label of node 0, which has no parents: replica_id || cur_layer || 0
+static inline void hash_first_node(const uint8_t* replica_id,
+                                   uint32_t cur_layer, uint32_t* label) {
+  // TODO - Hash and save intermediate result: replica_id || cur_layer
+  uint8_t buf[128] = {0};
+  std::memcpy(buf, replica_id, 32);
+  buf[35]  = (uint8_t)(cur_layer & 0xFF);
+  buf[64]  = 0x80; // Padding
+  buf[126] = 0x02; // Length (512 bits == 64B)
+
+  std::memcpy(label, SHA256_INITIAL_DIGEST, 32);
+  sha256_block(label, buf, 2);
+
+  // Fix endianess
+  blst_sha256_emit((uint8_t*)label, label);
+  label[7] &= 0x3FFFFFFF; // Strip last two bits to ensure in Fr
+}
+
+// Hash the parents of a node and finish its label, for each lane. h holds
+// the state after the first block (replica_id, layer and node), node_bufs
+// the node's label data with every parent filled in. The last block of the
+// data is overwritten with the padding.
+template<bool LAYER1, size_t LANES>
+inline
+void hash_label_rounds(uint32_t* const* h, uint8_t* const* node_bufs,
+                       size_t lanes = LANES) {
+  const uint8_t* bufs[LANES];
+  for (size_t l = 0; l < lanes; l++) {
+    bufs[l] = node_bufs[l] + 64;
+  }
+
+  if constexpr (LAYER1) {
+    // Six rounds of all base parents
+    for (size_t j = 0; j < 6; ++j) {
+      sha256_block_lanes<LANES>(h, bufs, 3, lanes);
+    }
+
+    // round 7 is only first parent
+    for (size_t l = 0; l < lanes; l++) {
+      uint8_t *lane_buf = node_bufs[l];
+      std::memset(lane_buf + 96, 0, 32); // Zero out upper half of last block
+      lane_buf[96]  = 0x80;            // Padding
+      lane_buf[126] = 0x27;            // Length (0x2700 = 9984 bits -> 1248 bytes)
+    }
+    sha256_block_lanes<LANES>(h, bufs, 1, lanes);
+  } else {
+    // Two rounds of all parents
+    sha256_block_lanes<LANES>(h, bufs, 7, lanes);
+    sha256_block_lanes<LANES>(h, bufs, 7, lanes);
+
+    // Final round is only nine parents
+    for (size_t l = 0; l < lanes; l++) {
+      uint8_t *lane_buf = node_bufs[l];
+      std::memset(lane_buf + 352, 0, 32); // Zero out upper half of last block
+      lane_buf[352] = 0x80;             // Padding
+      lane_buf[382] = 0x27;             // Length (0x2700 = 9984 bits -> 1248 bytes)
+    }
+    sha256_block_lanes<LANES>(h, bufs, 5, lanes);
+  }
+
+  // Fix endianess
+  for (size_t l = 0; l < lanes; l++) {
+    blst_sha256_emit((uint8_t*)h[l], h[l]);
+    h[l][7] &= 0x3FFFFFFF; // Strip last two bits to fit in Fr
+  }
+}
+
+// State of one ring_buf slot. Each slot is published on its own so
+// producers can finish out of order, and sits on its own cache line so
+// neighbouring slots don't contend.
+struct alignas(64) ring_slot_t {
+  std::atomic<uint64_t> seq;       // Node in the slot, stored once it is filled
+  wait_counter_t        wait;      // Consumer waits on seq
+  uint32_t              base_parent_missing; // Base parents left to the consumer
+  uint32_t              base_parents[PARENT_COUNT_BASE]; // Decoded indexes
+};
+
+// Parents cache readers. The flat cache is read in place, the compact
+// one is decoded by each producer.
+struct flat_parents_reader {
+  const uint32_t* cache;
+
+  const uint32_t* get(uint64_t node, uint32_t*, bool) {
+    return cache + node * PARENT_COUNT;
+  }
+};
+
+static inline flat_parents_reader parents_reader(const uint32_t* cache) {
+  return flat_parents_reader{cache};
+}
+
+static inline compact_parents::reader
+parents_reader(const compact_parents* cp) {
+  return compact_parents::reader(*cp);
+}
+
+// Producers needed per flat cache producer to keep up with the consumer
+static inline size_t producer_scale(const uint32_t*) {
+  return 1;
+}
+
+static inline size_t producer_scale(const compact_parents* cp) {
+  return cp->exp_mode() == COMPACT_EXP_RECOMPUTE ?
+    COMPACT_RECOMPUTE_PRODUCER_SCALE : 1;
+}
+
 // Fill the buffer for cur_node
+// The slot holds one buffer of bytes_per_node for each lane. All lanes share
+// the parent indexes, so the ready check for base parents is done once.
+// LAYER1 - first layer, no expander parents
+template<bool LAYER1, size_t LANES>
 inline
 void fill_buffer(uint64_t  cur_node,
                  std::atomic<uint64_t> &cur_consumer,
-                 uint32_t* cur_parent, // parents for this node
-                 uint32_t* layer_labels,
-                 uint32_t* exp_labels,
+                 const uint32_t* cur_parent, // parents for this node
+                 uint32_t* const* layer_labels,
+                 uint32_t* const* exp_labels,
+                 const uint8_t* exp_gathered, // Expander data, or NULL
                  uint8_t*  buf,
-                 uint32_t* base_parent_missing,
-                 bool      is_layer0) {
+                 ring_slot_t& slot) {
   const size_t min_base_parent_node = 2000;
+  const size_t bytes_per_node = (NODE_SIZE * PARENT_COUNT) + 64;
 
   uint64_t cur_node_swap = bswap_64(cur_node); // Note switch to big endian
-  std::memcpy(buf + 36, &cur_node_swap, 8); // update buf with current node
+  uint32_t* cur_node_ptrs[LANES];
+  const uint8_t* bufs[LANES];
+  for (size_t l = 0; l < LANES; l++) {
+    uint8_t* lane_buf = buf + l * bytes_per_node;
+    std::memcpy(lane_buf + 36, &cur_node_swap, 8); // update buf with current node
+
+    cur_node_ptrs[l] = layer_labels[l] + (cur_node * NODE_WORDS);
+    std::memcpy(cur_node_ptrs[l], SHA256_INITIAL_DIGEST, 32);
+    bufs[l] = lane_buf;
+  }
 
   // Perform the first hash
-  uint32_t* cur_node_ptr = layer_labels + (cur_node * NODE_WORDS);
-  std::memcpy(cur_node_ptr, SHA256_INITIAL_DIGEST, 32);
-  blst_sha256_block(cur_node_ptr, buf, 1);
+  sha256_block_lanes<LANES>(cur_node_ptrs, bufs, 1);
+
+  // The consumer fills missing base parents from the slot
+  std::memcpy(slot.base_parents, cur_parent,
+              PARENT_COUNT_BASE * sizeof(uint32_t));
+  uint32_t* base_parent_missing = &slot.base_parent_missing;
   
   // Fill in the base parents
   // Node 5 (prev node) will always be missing, and there tend to be
@@ -74,8 +281,11 @@ void fill_buffer(uint64_t  cur_node,
         // Node is not ready
         *base_parent_missing |= (1 << k);
       } else {
-        uint32_t *parent_data = layer_labels + (*cur_parent * NODE_WORDS);
-        std::memcpy(buf + 64 + (NODE_SIZE * k), parent_data, NODE_SIZE);
+        for (size_t l = 0; l < LANES; l++) {
+          uint32_t *parent_data = layer_labels[l] + (*cur_parent * NODE_WORDS);
+          std::memcpy(buf + l * bytes_per_node + 64 + (NODE_SIZE * k),
+                      parent_data, NODE_SIZE);
+        }
       }
       cur_parent++;
     }
@@ -86,45 +296,114 @@ void fill_buffer(uint64_t  cur_node,
     cur_parent += PARENT_COUNT_BASE;
   }
 
-  if (!is_layer0) {
+  if constexpr (!LAYER1) {
+    if (exp_gathered != NULL) {
+      // Already gathered from the previous layer file (single lane)
+      std::memcpy(buf + 64 + NODE_SIZE * PARENT_COUNT_BASE, exp_gathered,
+                  NODE_SIZE * PARENT_COUNT_EXP);
+      return;
+    }
     // Read from each of the expander parent nodes
     for (size_t k = PARENT_COUNT_BASE; k < PARENT_COUNT; ++k) {
-      uint32_t *parent_data = exp_labels + (*cur_parent * NODE_WORDS);
-      std::memcpy(buf + 64 + NODE_SIZE * k, parent_data, NODE_SIZE);
+      for (size_t l = 0; l < LANES; l++) {
+        uint32_t *parent_data = exp_labels[l] + (*cur_parent * NODE_WORDS);
+        std::memcpy(buf + l * bytes_per_node + 64 + NODE_SIZE * k,
+                    parent_data, NODE_SIZE);
+      }
       cur_parent++;
     }
   }
 }
 
+// Add a wait that began at start to a WAIT_HIST_BUCKETS histogram
+static inline void record_wait(uint64_t* hist, uint64_t& total_ns,
+                               std::chrono::steady_clock::time_point start) {
+  uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count();
+  size_t bucket = 63 - __builtin_clzll(ns | 1);
+  hist[std::min(bucket, WAIT_HIST_BUCKETS - 1)]++;
+  total_ns += ns;
+}
+
+// Producer side: don't overrun the buffer with node i. Built with
+// LABEL_METRICS the waits are timed into stats, otherwise the ready
+// check stays inside wait_until.
+static inline void wait_ring_space(wait_counter_t& consumer_wait,
+                                   label_wait_policy_t policy,
+                                   uint64_t i, uint64_t lookahead,
+                                   label_stats_t& stats) {
+  auto ready = [&](uint64_t consumer) {
+    return i <= consumer + lookahead - 1;
+  };
+#ifdef LABEL_METRICS
+  if (ready(consumer_wait.counter->load())) {
+    return;
+  }
+  auto start = std::chrono::steady_clock::now();
+  wait_until(consumer_wait, policy, ready);
+  stats.producer_waits++;
+  record_wait(stats.backpressure_hist, stats.backpressure_ns, start);
+#else
+  (void)stats;
+  wait_until(consumer_wait, policy, ready);
+#endif
+}
+
+// Pull the expander parent labels of a node into cache ahead of
+// fill_buffer. They are spread over the whole previous layer, so without
+// this every copy is a DRAM miss.
+template<size_t LANES>
+inline
+void prefetch_expanders(const uint32_t* parents,
+                        uint32_t* const* exp_labels) {
+  for (size_t k = PARENT_COUNT_BASE; k < PARENT_COUNT; ++k) {
+    for (size_t l = 0; l < LANES; l++) {
+      __builtin_prefetch(exp_labels[l] + parents[k] * NODE_WORDS, 0, 3);
+    }
+  }
+}
+
 // This implements a producer, i.e. a thread that pre-fills the buffer
 // with parent node data.
 // - cur_consumer - The node currently being processed (consumed) by the
 //                  hashing thread
-// - cur_producer - The next node to be filled in by producer threads. The
-//                  hashing thread can not yet work on this node.
 // - cur_awaiting - The first not not currently being filled by any producer
 //                  thread.
 // - stride       - Each producer fills in this many nodes at a time. Setting
 //                  this too small with cause a lot of time to be spent in
 //                  thread synchronization
 // - lookahead    - ring_buf size, in nodes
-// - base_parent_missing - Bit mask of any base parent nodes that could not
-//                         be filled in. This is an array of size lookahead.
-// - is_layer0    - Indicates first (no expander parents) or subsequent layer
-int create_label_runner(uint32_t* parents_cache,
-                        uint32_t* layer_labels,
-                        uint32_t* exp_labels, // NULL for layer 0
+// - slots        - Per slot ready sequence and base parent missing bit mask.
+//                  This is an array of size lookahead.
+// - consumer_wait - Wait on cur_consumer following 'policy'
+// - prefetch     - Layers 2 and up work on the stride in two phases: the
+//                  parents of all its nodes are read first, then expander
+//                  parents are prefetched this many nodes ahead of the node
+//                  being filled. 0 disables.
+// - stats        - This producer's backpressure waits (LABEL_METRICS)
+// - LAYER1       - Indicates first (no expander parents) or subsequent layer
+template<bool LAYER1, size_t LANES, typename PARENTS>
+int create_label_runner(PARENTS parents,
+                        uint32_t* const* layer_labels,
+                        uint32_t* const* exp_labels, // NULL for layer 0
                         uint64_t num_nodes,
                         std::atomic<uint64_t> &cur_consumer,
-                        std::atomic<uint64_t> &cur_producer,
                         std::atomic<uint64_t> &cur_awaiting,
                         size_t stride,
                         uint64_t lookahead,
                         uint8_t *ring_buf,
-                        uint32_t *base_parent_missing,
-                        bool is_layer0) {
-  // Label data bytes per node
+                        ring_slot_t *slots,
+                        wait_counter_t &consumer_wait,
+                        label_wait_policy_t policy,
+                        size_t prefetch,
+                        label_stats_t &stats) {
+  // Label data bytes per node, for all lanes
   const size_t bytes_per_node = (NODE_SIZE * PARENT_COUNT) + 64;
+  const size_t bytes_per_slot = bytes_per_node * LANES;
+  auto reader = parents_reader(parents);
+  // Parents of every node in the stride, decoded up front for prefetching
+  std::vector<uint32_t>        stride_parents(stride * PARENT_COUNT);
+  std::vector<const uint32_t*> parent_ptrs(stride);
 
   while(true) {
     // Get next work items
@@ -136,196 +415,843 @@ int create_label_runner(uint32_t* parents_cache,
     if (work + stride > num_nodes) {
       count = num_nodes - work;
     }
-    
+
+    // Phase one, parents of the stride and the first prefetches
+    for (size_t s = 0; s < count; s++) {
+      parent_ptrs[s] = reader.get(work + s, &stride_parents[s * PARENT_COUNT],
+                                  !LAYER1);
+    }
+    if constexpr (!LAYER1) {
+      for (size_t s = 0; s < std::min(prefetch, (size_t)count); s++) {
+        prefetch_expanders<LANES>(parent_ptrs[s], exp_labels);
+      }
+    }
+
     // Do the work of filling the buffers
     for (size_t s = 0; s < count; s++) {
       uint64_t i = work + s;
+      if constexpr (!LAYER1) {
+        if (prefetch > 0 && s + prefetch < count) {
+          prefetch_expanders<LANES>(parent_ptrs[s + prefetch], exp_labels);
+        }
+      }
 
       // Determine which node slot in the ring_buffer to use
       // Note that node 0 does not use a buffer slot
       uint32_t cur_slot = (i - 1) % lookahead;
       
       // Don't overrun the buffer
-      while(i > (cur_consumer.load() + lookahead - 1)) {
-        usleep(10);
-      }
-      uint8_t *buf = ring_buf + cur_slot * bytes_per_node;
+      wait_ring_space(consumer_wait, policy, i, lookahead, stats);
+      uint8_t *buf = ring_buf + cur_slot * bytes_per_slot;
       
-      fill_buffer(i, cur_consumer,
-                  parents_cache + i * PARENT_COUNT,
-                  layer_labels, exp_labels, 
-                  buf, &base_parent_missing[cur_slot],
-                  is_layer0);
-    }
+      fill_buffer<LAYER1, LANES>(i, cur_consumer, parent_ptrs[s],
+                                 layer_labels, exp_labels, NULL,
+                                 buf, slots[cur_slot]);
 
-    // Wait for the previous node to finish
-    while(work > (cur_producer.load() + 1)) {
-      usleep(10);
+      // Mark the node as done, no need to wait for other producers
+      slots[cur_slot].seq.store(i, std::memory_order_release);
+      wait_wake(slots[cur_slot].wait);
     }
-    
-    // Mark our work as done
-    cur_producer.fetch_add(count);
   }
   return 0;
 }
 
-int create_label(uint32_t* parents_cache, uint8_t*  replica_id,
-                 uint32_t* layer_labels,
-                 uint32_t* exp_labels, // NULL for layer0
-                 uint64_t  num_nodes,     uint32_t  cur_layer) {
-  size_t lookahead;
-  size_t num_producers;
-  size_t producer_stride;
-  if (cur_layer == 1) {
-    lookahead       = 400;
-    num_producers   = 1;    // Number of producer threads
-    producer_stride = 16;   // Producers work on groups of nodes
-  } else {
-    lookahead       = 800;
-    num_producers   = 2;    // Number of producer threads
-    producer_stride = 128;  // Producers work on groups of nodes
+// Producer for layers 2 and up when the previous layer is only on disk.
+// Claims stride sized groups of nodes up to gather_lookahead nodes ahead
+// of the one it is filling and queues reads of their expander parents, so
+// the SSD latency overlaps with filling. Groups are filled in claim order,
+// which keeps the lowest unfilled node at the head of some producer.
+// When the file can't be read the producer sets failed and from then on
+// hands its nodes to the consumer unfilled, so neither side waits forever.
+// The consumer stops at the first node after failed is set.
+template<typename PARENTS>
+int create_label_runner_gather(PARENTS parents,
+                               uint32_t* const* layer_labels,
+                               int exp_fd,
+                               uint64_t num_nodes,
+                               std::atomic<uint64_t> &cur_consumer,
+                               std::atomic<uint64_t> &cur_awaiting,
+                               size_t stride,
+                               uint64_t lookahead,
+                               size_t gather_lookahead,
+                               uint8_t *ring_buf,
+                               ring_slot_t *slots,
+                               wait_counter_t &consumer_wait,
+                               label_wait_policy_t policy,
+                               std::atomic<uint64_t> &gather_reads,
+                               std::atomic<uint64_t> &gather_hits,
+                               std::atomic<bool> &failed,
+                               label_stats_t &stats) {
+  const size_t bytes_per_node = (NODE_SIZE * PARENT_COUNT) + 64;
+  const size_t exp_bytes      = NODE_SIZE * PARENT_COUNT_EXP;
+  const size_t depth = std::max(gather_lookahead / stride, (size_t)1);
+  auto reader = parents_reader(parents);
+
+  layer_gather gather;
+  bool gather_failed = gather.init(exp_fd) != 0;
+  if (gather_failed) {
+    fprintf(stderr, "ERROR - gather setup failed\n");
+    failed = true;
+  }
+
+  // Claimed groups, a ring of depth entries
+  struct group_t {
+    uint64_t first;
+    uint64_t count;
+    unsigned pending;   // Reads not completed yet
+  };
+  std::vector<group_t>  groups(depth);
+  std::vector<uint32_t> group_parents(depth * stride * PARENT_COUNT);
+  std::vector<uint8_t>  group_exp(depth * stride * exp_bytes);
+  size_t head = 0;
+  size_t tail = 0;
+  bool   claimed_all = false;
+
+  while (true) {
+    // Keep the window full
+    while (!claimed_all && tail - head < depth) {
+      uint64_t work = cur_awaiting.fetch_add(stride);
+      if (work >= num_nodes) {
+        claimed_all = true;
+        break;
+      }
+      size_t g = tail % depth;
+      groups[g] = { work, std::min(stride, num_nodes - work), 0 };
+      for (size_t s = 0; s < groups[g].count; s++) {
+        uint32_t* node_parents =
+          &group_parents[(g * stride + s) * PARENT_COUNT];
+        const uint32_t* p = reader.get(work + s, node_parents, true);
+        if (p != node_parents) {
+          std::memcpy(node_parents, p, PARENT_COUNT * sizeof(uint32_t));
+        }
+        uint8_t* exp_data = &group_exp[(g * stride + s) * exp_bytes];
+        for (size_t k = 0; k < PARENT_COUNT_EXP && !gather_failed; k++) {
+          gather_failed = gather.request(node_parents[PARENT_COUNT_BASE + k],
+                                         exp_data + k * NODE_SIZE,
+                                         &groups[g].pending) != 0;
+        }
+      }
+      gather_failed = gather_failed || gather.submit() != 0;
+      tail++;
+    }
+    if (head == tail) {
+      break;
+    }
+
+    // Fill the oldest group once its reads are in
+    size_t g = head % depth;
+    gather_failed = gather_failed || gather.wait(&groups[g].pending) != 0;
+    if (gather_failed && !failed.load(std::memory_order_relaxed)) {
+      failed = true;
+    }
+    for (size_t s = 0; s < groups[g].count; s++) {
+      uint64_t i = groups[g].first + s;
+      uint32_t cur_slot = (i - 1) % lookahead;
+      wait_ring_space(consumer_wait, policy, i, lookahead, stats);
+      uint8_t *buf = ring_buf + cur_slot * bytes_per_node;
+      if (!gather_failed) {
+        fill_buffer<false, 1>(i, cur_consumer,
+                              &group_parents[(g * stride + s) * PARENT_COUNT],
+                              layer_labels, NULL,
+                              &group_exp[(g * stride + s) * exp_bytes],
+                              buf, slots[cur_slot]);
+      }
+      slots[cur_slot].seq.store(i, std::memory_order_release);
+      wait_wake(slots[cur_slot].wait);
+    }
+    head++;
+  }
+
+  gather_reads += gather.reads;
+  gather_hits  += gather.hits;
+  return gather_failed;
+}
+
+// Labels LANES sectors in lockstep. Every lane walks the same parents cache
+// so producers fill one ring slot per node with the parent data of each lane
+// and the consumer hashes all lanes together. Specialized on the layer kind
+// so the hot loop is free of runtime layer checks.
+// Labeling starts at start_node, nodes below it must already hold their
+// final labels (resuming from a checkpoint).
+template<bool LAYER1, size_t LANES, typename PARENTS>
+int create_label_lanes(PARENTS parents, uint8_t* const* replica_ids,
+                       uint32_t* const* layer_labels,
+                       uint32_t* const* exp_labels, // NULL for layer0
+                       int       exp_fd,  // Previous layer file or -1
+                       uint64_t  num_nodes,     uint32_t  cur_layer,
+                       std::atomic<uint64_t>* progress,
+                       uint64_t  start_node) {
+  if (start_node >= num_nodes) {
+    if (progress != NULL) {
+      progress->store(num_nodes, std::memory_order_release);
+    }
+    return 0;
+  }
+
+  const label_params_t params = get_label_params(LAYER1);
+  size_t lookahead       = params.lookahead;      // Ring buffer slots
+  size_t num_producers   = params.num_producers;  // Producer threads
+  size_t producer_stride = params.producer_stride; // Nodes claimed at a time
+  // Each producer copies parents for every lane, scale to keep up
+  if (LANES >= 8) {
+    num_producers *= LANES / 4;
+  }
+  if (!LAYER1) {
+    num_producers *= producer_scale(parents);
   }
   const size_t bytes_per_node = (NODE_SIZE * PARENT_COUNT) + 64;
+  const size_t bytes_per_slot = bytes_per_node * LANES;
+
+#ifdef LABEL_METRICS
+  // Before the producers start so the counters inherit to them
+  auto          layer_start = std::chrono::steady_clock::now();
+  perf_counters layer_counters;
+  bool          has_perf = get_label_metrics_perf() &&
+                           layer_counters.start(true) == 0;
+#endif
+
+  // Page aligned and zeroed, so it can be bound next to the consumer
+  const size_t ring_buf_size = lookahead * bytes_per_slot;
+  uint8_t *ring_buf = (uint8_t *)mmap(NULL, ring_buf_size,
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring_buf == MAP_FAILED) {
+    fprintf(stderr, "mmap ring_buf failed err %s\n", strerror(errno));
+    return 1;
+  }
 
-  uint8_t *ring_buf = new uint8_t[lookahead * bytes_per_node];
-  uint32_t *base_parent_missing = new uint32_t[lookahead];
+  // The calling thread is the consumer, pinned for the duration of the layer
+  const label_placement_t* placement = label_placement;
+  const std::atomic<bool>* cancel    = label_cancel;
+  cpu_set_t saved_affinity;
+  if (placement != NULL &&
+      pin_thread_to_cpu(placement->consumer_cpu, &saved_affinity) != 0) {
+    placement = NULL;
+  }
+  if (placement != NULL) {
+    bind_memory_to_node(ring_buf, ring_buf_size, placement->numa_node);
+  }
+
+  ring_slot_t *slots = new ring_slot_t[lookahead];
+  for (size_t i = 0; i < lookahead; i++) {
+    slots[i].seq                 = 0;
+    slots[i].wait.counter        = &slots[i].seq;
+    slots[i].wait.sleepers       = 0;
+    slots[i].base_parent_missing = 0;
+  }
   
   // Fill in the fixed portion of all buffers
-  for (size_t i = 0; i < lookahead; i++) {
+  for (size_t i = 0; i < lookahead * LANES; i++) {
     uint8_t *buf = ring_buf + i * bytes_per_node;
-    std::memcpy(buf, replica_id, 32);
+    std::memcpy(buf, replica_ids[i % LANES], 32);
     buf[35]  = (uint8_t)(cur_layer & 0xFF);
     buf[64]  = 0x80; // Padding
     buf[126] = 0x02; // Length (512 bits == 64B)
   }
 
+  // Node 0 has no parents and is hashed here, producers start at node 1
+  const uint64_t first_node = start_node == 0 ? 1 : start_node;
+
   // Node the consumer is currently working on
-  std::atomic<uint64_t> cur_consumer(0);
-  // Highest node that is ready from the producer
-  std::atomic<uint64_t> cur_producer(0);
+  std::atomic<uint64_t> cur_consumer(first_node - 1);
   // Next node to be filled
-  std::atomic<uint64_t> cur_awaiting(1);
+  std::atomic<uint64_t> cur_awaiting(first_node);
 
+  const label_wait_policy_t policy = label_wait_policy;
+  wait_counter_t consumer_wait = { &cur_consumer, {0} };
+  label_stats = label_stats_t();
+  const size_t gather_lookahead = label_gather_lookahead;
+  const size_t exp_prefetch     = label_exp_prefetch;
+  std::atomic<uint64_t> gather_reads(0);
+  std::atomic<uint64_t> gather_hits(0);
+  // Set by a gather producer that can't read the previous layer
+  std::atomic<bool>     gather_failed(false);
+  // Backpressure waits of each producer
+  std::vector<label_stats_t> producer_stats(num_producers);
+
+  // Producers claim their nodes, so the layer finishes with any that
+  // start. Without one it fails, drained like a cancel.
   std::thread runners[num_producers];
-  for (size_t i = 0; i < num_producers; i++) {
-    runners[i] = std::thread([&]() {
-      create_label_runner(parents_cache, layer_labels, exp_labels,
-                          num_nodes,
-                          cur_consumer, cur_producer, cur_awaiting,
-                          producer_stride, lookahead,
-                          ring_buf, base_parent_missing,
-                          cur_layer == 1);
-    });
+  size_t started = 0;
+  try {
+    for (size_t i = 0; i < num_producers; i++, started++) {
+      runners[i] = std::thread([&, i]() {
+        if (placement != NULL && !placement->producer_cpus.empty()) {
+          pin_thread_to_cpu(placement->producer_cpus[
+            i % placement->producer_cpus.size()]);
+        }
+        if constexpr (!LAYER1 && LANES == 1) {
+          if (exp_fd >= 0) {
+            create_label_runner_gather(parents, layer_labels, exp_fd,
+                                       num_nodes,
+                                       cur_consumer, cur_awaiting,
+                                       producer_stride, lookahead,
+                                       gather_lookahead,
+                                       ring_buf, slots,
+                                       consumer_wait, policy,
+                                       gather_reads, gather_hits,
+                                       gather_failed, producer_stats[i]);
+            return;
+          }
+        }
+        create_label_runner<LAYER1, LANES>(parents,
+                                           layer_labels, exp_labels,
+                                           num_nodes,
+                                           cur_consumer, cur_awaiting,
+                                           producer_stride, lookahead,
+                                           ring_buf, slots,
+                                           consumer_wait, policy,
+                                           exp_prefetch, producer_stats[i]);
+      });
+    }
+  } catch (const std::system_error& e) {
+    fprintf(stderr, "ERROR - starting producer %ld failed err %s\n", started,
+            e.what());
   }
+  const bool no_producers = started == 0;
 
-  uint32_t* cur_node_ptr   = layer_labels;
-  uint32_t* cur_parent_ptr = parents_cache + PARENT_COUNT;
+  uint32_t* cur_node_ptrs[LANES];
+  uint8_t* node_bufs[LANES];
 
   // Calculate node 0 (special case with no parents)
-  // Which is replica_id || cur_layer || 0
-  // TODO - Hash and save intermediate result: replica_id || cur_layer
-  uint8_t buf[(NODE_SIZE * PARENT_COUNT) + 64] = {0};
-  std::memcpy(buf, replica_id, 32);
-  buf[35]  = (uint8_t)(cur_layer & 0xFF);
-  buf[64]  = 0x80; // Padding
-  buf[126] = 0x02; // Length (512 bits == 64B)
-
-  std::memcpy(cur_node_ptr, SHA256_INITIAL_DIGEST, 32);
-  blst_sha256_block(cur_node_ptr, buf, 2);
-
-  // Fix endianess
-  blst_sha256_emit((uint8_t*)cur_node_ptr, cur_node_ptr);
-  cur_node_ptr[7] &= 0x3FFFFFFF; // Strip last two bits to ensure in Fr
-  #ifdef PRINT_DIGEST_DEBUG
-  if (cur_layer <= 2) {
-    print_digest(cur_node_ptr);
+  for (size_t l = 0; l < LANES; l++) {
+    if (start_node > 0) {
+      // Resuming, points at the last finished node
+      cur_node_ptrs[l] = layer_labels[l] + (start_node - 1) * NODE_WORDS;
+      continue;
+    }
+    uint32_t* cur_node_ptr = layer_labels[l];
+    hash_first_node(replica_ids[l], cur_layer, cur_node_ptr);
+    #ifdef PRINT_DIGEST_DEBUG
+    if (cur_layer <= 2 && l == 0) {
+      print_digest(cur_node_ptr);
+    }
+    #endif
+    cur_node_ptrs[l] = cur_node_ptr;
   }
-  #endif
 
   // Keep track of which node slot in the ring_buffer to use
-  uint32_t cur_slot = 0;
+  uint32_t cur_slot = (first_node - 1) % lookahead;
   size_t count_not_ready = 0;
+#ifdef LABEL_METRICS
+  uint64_t base_parents_missing = 0;
+#endif
   
   // Calculate nodes 1 to n
-  cur_consumer = 1;
-  uint64_t i = 1;
-  while(i < num_nodes) {
+  cur_consumer = first_node;
+  uint64_t i = first_node;
+  while(!no_producers && i < num_nodes) {
     // Ensure next buffer is ready
-    bool printed = false;
-    uint64_t producer_val;
-    while ((producer_val = cur_producer.load()) < i) {
-      if (!printed) {
-        printf("PRODUCER NOT READY! %ld\n", i);
-        printed = true;
-        count_not_ready++;
-      }
-      usleep(10);
+    if (slots[cur_slot].seq.load(std::memory_order_acquire) != i) {
+      count_not_ready++;
+
+      auto start = std::chrono::steady_clock::now();
+      wait_until(slots[cur_slot].wait, policy, [&](uint64_t seq) {
+        return seq == i;
+      });
+      record_wait(label_stats.wait_hist, label_stats.wait_ns, start);
     }
 
-    // Process as many nodes as are ready
-    size_t ready_count = producer_val - i + 1;
-    for(size_t count = 0; count < ready_count; count++) {
-      cur_node_ptr += 8;
-      uint8_t *buf = ring_buf + cur_slot * bytes_per_node;
+    // Process as many nodes as are ready, up to a ring's worth between
+    // progress updates
+    for (size_t count = 0; count < lookahead; count++) {
+      if (i >= num_nodes ||
+          slots[cur_slot].seq.load(std::memory_order_acquire) != i) {
+        break;
+      }
+      // Failed gathers publish their nodes unfilled, after setting the flag
+      if (!LAYER1 && gather_failed.load(std::memory_order_relaxed)) {
+        break;
+      }
+      uint8_t *buf = ring_buf + cur_slot * bytes_per_slot;
+      for (size_t l = 0; l < LANES; l++) {
+        cur_node_ptrs[l] += 8;
+        node_bufs[l] = buf + l * bytes_per_node;
+      }
     
       // Fill in the base parents
+#ifdef LABEL_METRICS
+      base_parents_missing +=
+        __builtin_popcount(slots[cur_slot].base_parent_missing);
+#endif
       for (size_t k = 0; k < PARENT_COUNT_BASE; ++k) {
-        if ((base_parent_missing[cur_slot] & (1 << k)) != 0) {
-          std::memcpy(buf + 64 + (NODE_SIZE * k),
-                      layer_labels + ((*cur_parent_ptr) * 8),
-                      NODE_SIZE);
+        if ((slots[cur_slot].base_parent_missing & (1 << k)) != 0) {
+          uint32_t parent = slots[cur_slot].base_parents[k];
+          for (size_t l = 0; l < LANES; l++) {
+            std::memcpy(buf + l * bytes_per_node + 64 + (NODE_SIZE * k),
+                        layer_labels[l] + (parent * 8),
+                        NODE_SIZE);
+          }
         }
-        cur_parent_ptr++;
       }
-      
+
       // Expanders are already all filled in (layer 1 doesn't use expanders)
-      cur_parent_ptr += PARENT_COUNT_EXP;
-      
-      if (cur_layer == 1) {
-        // Six rounds of all base parents
-        for (size_t j = 0; j < 6; ++j) {
-          blst_sha256_block(cur_node_ptr, buf + 64, 3);
-        }
-        
-        // round 7 is only first parent
-        std::memset(buf + 96, 0, 32); // Zero out upper half of last block
-        buf[96]  = 0x80;            // Padding
-        buf[126] = 0x27;            // Length (0x2700 = 9984 bits -> 1248 bytes)
-        blst_sha256_block(cur_node_ptr, buf + 64, 1);
-      } else {
-        // Two rounds of all parents
-        blst_sha256_block(cur_node_ptr, buf + 64, 7);
-        blst_sha256_block(cur_node_ptr, buf + 64, 7);
-        
-        // Final round is only nine parents
-        std::memset(buf + 352, 0, 32); // Zero out upper half of last block
-        buf[352] = 0x80;             // Padding
-        buf[382] = 0x27;             // Length (0x2700 = 9984 bits -> 1248 bytes)
-        blst_sha256_block(cur_node_ptr, buf + 64, 5);
-      }
-      
-      // Fix endianess
-      blst_sha256_emit((uint8_t*)cur_node_ptr, cur_node_ptr);
-      cur_node_ptr[7] &= 0x3FFFFFFF; // Strip last two bits to fit in Fr
+      hash_label_rounds<LAYER1, LANES>(cur_node_ptrs, node_bufs);
 #ifdef PRINT_DIGEST_DEBUG
       if (cur_layer <= 2) {
-        print_digest(cur_node_ptr);
+        print_digest(cur_node_ptrs[0]);
       }
 #endif
 
       cur_consumer++;
+      wait_wake(consumer_wait);
       i++;
       cur_slot = (cur_slot + 1) % lookahead;
     }
+
+    // Nodes before i are final
+    if (progress != NULL) {
+      progress->store(i, std::memory_order_release);
+    }
+    if ((cancel != NULL && cancel->load(std::memory_order_relaxed)) ||
+        (!LAYER1 && gather_failed.load(std::memory_order_relaxed))) {
+      break;
+    }
+  }
+
+  // Cancelled or failed: stop further claims and take the nodes the
+  // producers hold, unhashed, so they can finish
+  const bool cancelled = i < num_nodes;
+  if (cancelled) {
+    uint64_t claimed = std::min(cur_awaiting.exchange(num_nodes), num_nodes);
+    for (; i < claimed; i++) {
+      wait_until(slots[cur_slot].wait, policy, [&](uint64_t seq) {
+        return seq == i;
+      });
+      cur_consumer++;
+      wait_wake(consumer_wait);
+      cur_slot = (cur_slot + 1) % lookahead;
+    }
   }
 
+  // Also in get_label_stats, printed by the debug build only
+#ifdef PRINT_DIGEST_DEBUG
   printf("Count of producer not ready %ld\n", count_not_ready);
+#endif
+  label_stats.producer_not_ready = count_not_ready;
   
-  for (size_t i = 0; i < num_producers; i++) {
+  for (size_t i = 0; i < started; i++) {
     runners[i].join();
   }
-  delete [] ring_buf;
-  delete [] base_parent_missing;
+  label_stats.gather_reads = gather_reads;
+  label_stats.gather_hits  = gather_hits;
 
-  return 0;
+#ifdef LABEL_METRICS
+  for (const label_stats_t& stats : producer_stats) {
+    label_stats.producer_waits  += stats.producer_waits;
+    label_stats.backpressure_ns += stats.backpressure_ns;
+    for (size_t b = 0; b < WAIT_HIST_BUCKETS; b++) {
+      label_stats.backpressure_hist[b] += stats.backpressure_hist[b];
+    }
+  }
+  label_stats.base_parents         = (num_nodes - first_node) *
+                                     PARENT_COUNT_BASE;
+  label_stats.base_parents_missing = base_parents_missing;
+
+  layer_metrics_t metrics = {};
+  metrics.layer    = cur_layer;
+  metrics.lanes    = LANES;
+  metrics.nodes    = num_nodes - start_node;
+  metrics.seconds  = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - layer_start).count();
+  metrics.stats    = label_stats;
+  metrics.has_perf = has_perf;
+  if (has_perf) {
+    layer_counters.stop();
+    for (size_t c = 0; c < PERF_COUNTER_COUNT; c++) {
+      metrics.perf[c] = layer_counters.read((perf_counter_t)c);
+    }
+  }
+  record_layer_metrics(metrics);
+#endif
+  munmap(ring_buf, ring_buf_size);
+  if (placement != NULL) {
+    restore_thread_affinity(saved_affinity);
+  }
+  delete [] slots;
+
+  if (gather_failed || no_producers) {
+    return 1;
+  }
+  return cancelled ? LABEL_CANCELLED : 0;
+}
+
+// Layer 1 without producer threads. Its only parents are base parents of
+// the same layer, all final by the time the consumer reaches a node, so the
+// consumer copies them itself. The parents of the node prefetch nodes ahead
+// are decoded and their labels prefetched, which hides the misses on the
+// far ones. Needs one core instead of a consumer and producer pair, and no
+// ring buffer or handshakes.
+template<size_t LANES, typename PARENTS>
+int create_label_layer1_inline(PARENTS parents, uint8_t* const* replica_ids,
+                               uint32_t* const* layer_labels,
+                               uint64_t  num_nodes,     uint32_t  cur_layer,
+                               std::atomic<uint64_t>* progress,
+                               uint64_t  start_node) {
+  if (start_node >= num_nodes) {
+    if (progress != NULL) {
+      progress->store(num_nodes, std::memory_order_release);
+    }
+    return 0;
+  }
+
+#ifdef LABEL_METRICS
+  auto          layer_start = std::chrono::steady_clock::now();
+  perf_counters layer_counters;
+  bool          has_perf = get_label_metrics_perf() &&
+                           layer_counters.start(true) == 0;
+#endif
+
+  const label_placement_t* placement = label_placement;
+  const std::atomic<bool>* cancel    = label_cancel;
+  cpu_set_t saved_affinity;
+  if (placement != NULL &&
+      pin_thread_to_cpu(placement->consumer_cpu, &saved_affinity) != 0) {
+    placement = NULL;
+  }
+  label_stats = label_stats_t();
+
+  // Fixed portion of the node buffers
+  const size_t bytes_per_node = (NODE_SIZE * PARENT_COUNT) + 64;
+  alignas(64) uint8_t bufs[LANES][bytes_per_node];
+  uint32_t*      h[LANES];
+  uint8_t*       node_bufs[LANES];
+  const uint8_t* first_blocks[LANES];
+  for (size_t l = 0; l < LANES; l++) {
+    std::memset(bufs[l], 0, bytes_per_node);
+    std::memcpy(bufs[l], replica_ids[l], 32);
+    bufs[l][35]  = (uint8_t)(cur_layer & 0xFF);
+    node_bufs[l]    = bufs[l];
+    first_blocks[l] = bufs[l];
+  }
+
+  if (start_node == 0) {
+    for (size_t l = 0; l < LANES; l++) {
+      hash_first_node(replica_ids[l], cur_layer, layer_labels[l]);
+    }
+#ifdef PRINT_DIGEST_DEBUG
+    if (cur_layer <= 2) {
+      print_digest(layer_labels[0]);
+    }
+#endif
+  }
+  const uint64_t first_node = start_node == 0 ? 1 : start_node;
+
+  // Base parents of the nodes up to prefetch ahead, a ring indexed by node
+  const size_t prefetch = label_layer1_prefetch;
+  auto reader = parents_reader(parents);
+  std::vector<uint32_t> ahead((prefetch + 1) * PARENT_COUNT);
+  auto decode = [&](uint64_t node) {
+    uint32_t* dst = &ahead[(node % (prefetch + 1)) * PARENT_COUNT];
+    const uint32_t* p = reader.get(node, dst, false);
+    if (p != dst) {
+      std::memcpy(dst, p, PARENT_COUNT_BASE * sizeof(uint32_t));
+    }
+    // The predecessor, still in cache, is the last base parent in V1_0
+    // caches and the first in V1_1. Skip whichever end holds it, a random
+    // parent there can only be the predecessor again.
+    const size_t predecessor = dst[0] == node - 1 ? 0 : PARENT_COUNT_BASE - 1;
+    for (size_t k = 0; k < PARENT_COUNT_BASE; k++) {
+      if (k == predecessor) {
+        continue;
+      }
+      for (size_t l = 0; l < LANES; l++) {
+        __builtin_prefetch(layer_labels[l] + dst[k] * NODE_WORDS, 0, 3);
+      }
+    }
+  };
+  for (uint64_t n = first_node;
+       n < std::min(first_node + prefetch, num_nodes); n++) {
+    decode(n);
+  }
+
+  uint64_t end = num_nodes;   // Below the cancel point when cancelled
+  for (uint64_t i = first_node; i < num_nodes; i++) {
+    if (i + prefetch < num_nodes) {
+      decode(i + prefetch);
+    }
+    const uint32_t* cur_parents = &ahead[(i % (prefetch + 1)) * PARENT_COUNT];
+
+    uint64_t cur_node_swap = bswap_64(i); // Note switch to big endian
+    for (size_t l = 0; l < LANES; l++) {
+      std::memcpy(bufs[l] + 36, &cur_node_swap, 8);
+      h[l] = layer_labels[l] + i * NODE_WORDS;
+      std::memcpy(h[l], SHA256_INITIAL_DIGEST, 32);
+    }
+    sha256_block_lanes<LANES>(h, first_blocks, 1);
+
+    for (size_t k = 0; k < PARENT_COUNT_BASE; k++) {
+      for (size_t l = 0; l < LANES; l++) {
+        std::memcpy(bufs[l] + 64 + NODE_SIZE * k,
+                    layer_labels[l] + cur_parents[k] * NODE_WORDS,
+                    NODE_SIZE);
+      }
+    }
+    hash_label_rounds<true, LANES>(h, node_bufs);
+#ifdef PRINT_DIGEST_DEBUG
+    if (cur_layer <= 2) {
+      print_digest(h[0]);
+    }
+#endif
+
+    // Nodes up to i are final
+    if ((i + 1) % LABEL_LAYER1_PROGRESS == 0) {
+      if (progress != NULL) {
+        progress->store(i + 1, std::memory_order_release);
+      }
+      if (cancel != NULL && cancel->load(std::memory_order_relaxed) &&
+          i + 1 < num_nodes) {
+        end = i + 1;
+        break;
+      }
+    }
+  }
+  if (progress != NULL) {
+    progress->store(end, std::memory_order_release);
+  }
+
+#ifdef LABEL_METRICS
+  // Every base parent is gathered by the consumer
+  label_stats.base_parents         = (end - first_node) *
+                                     PARENT_COUNT_BASE;
+  label_stats.base_parents_missing = label_stats.base_parents;
+
+  layer_metrics_t metrics = {};
+  metrics.layer    = cur_layer;
+  metrics.lanes    = LANES;
+  metrics.nodes    = end - start_node;
+  metrics.seconds  = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - layer_start).count();
+  metrics.stats    = label_stats;
+  metrics.has_perf = has_perf;
+  if (has_perf) {
+    layer_counters.stop();
+    for (size_t c = 0; c < PERF_COUNTER_COUNT; c++) {
+      metrics.perf[c] = layer_counters.read((perf_counter_t)c);
+    }
+  }
+  record_layer_metrics(metrics);
+#endif
+  if (placement != NULL) {
+    restore_thread_affinity(saved_affinity);
+  }
+  return end < num_nodes ? LABEL_CANCELLED : 0;
+}
+
+// Pick the layer kind specialization
+template<size_t LANES, typename PARENTS>
+int create_label_dispatch(const sector_config_t& config,
+                          PARENTS parents, uint8_t* const* replica_ids,
+                          uint32_t* const* layer_labels,
+                          uint32_t* const* exp_labels,
+                          int       exp_fd,
+                          uint64_t  num_nodes,     uint32_t  cur_layer,
+                          std::atomic<uint64_t>* progress,
+                          uint64_t  start_node) {
+  if (num_nodes > config.node_count) {
+    fprintf(stderr, "ERROR - %ld nodes exceeds sector node count %ld\n",
+            num_nodes, config.node_count);
+    return 1;
+  }
+  if (cur_layer == 1 && get_label_params(true).num_producers == 0) {
+    return create_label_layer1_inline<LANES>(
+      parents, replica_ids, layer_labels, num_nodes, cur_layer, progress,
+      start_node);
+  }
+  if (cur_layer == 1) {
+    return create_label_lanes<true, LANES>(
+      parents, replica_ids, layer_labels, exp_labels, exp_fd,
+      num_nodes, cur_layer, progress, start_node);
+  }
+  return create_label_lanes<false, LANES>(
+    parents, replica_ids, layer_labels, exp_labels, exp_fd,
+    num_nodes, cur_layer, progress, start_node);
+}
+
+void fill_label_buffers(const uint32_t* parents_cache,
+                        uint32_t* layer_labels, uint32_t* exp_labels,
+                        uint64_t  first_node,   uint64_t  count) {
+  const size_t bytes_per_node = (NODE_SIZE * PARENT_COUNT) + 64;
+  alignas(64) uint8_t buf[bytes_per_node] = {0};
+  buf[64]  = 0x80; // Padding
+  buf[126] = 0x02; // Length (512 bits == 64B)
+
+  // Every parent counts as consumed
+  std::atomic<uint64_t> cur_consumer(first_node + count);
+  ring_slot_t slot;
+  uint32_t* const layers[1] = { layer_labels };
+  uint32_t* const exps[1]   = { exp_labels };
+  for (uint64_t i = first_node; i < first_node + count; i++) {
+    const uint32_t* parents = parents_cache + i * PARENT_COUNT;
+    if (exp_labels == NULL) {
+      fill_buffer<true, 1>(i, cur_consumer, parents, layers, NULL, NULL,
+                           buf, slot);
+    } else {
+      fill_buffer<false, 1>(i, cur_consumer, parents, layers, exps, NULL,
+                            buf, slot);
+    }
+  }
+}
+
+void compute_labels(const uint8_t* replica_id, uint32_t cur_layer,
+                    const uint32_t* layer_labels, const uint32_t* exp_labels,
+                    const uint64_t* nodes, const uint32_t* const* parents,
+                    size_t count, uint32_t* labels) {
+  const size_t bytes_per_node = (NODE_SIZE * PARENT_COUNT) + 64;
+  alignas(64) uint8_t bufs[SHA256_MULTI_MAX_LANES][bytes_per_node];
+  uint32_t*      h[SHA256_MULTI_MAX_LANES]            = {NULL};
+  uint8_t*       node_bufs[SHA256_MULTI_MAX_LANES]    = {NULL};
+  const uint8_t* first_blocks[SHA256_MULTI_MAX_LANES] = {NULL};
+  size_t         lanes = 0;
+
+  for (size_t n = 0; n < std::min(count, SHA256_MULTI_MAX_LANES); n++) {
+    uint8_t*  buf   = bufs[lanes];
+    uint32_t* label = labels + n * NODE_WORDS;
+    uint64_t  node_swap = bswap_64(nodes[n]); // Note switch to big endian
+    std::memset(buf, 0, 64);
+    std::memcpy(buf, replica_id, 32);
+    buf[35] = (uint8_t)(cur_layer & 0xFF);
+    std::memcpy(buf + 36, &node_swap, 8);
+    std::memcpy(label, SHA256_INITIAL_DIGEST, 32);
+
+    if (nodes[n] == 0) {
+      hash_first_node(replica_id, cur_layer, label);
+      continue;
+    }
+
+    // Labels of a finished layer, every parent is final
+    size_t parent_count = cur_layer == 1 ? PARENT_COUNT_BASE : PARENT_COUNT;
+    for (size_t k = 0; k < parent_count; k++) {
+      const uint32_t* src = k < PARENT_COUNT_BASE ? layer_labels : exp_labels;
+      std::memcpy(buf + 64 + NODE_SIZE * k, src + parents[n][k] * NODE_WORDS,
+                  NODE_SIZE);
+    }
+    h[lanes]            = label;
+    node_bufs[lanes]    = buf;
+    first_blocks[lanes] = buf;
+    lanes++;
+  }
+
+  if (lanes == 0) {
+    return;
+  }
+  sha256_block_lanes<SHA256_MULTI_MAX_LANES>(h, first_blocks, 1, lanes);
+  if (cur_layer == 1) {
+    hash_label_rounds<true, SHA256_MULTI_MAX_LANES>(h, node_bufs, lanes);
+  } else {
+    hash_label_rounds<false, SHA256_MULTI_MAX_LANES>(h, node_bufs, lanes);
+  }
+}
+
+int create_label(const sector_config_t& config,
+                 uint32_t* parents_cache, uint8_t*  replica_id,
+                 uint32_t* layer_labels,
+                 uint32_t* exp_labels, // NULL for layer0
+                 uint64_t  num_nodes,     uint32_t  cur_layer,
+                 std::atomic<uint64_t>* progress,
+                 uint64_t  start_node) {
+  return create_label_dispatch<1>(config, (const uint32_t*)parents_cache,
+                                  &replica_id, &layer_labels, &exp_labels, -1,
+                                  num_nodes, cur_layer, progress, start_node);
+}
+
+int create_label(const sector_config_t& config,
+                 const compact_parents& parents, uint8_t* replica_id,
+                 uint32_t* layer_labels,
+                 uint32_t* exp_labels, // NULL for layer0
+                 uint64_t  num_nodes,     uint32_t  cur_layer,
+                 std::atomic<uint64_t>* progress,
+                 uint64_t  start_node) {
+  return create_label_dispatch<1>(config, &parents,
+                                  &replica_id, &layer_labels, &exp_labels, -1,
+                                  num_nodes, cur_layer, progress, start_node);
+}
+
+int create_label_file(const sector_config_t& config,
+                      uint32_t* parents_cache, uint8_t* replica_id,
+                      uint32_t* layer_labels,  int exp_fd,
+                      uint64_t  num_nodes,     uint32_t  cur_layer,
+                      std::atomic<uint64_t>* progress,
+                      uint64_t  start_node) {
+  uint32_t* exp_labels = NULL;
+  return create_label_dispatch<1>(config, (const uint32_t*)parents_cache,
+                                  &replica_id, &layer_labels, &exp_labels,
+                                  exp_fd, num_nodes, cur_layer, progress,
+                                  start_node);
+}
+
+int create_label_file(const sector_config_t& config,
+                      const compact_parents& parents, uint8_t* replica_id,
+                      uint32_t* layer_labels,  int exp_fd,
+                      uint64_t  num_nodes,     uint32_t  cur_layer,
+                      std::atomic<uint64_t>* progress,
+                      uint64_t  start_node) {
+  uint32_t* exp_labels = NULL;
+  return create_label_dispatch<1>(config, &parents,
+                                  &replica_id, &layer_labels, &exp_labels,
+                                  exp_fd, num_nodes, cur_layer, progress,
+                                  start_node);
+}
+
+// Pick the lane count specialization
+template<typename PARENTS>
+static int create_label_lanes_dispatch(const sector_config_t& config,
+                                       PARENTS parents, uint8_t** replica_ids,
+                                       uint32_t** layer_labels,
+                                       uint32_t** exp_labels,
+                                       size_t     lanes,
+                                       uint64_t   num_nodes,
+                                       uint32_t   cur_layer,
+                                       std::atomic<uint64_t>* progress) {
+  // Layer 1 has no expander parents, use a NULL array for every lane
+  uint32_t* no_exp_labels[SHA256_MULTI_MAX_LANES] = {NULL};
+  if (exp_labels == NULL) {
+    exp_labels = no_exp_labels;
+  }
+
+  switch (lanes) {
+  case 1:
+    return create_label_dispatch<1>(config, parents, replica_ids,
+                                    layer_labels, exp_labels, -1,
+                                    num_nodes, cur_layer, progress, 0);
+  case 4:
+    return create_label_dispatch<4>(config, parents, replica_ids,
+                                    layer_labels, exp_labels, -1,
+                                    num_nodes, cur_layer, progress, 0);
+  case 8:
+    return create_label_dispatch<8>(config, parents, replica_ids,
+                                    layer_labels, exp_labels, -1,
+                                    num_nodes, cur_layer, progress, 0);
+  case 16:
+    return create_label_dispatch<16>(config, parents, replica_ids,
+                                     layer_labels, exp_labels, -1,
+                                     num_nodes, cur_layer, progress, 0);
+  default:
+    fprintf(stderr, "ERROR - unsupported lane count %ld\n", lanes);
+    return 1;
+  }
+}
+
+int create_label_multi(const sector_config_t& config,
+                       uint32_t*  parents_cache, uint8_t** replica_ids,
+                       uint32_t** layer_labels,
+                       uint32_t** exp_labels, // NULL for layer0
+                       size_t     lanes,
+                       uint64_t   num_nodes,     uint32_t  cur_layer,
+                       std::atomic<uint64_t>* progress) {
+  return create_label_lanes_dispatch(config, (const uint32_t*)parents_cache,
+                                     replica_ids, layer_labels, exp_labels,
+                                     lanes, num_nodes, cur_layer, progress);
+}
+
+int create_label_multi(const sector_config_t& config,
+                       const compact_parents& parents, uint8_t** replica_ids,
+                       uint32_t** layer_labels,
+                       uint32_t** exp_labels, // NULL for layer0
+                       size_t     lanes,
+                       uint64_t   num_nodes,     uint32_t  cur_layer,
+                       std::atomic<uint64_t>* progress) {
+  return create_label_lanes_dispatch(config, &parents,
+                                     replica_ids, layer_labels, exp_labels,
+                                     lanes, num_nodes, cur_layer, progress);
 }
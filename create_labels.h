@@ -5,41 +5,246 @@
 #ifndef __CREATE_LABELS_H__
 #define __CREATE_LABELS_H__
 
-#if (defined(__x86_64__) || defined(__x86_64) || defined(_M_X64)) && \
-     defined(__SHA__)   /* -msha */
-# define blst_sha256_block blst_sha256_block_data_order_shaext
-#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
-# define blst_sha256_block blst_sha256_block_armv8
-#else
-# define blst_sha256_block blst_sha256_block_data_order
-#endif
-
-extern "C" {
-  void blst_sha256_block(uint32_t* h, const void* in, size_t blocks);
-  void blst_sha256_emit(uint8_t* md, const uint32_t* h);
-}
-
-//const size_t SECTOR_SIZE       = (1UL << 11); // 2K
-const size_t SECTOR_SIZE       = (1UL << 20) * 512; // 512M
-//const size_t SECTOR_SIZE       = (32UL << 30); // 32GB - 8:34
+#include <atomic>
+#include "sha256_dispatch.h"
+#include "wait_policy.h"
+#include "topology.h"
+
+// Supported sector sizes
+const size_t SECTOR_SIZE_2K    = (1UL << 11);       // 2K
+const size_t SECTOR_SIZE_8M    = (1UL << 20) * 8;   // 8M
+const size_t SECTOR_SIZE_512M  = (1UL << 20) * 512; // 512M
+const size_t SECTOR_SIZE_32G   = (32UL << 30);      // 32GB - 8:34
+const size_t SECTOR_SIZE_64G   = (64UL << 30);      // 64GB
 
 const size_t NODE_SIZE         = 32;
 const size_t NODE_WORDS        = NODE_SIZE / sizeof(uint32_t);
-const size_t NODE_COUNT        = SECTOR_SIZE / NODE_SIZE;
 const size_t PARENT_COUNT_BASE = 6;
 const size_t PARENT_COUNT_EXP  = 8;
 const size_t PARENT_COUNT      = PARENT_COUNT_BASE + PARENT_COUNT_EXP;
 const size_t PARENT_SIZE       = sizeof(uint32_t);
-const size_t PARENTS_SIZE      = NODE_COUNT * PARENT_COUNT * PARENT_SIZE;
-const size_t LAYER_COUNT       = 2;
+const size_t LAYER_COUNT       = 11;
+
+// Per sector size constants, selected at runtime
+struct sector_config_t {
+  size_t      sector_size;
+  size_t      node_count;             // sector_size / NODE_SIZE
+  size_t      parents_size;           // Bytes in the parents cache
+  const char* parents_cache_filename; // NULL if there is no lotus cache file
+};
+
+// Returns NULL for unsupported sector sizes
+const sector_config_t* get_sector_config(size_t sector_size);
 
-int create_label(uint32_t* parents_cache, uint8_t* replica_id,
+// Label one layer. If progress is set the count of finished nodes is
+// published there as the layer advances, all labels below it are final.
+// A non-zero start_node resumes a layer whose labels below start_node are
+// already in layer_labels.
+int create_label(const sector_config_t& config,
+                 uint32_t* parents_cache, uint8_t* replica_id,
                  uint32_t* layer_labels,  uint32_t* exp_labels,
-                 uint64_t  num_nodes,     uint32_t  cur_layer);
+                 uint64_t  num_nodes,     uint32_t  cur_layer,
+                 std::atomic<uint64_t>* progress = NULL,
+                 uint64_t  start_node = 0);
+
+class compact_parents;
+
+// Same with a compact parents cache, see compact_parents.h. Producers
+// decode the parents of each node as they fill the ring buffer.
+int create_label(const sector_config_t& config,
+                 const compact_parents& parents, uint8_t* replica_id,
+                 uint32_t* layer_labels,  uint32_t* exp_labels,
+                 uint64_t  num_nodes,     uint32_t  cur_layer,
+                 std::atomic<uint64_t>* progress = NULL,
+                 uint64_t  start_node = 0);
+
+// Low memory labeling of layers 2 and up: the previous layer is read from
+// exp_fd, its layer file (O_DIRECT where the filesystem allows), instead of
+// a resident exp_labels. Producers gather the expander parents
+// set_label_gather_lookahead nodes ahead through io_uring, see
+// layer_gather.h. The file has to hold the whole previous layer.
+int create_label_file(const sector_config_t& config,
+                      uint32_t* parents_cache, uint8_t* replica_id,
+                      uint32_t* layer_labels,  int exp_fd,
+                      uint64_t  num_nodes,     uint32_t  cur_layer,
+                      std::atomic<uint64_t>* progress = NULL,
+                      uint64_t  start_node = 0);
+
+int create_label_file(const sector_config_t& config,
+                      const compact_parents& parents, uint8_t* replica_id,
+                      uint32_t* layer_labels,  int exp_fd,
+                      uint64_t  num_nodes,     uint32_t  cur_layer,
+                      std::atomic<uint64_t>* progress = NULL,
+                      uint64_t  start_node = 0);
+
+// Label 'lanes' sectors (1, 4, 8 or 16) with different replica_ids in
+// lockstep. Arrays are indexed by lane, exp_labels is NULL for layer 1.
+int create_label_multi(const sector_config_t& config,
+                       uint32_t*  parents_cache, uint8_t** replica_ids,
+                       uint32_t** layer_labels,  uint32_t** exp_labels,
+                       size_t     lanes,
+                       uint64_t   num_nodes,     uint32_t  cur_layer,
+                       std::atomic<uint64_t>* progress = NULL);
+
+int create_label_multi(const sector_config_t& config,
+                       const compact_parents& parents, uint8_t** replica_ids,
+                       uint32_t** layer_labels,  uint32_t** exp_labels,
+                       size_t     lanes,
+                       uint64_t   num_nodes,     uint32_t  cur_layer,
+                       std::atomic<uint64_t>* progress = NULL);
+
+// Producer work alone, exposed for benchmarking: fill the ring buffer data
+// of nodes [first_node, first_node + count) one after the other, as if all
+// their base parents were labeled. Clobbers the labels of those nodes with
+// the first hash block. exp_labels is NULL for layer 1.
+void fill_label_buffers(const uint32_t* parents_cache,
+                        uint32_t* layer_labels, uint32_t* exp_labels,
+                        uint64_t  first_node,   uint64_t  count);
+
+// Recompute the labels of count nodes (at most SHA256_MULTI_MAX_LANES) of
+// a finished layer into labels, NODE_WORDS each. parents[i] are the
+// parents of nodes[i] in the flat cache order. The rounds are those of
+// create_label, with the base parents read from layer_labels and the
+// expander parents from exp_labels (NULL for layer 1). Nodes are hashed
+// together on the multi-buffer SHA-256 kernels.
+void compute_labels(const uint8_t* replica_id, uint32_t cur_layer,
+                    const uint32_t* layer_labels, const uint32_t* exp_labels,
+                    const uint64_t* nodes, const uint32_t* const* parents,
+                    size_t count, uint32_t* labels);
+
+// The set_label_* tunables below and set_huge_page_size are process wide,
+// shared by every sector and context. They may be changed from any thread
+// at any time, each layer reads them once as it starts.
+
+// Wait strategy of the producer and consumer threads, applies to labeling
+// started after the call. Defaults to WAIT_POLICY_ADAPTIVE.
+void set_label_wait_policy(label_wait_policy_t policy);
+
+// Nodes each producer reads ahead in create_label_file, applies to
+// labeling started after the call
+const size_t LABEL_GATHER_LOOKAHEAD = 2048;
+void set_label_gather_lookahead(size_t nodes);
+
+// Layers 2 and up: producers claim chunks of LABEL_EXP_CHUNK nodes and
+// prefetch the expander parents LABEL_EXP_PREFETCH nodes ahead of the one
+// they fill. Distance 0 disables prefetching. Applies to labeling started
+// after the call. The chunk is the producer_stride of label_params_t.
+const size_t LABEL_EXP_CHUNK    = 128;
+const size_t LABEL_EXP_PREFETCH = 16;
+void set_label_exp_prefetch(size_t chunk_nodes, size_t distance);
+
+const size_t WAIT_HIST_BUCKETS = 32;
 
-int setup_create_label_memory(uint32_t** parents_cache, uint32_t** layer_labels,
-                              uint32_t** exp_labels);
+struct label_stats_t {
+  uint64_t producer_not_ready;    // Times the consumer found its node unfilled
+  // Consumer wait times, bucket i counts waits of [2^i, 2^(i+1)) ns
+  uint64_t wait_hist[WAIT_HIST_BUCKETS];
+  uint64_t wait_ns;               // Sum of the consumer waits
+  uint64_t gather_reads;          // create_label_file pages read
+  uint64_t gather_hits;           // and expander parents found cached
+
+  // Only counted when built with -DLABEL_METRICS, see label_metrics.h
+  uint64_t producer_waits;        // Times a producer found the ring full
+  uint64_t backpressure_hist[WAIT_HIST_BUCKETS]; // Their wait times
+  uint64_t backpressure_ns;
+  uint64_t base_parents;          // Base parents of the labeled nodes
+  uint64_t base_parents_missing;  // of which producers left to the consumer
+};
+
+// Statistics of the most recent create_label call on the calling thread
+const label_stats_t& get_label_stats();
+
+// Producer threads per sector in layers 2 and up (layer 1 runs none by
+// default), plus the calling thread as the consumer
+const size_t LABEL_EXP_PRODUCERS = 2;
+
+// Producer-less layer 1: the consumer decodes the parents of the node
+// LABEL_LAYER1_PREFETCH nodes ahead and prefetches their labels, 0
+// disables. Progress is published every LABEL_LAYER1_PROGRESS nodes.
+// Applies to labeling started after the call.
+const size_t LABEL_LAYER1_PREFETCH = 4;
+const size_t LABEL_LAYER1_PROGRESS = 256;
+void set_label_layer1_prefetch(size_t distance);
+
+// Ring buffer and producer setup of one layer kind
+struct label_params_t {
+  size_t lookahead;        // Ring buffer slots, in nodes
+  size_t num_producers;    // Producer threads, before lane and compact
+                           // cache scaling
+  size_t producer_stride;  // Nodes a producer claims at a time
+};
+
+const label_params_t LABEL_PARAMS_LAYER1 = { 400, 0, 16 };
+const label_params_t LABEL_PARAMS_EXP    = { 800, LABEL_EXP_PRODUCERS,
+                                             LABEL_EXP_CHUNK };
+
+// Parameters of layer 1 (layer1 true) or of layers 2 and up. Applies to
+// labeling started after the call, zero fields are raised to 1. Layer 1
+// with num_producers 0 (the default) runs without producers, the consumer
+// gathers the base parents itself and lookahead and producer_stride are
+// unused. See label_tune.h to pick them per machine.
+void set_label_params(bool layer1, const label_params_t& params);
+label_params_t get_label_params(bool layer1);
+
+// Page sizes for set_huge_page_size
+const size_t PAGE_SIZE_4K      = (1UL << 12);
+const size_t PAGE_SIZE_2M      = (1UL << 21);
+const size_t PAGE_SIZE_1G      = (1UL << 30);
+
+// Back layers and the parents cache allocated after the call with 2M or 1G
+// huge pages (hugetlbfs pool, see /proc/sys/vm/nr_hugepages). The parents
+// cache file is copied into a shared huge page region. Falls back to smaller
+// pages when the pool runs out. PAGE_SIZE_4K (the default) disables.
+void set_huge_page_size(size_t page_size);
+
+// Pin the labeling threads started from the calling thread, and the
+// calling thread itself as the consumer, following placement. The ring
+// buffer is bound to placement->numa_node. NULL (the default) leaves
+// threads and memory to the scheduler.
+void set_label_placement(const label_placement_t* placement);
+
+// Returned by the labeling functions when stopped through set_label_cancel
+const int LABEL_CANCELLED = 2;
+
+// Stop labeling started from the calling thread once *cancel is set. The
+// layer stops at its next progress update, labels below the published
+// progress are final and the layer can be resumed there with start_node.
+// NULL (the default) labels every layer to the end.
+void set_label_cancel(const std::atomic<bool>* cancel);
+
+// Map the lotus parents cache file of config read-only and locked, or
+// generate it when there is no file. Loading and locking run on all cores,
+// a sample of the nodes is checked against the graph. Any number of
+// sectors can share the mapping, see parents_handle in label_context.h.
+// Returns NULL on failure.
+uint32_t* map_parent_cache(const sector_config_t& config);
+void unmap_parent_cache(const sector_config_t& config, uint32_t* parents);
+
+// Share the parents cache between processes through a file in dir, a tmpfs
+// such as /dev/shm or a hugetlbfs mount for huge pages. The first
+// map_parent_cache loads the lotus file into it on all cores and checks it
+// against the graph, later calls and other processes attach read-only.
+// NULL (the default) maps the file privately in each process. dir has to
+// stay valid.
+void set_parent_cache_shm_dir(const char* dir);
+// Drop the shared copy, e.g. after replacing the cache file
+int remove_shared_parent_cache(const sector_config_t& config);
+
+// Single sector setup: maps the parents cache and allocates the layers.
+// Only one sector per process, use label_context.h for more.
+// Layers are bound to numa_node when it is not negative. exp_labels may be
+// NULL to allocate a single layer (create_layers low memory mode).
+int setup_create_label_memory(const sector_config_t& config,
+                              uint32_t** parents_cache,
+                              uint32_t** layer_labels,
+                              uint32_t** exp_labels,
+                              int numa_node = -1);
 
 void cleanup_create_label_memory();
 
+// Locked, 64 byte aligned layer, NULL on failure
+uint32_t* allocate_layer(size_t sector_size, int numa_node = -1);
+
+void free_layer(uint32_t* layer, size_t sector_size);
+
 #endif // __CREATE_LABELS_H__
@@ -2,57 +2,799 @@
 // Licensed under the Apache License, Version 2.0, see LICENSE for details.
 // SPDX-License-Identifier: Apache-2.0
 
-// g++ -g -Wall -Wextra -Werror -march=native -O3 create_labels.cpp memory_handling.cpp gbench_create_labels.cpp -I../../blst/src ../../blst/libblst.a -lbenchmark -lpthread
+// g++ -g -Wall -Wextra -Werror -march=native -O3 create_labels.cpp sha256_multi.cpp sha256_dispatch.cpp memory_handling.cpp parents_cache.cpp compact_parents.cpp topology.cpp async_io.cpp layer_gather.cpp checkpoint.cpp layer_pipeline.cpp layer_tree.cpp replica_encode.cpp label_verify.cpp label_context.cpp label_metrics.cpp perf_counters.cpp gbench_create_labels.cpp -I../../blst/src ../../blst/libblst.a -lbenchmark -lpthread
 
 #include <cstdint>                // uint*
+#include <cstring>                // memcpy
+#include <cstdlib>                // getenv
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <fcntl.h>                 // open
+#include <unistd.h>                // write
 #include <benchmark/benchmark.h>
 #include "create_labels.h"
+#include "perf_counters.h"
+#include "compact_parents.h"
+#include "label_context.h"
+#include "label_metrics.h"
+#include "layer_tree.h"
+#include "label_verify.h"
+#include "replica_encode.h"
+#include "parents_cache.h"
+#include "sha256_multi.h"
+#if defined(__x86_64__) || defined(__x86_64) || defined(_M_X64)
+#include <x86intrin.h>             // __rdtsc
+#endif
+
+// Sector size under test, SDR_SECTOR_SIZE overrides the 512M default
+static const sector_config_t& bench_config() {
+  size_t sector_size = SECTOR_SIZE_512M;
+  const char* env = getenv("SDR_SECTOR_SIZE");
+  if (env != NULL) {
+    sector_size = strtoul(env, NULL, 0);
+  }
+  const sector_config_t* config = get_sector_config(sector_size);
+  if (config == NULL) {
+    printf("ERROR - unsupported sector size %ld\n", sector_size);
+    exit(1);
+  }
+  return *config;
+}
+
+// With SDR_PIN set the labeling threads are pinned to cores sharing a
+// cache and the layers are bound to that NUMA node, replacing an external
+// taskset. Returns the node for setup_create_label_memory.
+static int bench_numa_node() {
+  static std::vector<label_placement_t> placements;
+  if (getenv("SDR_PIN") == NULL) {
+    return -1;
+  }
+  if (placements.empty()) {
+    cpu_topology_t topo;
+    if (load_cpu_topology(topo) != 0) {
+      return -1;
+    }
+    plan_label_placement(topo, 1, 2, placements);
+  }
+  set_label_placement(&placements[0]);
+  return placements[0].numa_node;
+}
+
+// Parents cache of a sector size generated in memory from the graph, in the
+// layout of the lotus v28 file, so the sweep benchmarks need neither the
+// cache file nor network access to fetch it. Kept for the whole run.
+static uint32_t* bench_parents(const sector_config_t& config) {
+  static std::map<size_t, std::unique_ptr<uint32_t[]>> caches;
+  std::unique_ptr<uint32_t[]>& cache = caches[config.sector_size];
+  if (!cache) {
+    cache.reset(new uint32_t[config.node_count * PARENT_COUNT]);
+    generate_parent_cache(cache.get(), config.sector_size, SDR_API_V1_0, 0);
+  }
+  return cache.get();
+}
+
+// SHA-256 blocks per label, layer 1 (1 + 6 * 3 + 1) and layers 2 and up
+// (1 + 7 + 7 + 5) alike
+const size_t SHA_BLOCKS_PER_NODE = 20;
+
+// Replica id of the captured test vector, as in main.cpp
+static const uint8_t BENCH_REPLICA_ID[32] = {
+  243, 174, 179, 214, 115, 147, 246,  67,
+   84, 124, 187, 241,  48, 103, 161, 157,
+  119, 194, 163, 152, 191, 176, 222, 127,
+   19,  25, 127,  14, 126,   3, 152,  31
+};
+
+// A sector to label in a benchmark: parents cache, two layers and the
+// BENCH_REPLICA_ID, with layer 1 labeled into layer_labels when label_layer1
+// is set, so layer 2 labels into exp_labels. On a setup failure the
+// benchmark is skipped and ok is false. Released at the end of the scope.
+struct bench_sector {
+  // bench_config size through setup_create_label_memory, on page_size
+  // pages. Only one of these can exist at a time.
+  bench_sector(benchmark::State& state, bool label_layer1,
+               size_t page_size = PAGE_SIZE_4K)
+    : config(bench_config()), generated(false) {
+    set_huge_page_size(page_size);
+    ok = setup_create_label_memory(config, &parents_cache, &layer_labels,
+                                   &exp_labels, bench_numa_node()) == 0;
+    set_huge_page_size(PAGE_SIZE_4K);
+    finish_setup(state, label_layer1);
+  }
+
+  // Any size, on its bench_parents cache
+  bench_sector(benchmark::State& state, const sector_config_t& sector_config,
+               bool label_layer1)
+    : config(sector_config), generated(true) {
+    int numa_node = bench_numa_node();
+    parents_cache = bench_parents(config);
+    layer_labels  = allocate_layer(config.sector_size, numa_node);
+    exp_labels    = allocate_layer(config.sector_size, numa_node);
+    ok = layer_labels != NULL && exp_labels != NULL;
+    finish_setup(state, label_layer1);
+  }
+
+  ~bench_sector() {
+    if (!generated) {
+      if (ok) {
+        cleanup_create_label_memory();
+      }
+      return;
+    }
+    for (uint32_t* layer : { layer_labels, exp_labels }) {
+      if (layer != NULL) {
+        free_layer(layer, config.sector_size);
+      }
+    }
+  }
+
+  // Layer 2 into exp_labels
+  int label_layer2() {
+    return create_label(config, parents_cache, replica_id, exp_labels,
+                        layer_labels, config.node_count, 2);
+  }
+
+  const sector_config_t& config;
+  uint8_t   replica_id[32];
+  uint32_t* parents_cache;
+  uint32_t* layer_labels;
+  uint32_t* exp_labels;
+  bool      ok;
+
+private:
+  void finish_setup(benchmark::State& state, bool label_layer1) {
+    std::memcpy(replica_id, BENCH_REPLICA_ID, sizeof(replica_id));
+    if (!ok) {
+      state.SkipWithError("sector setup failed");
+    } else if (label_layer1) {
+      create_label(config, parents_cache, replica_id, layer_labels, NULL,
+                   config.node_count, 1);
+    }
+  }
+
+  bool generated;  // bench_parents and allocate_layer
+};
 
 static void BM_CreateLabels(benchmark::State& state) {
-  uint8_t replica_id[] = {
-    243, 174, 179, 214, 115, 147, 246,  67,
-     84, 124, 187, 241,  48, 103, 161, 157,
-    119, 194, 163, 152, 191, 176, 222, 127,
-     19,  25, 127,  14, 126,   3, 152,  31
+  bench_sector sector(state, false);
+  for (auto _ : state) {
+    create_label(sector.config, sector.parents_cache, sector.replica_id,
+                 sector.layer_labels, NULL, sector.config.node_count, 1);
+  }
+}
+
+static void BM_CreateLabelsExp(benchmark::State& state) {
+  bench_sector sector(state, true);
+  for (auto _ : state) {
+    sector.label_layer2();
+  }
+}
+
+// Lockstep labeling of state.range(0) sectors, replica_ids differ per lane
+static void BM_CreateLabelsMulti(benchmark::State& state) {
+  const size_t lanes = state.range(0);
+  bench_sector sector(state, false);
+  if (!sector.ok) {
+    return;
+  }
+  const sector_config_t& config = sector.config;
+
+  // Lane 0 is the sector's own
+  int       numa_node = bench_numa_node();
+  uint8_t   replica_ids[lanes][32];
+  uint8_t*  replica_id_ptrs[lanes];
+  uint32_t* lane_labels[lanes];
+  uint32_t* lane_exp_labels[lanes];
+  bool      allocated = true;
+  for (size_t l = 0; l < lanes; l++) {
+    std::memcpy(replica_ids[l], sector.replica_id, 32);
+    replica_ids[l][0] ^= (uint8_t)l;
+    replica_id_ptrs[l] = replica_ids[l];
+    lane_labels[l]     = l == 0 ? sector.layer_labels :
+                                    allocate_layer(config.sector_size,
+                                                   numa_node);
+    lane_exp_labels[l] = l == 0 ? sector.exp_labels   :
+                                    allocate_layer(config.sector_size,
+                                                   numa_node);
+    allocated = allocated && lane_labels[l] != NULL &&
+                lane_exp_labels[l] != NULL;
+  }
+  if (!allocated) {
+    state.SkipWithError("layer allocation failed");
+  } else {
+    create_label_multi(config, sector.parents_cache, replica_id_ptrs,
+                       lane_labels, NULL, lanes, config.node_count, 1);
+
+    for (auto _ : state) {
+      create_label_multi(config, sector.parents_cache, replica_id_ptrs,
+                         lane_exp_labels, lane_labels, lanes,
+                         config.node_count, 2);
+    }
+    state.counters["nodes/s"] = benchmark::Counter(
+      (double)config.node_count * lanes * state.iterations(),
+      benchmark::Counter::kIsRate);
+  }
+
+  for (size_t l = 1; l < lanes; l++) {
+    for (uint32_t* layer : { lane_labels[l], lane_exp_labels[l] }) {
+      if (layer != NULL) {
+        free_layer(layer, config.sector_size);
+      }
+    }
+  }
+}
+
+// Layer 2 labeling under each wait policy (state.range(0) is a
+// label_wait_policy_t). Reports how often the consumer found its node not
+// ready and the wait time percentiles in microseconds.
+static void BM_CreateLabelsExpWait(benchmark::State& state) {
+  bench_sector sector(state, true);
+
+  set_label_wait_policy((label_wait_policy_t)state.range(0));
+  uint64_t not_ready = 0;
+  uint64_t hist[WAIT_HIST_BUCKETS] = {0};
+  for (auto _ : state) {
+    sector.label_layer2();
+    const label_stats_t& stats = get_label_stats();
+    not_ready += stats.producer_not_ready;
+    for (size_t i = 0; i < WAIT_HIST_BUCKETS; i++) {
+      hist[i] += stats.wait_hist[i];
+    }
+  }
+  set_label_wait_policy(WAIT_POLICY_ADAPTIVE);
+
+  // Percentiles from the log2 histogram, reported as the bucket upper bound
+  auto percentile = [&](double p) {
+    if (not_ready == 0) {
+      return 0.0;
+    }
+    uint64_t target = (uint64_t)((not_ready - 1) * p);
+    uint64_t seen   = 0;
+    for (size_t i = 0; i < WAIT_HIST_BUCKETS; i++) {
+      seen += hist[i];
+      if (seen > target) {
+        return (double)(2UL << i) / 1000.0;
+      }
+    }
+    return 0.0;
   };
+  state.counters["not_ready"] = benchmark::Counter(
+    (double)not_ready, benchmark::Counter::kAvgIterations);
+  state.counters["wait_p50_us"] = percentile(0.50);
+  state.counters["wait_p99_us"] = percentile(0.99);
+  state.counters["wait_max_us"] = percentile(1.0);
+}
 
-  uint32_t* parents_cache = nullptr;
-  uint32_t* layer_labels  = nullptr;
-  uint32_t* exp_labels    = nullptr;
+// Layer 2 with layers and parents cache on state.range(0) sized pages.
+// Reports the dTLB misses per node of the labeling threads.
+static void BM_CreateLabelsExpPages(benchmark::State& state) {
+  bench_sector sector(state, true, state.range(0));
 
-  setup_create_label_memory(&parents_cache, &layer_labels, &exp_labels);
+  perf_counters counters;
+  counters.start();
+  for (auto _ : state) {
+    sector.label_layer2();
+  }
+  counters.stop();
+
+  double nodes = (double)sector.config.node_count * state.iterations();
+  state.counters["dtlb_load_misses/node"] =
+    counters.read(PERF_DTLB_LOAD_MISSES) / nodes;
+  state.counters["dtlb_store_misses/node"] =
+    counters.read(PERF_DTLB_STORE_MISSES) / nodes;
+}
+
+// Layer 2 reading a compact parents cache encoded from the flat one,
+// state.range(0) is the compact_exp_mode. Compare with CreateLabelsExp.
+static void BM_CreateLabelsExpCompact(benchmark::State& state) {
+  bench_sector sector(state, true);
+  if (!sector.ok) {
+    return;
+  }
+  const sector_config_t& config = sector.config;
+  compact_parents compact;
+  if (compact.encode(sector.parents_cache, config.sector_size, SDR_API_V1_0,
+                     (compact_exp_mode)state.range(0)) != 0) {
+    state.SkipWithError("parents cache does not match the graph");
+    return;
+  }
 
   for (auto _ : state) {
-    create_label(parents_cache, replica_id, layer_labels, NULL, NODE_COUNT, 1);
+    create_label(config, compact, sector.replica_id, sector.exp_labels,
+                 sector.layer_labels, config.node_count, 2);
   }
 
-  cleanup_create_label_memory();
+  state.counters["parents_bytes/node"] =
+    (double)compact.size() / config.node_count;
+
+  compact.release();
 }
 
-static void BM_CreateLabelsExp(benchmark::State& state) {
-  uint8_t replica_id[] = {
-    243, 174, 179, 214, 115, 147, 246,  67,
-     84, 124, 187, 241,  48, 103, 161, 157,
-    119, 194, 163, 152, 191, 176, 222, 127,
-     19,  25, 127,  14, 126,   3, 152,  31
-  };
+// Layer 2 in low memory mode with state.range(0) nodes of gather
+// lookahead. Layer 1 is written to SDR_BENCH_DIR (default /var/tmp), put it
+// on the NVMe drive under test.
+static void BM_CreateLabelsExpFile(benchmark::State& state) {
+  bench_sector sector(state, true);
+  if (!sector.ok) {
+    return;
+  }
+  const sector_config_t& config = sector.config;
+
+  const char* dir = getenv("SDR_BENCH_DIR");
+  std::string path = std::string(dir != NULL ? dir : "/var/tmp") +
+                     "/sdr-bench-layer-1.dat";
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 ||
+      write(fd, sector.layer_labels, config.sector_size) !=
+      (ssize_t)config.sector_size || fdatasync(fd) != 0) {
+    state.SkipWithError("writing layer 1 failed");
+    return;
+  }
+  close(fd);
+  fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+  if (fd < 0) {
+    fd = open(path.c_str(), O_RDONLY);
+  }
 
-  uint32_t* parents_cache = nullptr;
-  uint32_t* layer_labels  = nullptr;
-  uint32_t* exp_labels    = nullptr;
+  set_label_gather_lookahead(state.range(0));
+  for (auto _ : state) {
+    create_label_file(config, sector.parents_cache, sector.replica_id,
+                      sector.exp_labels, fd, config.node_count, 2);
+  }
+  set_label_gather_lookahead(LABEL_GATHER_LOOKAHEAD);
+
+  const label_stats_t& stats = get_label_stats();
+  state.counters["nodes/s"] = benchmark::Counter(
+    (double)config.node_count * state.iterations(),
+    benchmark::Counter::kIsRate);
+  state.counters["cache_hit_rate"] = (double)stats.gather_hits /
+    std::max(stats.gather_hits + stats.gather_reads, (uint64_t)1);
+  state.counters["not_ready"] = stats.producer_not_ready;
+
+  close(fd);
+  unlink(path.c_str());
+}
+
+// Layer 2 with producer chunks of state.range(0) nodes and expander
+// prefetch state.range(1) nodes ahead. Reports the consumer stalls, which
+// should drop as the prefetch distance covers DRAM latency.
+static void BM_CreateLabelsExpPrefetch(benchmark::State& state) {
+  bench_sector sector(state, true);
+
+  set_label_exp_prefetch(state.range(0), state.range(1));
+  for (auto _ : state) {
+    sector.label_layer2();
+  }
+  set_label_exp_prefetch(LABEL_EXP_CHUNK, LABEL_EXP_PREFETCH);
+  state.counters["not_ready"] = get_label_stats().producer_not_ready;
+}
+
+// One SHA-256 backend from SHA256_BACKENDS, selected by state.range(0).
+// Hashes SHA_BENCH_BLOCKS blocks on each of the backend's lanes.
+static void BM_Sha256Block(benchmark::State& state) {
+  const size_t SHA_BENCH_BLOCKS = 1024;
+  const sha256_backend_t& backend = SHA256_BACKENDS[state.range(0)];
+  state.SetLabel(backend.name);
+  if (!backend.supported()) {
+    state.SkipWithError("not supported by this CPU");
+    return;
+  }
+
+  std::vector<uint8_t>  msg(backend.lanes * SHA_BENCH_BLOCKS * 64, 0x5a);
+  std::vector<uint32_t> state_words(backend.lanes * 8, 0);
+  uint32_t*      h[SHA256_MULTI_MAX_LANES];
+  const uint8_t* in[SHA256_MULTI_MAX_LANES];
+  for (size_t l = 0; l < backend.lanes; l++) {
+    h[l]  = &state_words[l * 8];
+    in[l] = &msg[l * SHA_BENCH_BLOCKS * 64];
+  }
 
-  setup_create_label_memory(&parents_cache, &layer_labels, &exp_labels);
-  create_label(parents_cache, replica_id, layer_labels, NULL, NODE_COUNT, 1);
+#if defined(__x86_64__) || defined(__x86_64) || defined(_M_X64)
+  uint64_t start = __rdtsc();
+#endif
+  for (auto _ : state) {
+    if (backend.lanes == 1) {
+      backend.block(h[0], in[0], SHA_BENCH_BLOCKS);
+    } else {
+      backend.block_multi(h, in, SHA_BENCH_BLOCKS);
+    }
+    benchmark::DoNotOptimize(state_words.data());
+  }
+
+  double blocks = (double)SHA_BENCH_BLOCKS * backend.lanes *
+                  state.iterations();
+#if defined(__x86_64__) || defined(__x86_64) || defined(_M_X64)
+  state.counters["cycles/block"] = (__rdtsc() - start) / blocks;
+#endif
+  state.SetBytesProcessed(blocks * 64);
+  // Labeling rate of one core if hashing were all it did
+  state.counters["nodes/s"] =
+    benchmark::Counter(blocks / SHA_BLOCKS_PER_NODE,
+                       benchmark::Counter::kIsRate);
+}
+
+// Labeling over a grid of state.range(0) sector size, state.range(1) layer
+// (1, or 2 for layers 2 and up) and label_params_t {lookahead, producers,
+// stride} from state.range(2..4), on a bench_parents cache
+static void BM_CreateLabelsSweep(benchmark::State& state) {
+  const sector_config_t* config = get_sector_config(state.range(0));
+  bool layer1 = state.range(1) == 1;
+  bench_sector sector(state, *config, !layer1);
+
+  label_params_t saved  = get_label_params(layer1);
+  label_params_t params = { (size_t)state.range(2), (size_t)state.range(3),
+                            (size_t)state.range(4) };
+  set_label_params(layer1, params);
+  for (auto _ : state) {
+    if (layer1) {
+      create_label(*config, sector.parents_cache, sector.replica_id,
+                   sector.layer_labels, NULL, config->node_count, 1);
+    } else {
+      sector.label_layer2();
+    }
+  }
+  set_label_params(layer1, saved);
+
+  state.counters["nodes/s"] =
+    benchmark::Counter(config->node_count,
+                       benchmark::Counter::kIsIterationInvariantRate);
+  state.SetBytesProcessed(config->sector_size * state.iterations());
+  state.counters["not_ready"] = get_label_stats().producer_not_ready;
+}
+
+// The defaults of each layer kind, then one parameter at a time around
+// them. SDR_SECTOR_SIZE limits the sweep to that size.
+static void sweep_args(benchmark::internal::Benchmark* b) {
+  std::vector<int64_t> sizes = { (int64_t)SECTOR_SIZE_8M,
+                                 (int64_t)SECTOR_SIZE_512M };
+  if (getenv("SDR_SECTOR_SIZE") != NULL) {
+    sizes = { (int64_t)bench_config().sector_size };
+  }
+  for (int64_t size : sizes) {
+    for (int64_t layer : { 1, 2 }) {
+      const label_params_t& p = layer == 1 ? LABEL_PARAMS_LAYER1 :
+                                             LABEL_PARAMS_EXP;
+      int64_t lookahead = p.lookahead;
+      int64_t producers = p.num_producers;
+      int64_t stride    = p.producer_stride;
+      b->Args({ size, layer, lookahead, producers, stride });
+      for (int64_t n : { 1, 2, 4 }) {
+        if (n != producers) {
+          b->Args({ size, layer, lookahead, n, stride });
+        }
+      }
+      // The ring parameters, with a producer for the producer-less layer 1
+      producers = std::max(producers, (int64_t)1);
+      b->Args({ size, layer, lookahead, producers, stride / 4 });
+      b->Args({ size, layer, lookahead, producers, stride * 4 });
+      b->Args({ size, layer, lookahead / 2, producers, stride });
+      b->Args({ size, layer, lookahead * 2, producers, stride });
+    }
+  }
+}
+
+// Layer 2 of the bench_config size with the single stream SHA-256 backend
+// forced to SHA256_BACKENDS[state.range(0)]
+static void BM_CreateLabelsSha(benchmark::State& state) {
+  const sector_config_t& config = bench_config();
+  const sha256_backend_t& backend = SHA256_BACKENDS[state.range(0)];
+  state.SetLabel(backend.name);
+  if (backend.lanes != 1) {
+    state.SkipWithError("multi-buffer backend, see CreateLabelsMulti");
+    return;
+  }
+  if (sha256_force_backend(backend.name) != 0) {
+    state.SkipWithError("not supported by this CPU");
+    return;
+  }
+
+  {
+    bench_sector sector(state, config, true);
+    for (auto _ : state) {
+      sector.label_layer2();
+    }
+  }
+  sha256_force_backend("auto");
+
+  state.counters["nodes/s"] =
+    benchmark::Counter(config.node_count,
+                       benchmark::Counter::kIsIterationInvariantRate);
+  state.SetBytesProcessed(config.sector_size * state.iterations());
+}
+
+// One producer's fill_buffer work without a consumer, state.range(0) is
+// the sector size and state.range(1) the layer (1 or 2). Walks the sector
+// FILL_BENCH_NODES nodes per iteration, so expander reads miss the cache
+// as in labeling. Bytes are the parent labels gathered.
+static void BM_FillBuffer(benchmark::State& state) {
+  const uint64_t FILL_BENCH_NODES = 4096;
+  const sector_config_t* config = get_sector_config(state.range(0));
+  bool layer1 = state.range(1) == 1;
+
+  uint32_t* parents_cache = bench_parents(*config);
+  uint32_t* layer_labels  = allocate_layer(config->sector_size);
+  uint32_t* exp_labels    = layer1 ? NULL :
+                            allocate_layer(config->sector_size);
+
+  // Past the nodes whose base parents are always left to the consumer
+  const uint64_t first = std::min((uint64_t)4096, config->node_count / 2);
+  const uint64_t count = std::min(FILL_BENCH_NODES,
+                                  config->node_count - first);
+  uint64_t node = first;
+  for (auto _ : state) {
+    fill_label_buffers(parents_cache, layer_labels, exp_labels, node, count);
+    node += count;
+    if (node + count > config->node_count) {
+      node = first;
+    }
+  }
+
+  size_t parents = layer1 ? PARENT_COUNT_BASE : PARENT_COUNT;
+  state.counters["nodes/s"] =
+    benchmark::Counter(count, benchmark::Counter::kIsIterationInvariantRate);
+  state.SetBytesProcessed(count * parents * NODE_SIZE * state.iterations());
+
+  free_layer(layer_labels, config->sector_size);
+  if (exp_labels != NULL) {
+    free_layer(exp_labels, config->sector_size);
+  }
+}
+
+// Replica encoding of a finished layer on state.range(0) threads, 0 for
+// every core. The data and replica files go to SDR_BENCH_DIR (default
+// /var/tmp). Bytes are the sector size.
+static void BM_EncodeReplica(benchmark::State& state) {
+  const sector_config_t& config = bench_config();
+  uint32_t* key = allocate_layer(config.sector_size);
+  for (size_t i = 0; i < config.sector_size / sizeof(uint32_t); i++) {
+    key[i] = (uint32_t)(i * 0x9E3779B9U);
+    if (i % NODE_WORDS == NODE_WORDS - 1) {
+      key[i] &= 0x3FFFFFFF; // Labels are below 2^254
+    }
+  }
+
+  // Any labels do as data, they are valid field elements
+  const char* dir = getenv("SDR_BENCH_DIR");
+  std::string prefix = std::string(dir != NULL ? dir : "/var/tmp");
+  std::string data_path    = prefix + "/sdr-bench-data.dat";
+  std::string replica_path = prefix + "/sdr-bench-replica.dat";
+  int fd = open(data_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 ||
+      write(fd, key, config.sector_size) != (ssize_t)config.sector_size ||
+      fdatasync(fd) != 0) {
+    state.SkipWithError("writing the data file failed");
+    free_layer(key, config.sector_size);
+    return;
+  }
+  close(fd);
+
+  for (auto _ : state) {
+    if (encode_replica(data_path.c_str(), replica_path.c_str(), key,
+                       config.node_count, state.range(0)) != 0) {
+      state.SkipWithError("encoding failed");
+      break;
+    }
+  }
+
+  state.SetBytesProcessed(config.sector_size * state.iterations());
+  unlink(data_path.c_str());
+  unlink(replica_path.c_str());
+  free_layer(key, config.sector_size);
+}
+
+// Layer 1 of the bench_config size with state.range(0) producers, 0 for
+// the producer-less engine, which prefetches state.range(1) nodes ahead.
+// Compare nodes/s per core used.
+static void BM_CreateLabelsLayer1(benchmark::State& state) {
+  bench_sector sector(state, false);
+  const sector_config_t& config = sector.config;
+
+  label_params_t saved  = get_label_params(true);
+  label_params_t params = saved;
+  params.num_producers  = state.range(0);
+  set_label_params(true, params);
+  set_label_layer1_prefetch(state.range(1));
+  for (auto _ : state) {
+    create_label(config, sector.parents_cache, sector.replica_id,
+                 sector.layer_labels, NULL, config.node_count, 1);
+  }
+  set_label_layer1_prefetch(LABEL_LAYER1_PREFETCH);
+  set_label_params(true, saved);
+
+  state.counters["nodes/s"] =
+    benchmark::Counter(config.node_count,
+                       benchmark::Counter::kIsIterationInvariantRate);
+  state.counters["cores"] = 1 + state.range(0);
+}
+
+// Full check of a labeled layer 2 on state.range(0) threads, 0 for every
+// core, against labeling the same layer
+static void BM_VerifyLayer(benchmark::State& state) {
+  bench_sector sector(state, true);
+  if (!sector.ok) {
+    return;
+  }
+  const sector_config_t& config = sector.config;
+  sector.label_layer2();
+
+  for (auto _ : state) {
+    label_verify_result_t result;
+    verify_layer(sector.parents_cache, sector.replica_id, sector.exp_labels,
+                 sector.layer_labels, config.node_count, 2, result, 0,
+                 state.range(0));
+    if (result.mismatches != 0) {
+      state.SkipWithError("layer mismatch");
+      break;
+    }
+  }
+
+  state.counters["nodes/s"] =
+    benchmark::Counter(config.node_count,
+                       benchmark::Counter::kIsIterationInvariantRate);
+}
+
+// Layer 2 with label_params_t {lookahead, producers, stride} from
+// state.range(0..2), the grid label_tune.cpp searches
+static void BM_CreateLabelsExpParams(benchmark::State& state) {
+  bench_sector sector(state, true);
+
+  label_params_t params = { (size_t)state.range(0), (size_t)state.range(1),
+                            (size_t)state.range(2) };
+  set_label_params(false, params);
+  for (auto _ : state) {
+    sector.label_layer2();
+  }
+  set_label_params(false, LABEL_PARAMS_EXP);
+
+  const label_stats_t& stats = get_label_stats();
+  state.counters["not_ready"] = stats.producer_not_ready;
+  // Ring too small for the producers (LABEL_METRICS builds only)
+  if (label_metrics_enabled()) {
+    state.counters["producer_waits"] = stats.producer_waits;
+  }
+  state.counters["nodes/s"] =
+    benchmark::Counter(sector.config.node_count,
+                       benchmark::Counter::kIsIterationInvariantRate);
+}
+
+// Parents cache startup as its own phase, state.range(0) is 0 for a
+// private mapping of the cache file, 1 for loading it into a shared
+// segment in SDR_BENCH_SHM (default /dev/shm) and 2 for attaching to that
+// segment as a later process would
+static void BM_ParentsCacheStartup(benchmark::State& state) {
+  const sector_config_t& config = bench_config();
+  if (config.parents_cache_filename == NULL ||
+      access(config.parents_cache_filename, R_OK) != 0) {
+    state.SkipWithError("no parents cache file, run gen_parents_cache");
+    return;
+  }
+  const char* shm_dir = getenv("SDR_BENCH_SHM");
+  set_parent_cache_shm_dir(state.range(0) == 0 ? NULL :
+                           shm_dir != NULL ? shm_dir : "/dev/shm");
+  if (state.range(0) == 2) {
+    unmap_parent_cache(config, map_parent_cache(config));
+  }
+
+  for (auto _ : state) {
+    if (state.range(0) == 1) {
+      state.PauseTiming();
+      remove_shared_parent_cache(config);
+      state.ResumeTiming();
+    }
+    uint32_t* parents = map_parent_cache(config);
+    state.PauseTiming();
+    unmap_parent_cache(config, parents);
+    state.ResumeTiming();
+  }
+
+  state.SetBytesProcessed(state.iterations() * config.parents_size);
+  remove_shared_parent_cache(config);
+  set_parent_cache_shm_dir(NULL);
+}
+
+// state.range(0) sectors of layers 1 and 2 through label_scheduler, all
+// sharing one parents cache. As many run at once as the cores and memory
+// allow, reported as peak_running.
+static void BM_CreateLabelsSectors(benchmark::State& state) {
+  const sector_config_t& config = bench_config();
+  parents_handle parents;
+  parents.open(config);
+  label_scheduler scheduler(parents, 0, 0, getenv("SDR_PIN") != NULL);
+
+  for (auto _ : state) {
+    for (int64_t i = 0; i < state.range(0); i++) {
+      label_job_t job;
+      std::memset(job.replica_id, 0, sizeof(job.replica_id));
+      job.replica_id[0] = (uint8_t)i;
+      job.num_layers    = 2;
+      job.low_ram       = false;
+      scheduler.submit(job);
+    }
+    if (scheduler.wait() != 0) {
+      state.SkipWithError("labeling failed");
+      break;
+    }
+  }
+
+  state.counters["sectors/s"] =
+    benchmark::Counter(state.range(0),
+                       benchmark::Counter::kIsIterationInvariantRate);
+  state.counters["peak_running"] = scheduler.peak_running();
+}
+
+// SHA-256 Merkle tree of a finished layer of the bench_config size on
+// one layer_tree thread, i.e. the extra work set_layer_trees adds per
+// layer. Bytes are the layer's labels.
+static void BM_LayerTree(benchmark::State& state) {
+  const sector_config_t& config = bench_config();
+  uint32_t* labels = allocate_layer(config.sector_size);
+  for (size_t i = 0; i < config.sector_size / sizeof(uint32_t); i++) {
+    labels[i] = (uint32_t)(i * 0x9E3779B9U);
+  }
 
+  layer_tree tree;
   for (auto _ : state) {
-    create_label(parents_cache, replica_id, exp_labels, layer_labels,
-                 NODE_COUNT, 2);
+    // Every label is final from the start
+    tree.start(labels, config.node_count, NULL, config.node_count);
+    if (tree.finish() != 0) {
+      state.SkipWithError("tree failed");
+      break;
+    }
   }
 
-  cleanup_create_label_memory();
+  state.counters["nodes/s"] =
+    benchmark::Counter(config.node_count,
+                       benchmark::Counter::kIsIterationInvariantRate);
+  state.SetBytesProcessed(config.sector_size * state.iterations());
+  free_layer(labels, config.sector_size);
 }
 
+BENCHMARK(BM_ParentsCacheStartup)->Arg(0)->Arg(1)->Arg(2)->UseRealTime()
+                                  ->Unit(benchmark::kMillisecond);
 BENCHMARK(BM_CreateLabels);
 BENCHMARK(BM_CreateLabelsExp);
+BENCHMARK(BM_CreateLabelsLayer1)->Args({0, 0})->Args({0, 2})->Args({0, 4})
+  ->Args({0, 8})->Args({1, 0})->UseRealTime();
+BENCHMARK(BM_CreateLabelsExpCompact)->Arg(COMPACT_EXP_PACKED)
+                                    ->Arg(COMPACT_EXP_RECOMPUTE);
+BENCHMARK(BM_CreateLabelsExpFile)->Arg(128)->Arg(512)->Arg(2048)
+                                 ->Arg(8192)->UseRealTime();
+BENCHMARK(BM_CreateLabelsExpPrefetch)->Args({128, 0})
+                                     ->Args({128, 8})
+                                     ->Args({128, 16})
+                                     ->Args({128, 32})
+                                     ->Args({512, 16});
+BENCHMARK(BM_CreateLabelsExpParams)->Args({800, 2, 128})
+                                   ->Args({400, 2, 128})
+                                   ->Args({1600, 2, 128})
+                                   ->Args({800, 1, 128})
+                                   ->Args({800, 4, 128})
+                                   ->Args({800, 2, 32})
+                                   ->Args({800, 2, 512})->UseRealTime();
+BENCHMARK(BM_CreateLabelsExpPages)->Arg(PAGE_SIZE_4K)
+                                  ->Arg(PAGE_SIZE_2M)
+                                  ->Arg(PAGE_SIZE_1G);
+BENCHMARK(BM_CreateLabelsExpWait)->Arg(WAIT_POLICY_SLEEP)
+                                 ->Arg(WAIT_POLICY_SPIN)
+                                 ->Arg(WAIT_POLICY_ADAPTIVE);
+BENCHMARK(BM_CreateLabelsMulti)->Arg(4)->Arg(8)->Arg(16);
+BENCHMARK(BM_CreateLabelsSectors)->Arg(1)->Arg(2)->Arg(4)->UseRealTime();
+BENCHMARK(BM_Sha256Block)->DenseRange(0, SHA256_BACKEND_COUNT - 1);
+BENCHMARK(BM_CreateLabelsSweep)->Apply(sweep_args)->UseRealTime()
+                               ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_CreateLabelsSha)->DenseRange(0, SHA256_BACKEND_COUNT - 1)
+                             ->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_EncodeReplica)->Arg(1)->Arg(0)->UseRealTime()
+  ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_VerifyLayer)->Arg(1)->Arg(0)->UseRealTime()
+  ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_LayerTree)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_FillBuffer)->Args({ (int64_t)SECTOR_SIZE_8M, 1 })
+                        ->Args({ (int64_t)SECTOR_SIZE_8M, 2 })
+                        ->Args({ (int64_t)SECTOR_SIZE_512M, 1 })
+                        ->Args({ (int64_t)SECTOR_SIZE_512M, 2 });
 
 BENCHMARK_MAIN();
@@ -0,0 +1,134 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+// Generate or verify a v28 parents cache file.
+//
+//   ./gen_parents_cache <sector_size> [output_file]
+//   ./gen_parents_cache <sector_size> --verify [cache_file]
+//
+// The file name defaults to the lotus path for the sector size. Set
+// SDR_API=1.0 or 1.1 in the environment to pick the proof version (default
+// 1.0) and SDR_THREADS to limit the thread count. SDR_COMPACT=packed or
+// recompute writes a compact cache (see compact_parents.h) instead, named
+// <lotus path>.compact by default.
+
+#include <cstdint>          // uint*
+#include <cstdio>           // printf
+#include <cstdlib>          // strtoul
+#include <cstring>          // strcmp
+#include <chrono>
+#include <fcntl.h>          // open
+#include <sys/mman.h>       // mmap
+#include <errno.h>
+#include <unistd.h>
+#include "create_labels.h"
+#include "parents_cache.h"
+#include "compact_parents.h"
+#include <string>
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    printf("Usage: %s <sector_size> [output_file | --verify [cache_file]]\n",
+           argv[0]);
+    return 1;
+  }
+  size_t sector_size = strtoul(argv[1], NULL, 0);
+  const sector_config_t* config = get_sector_config(sector_size);
+  if (config == NULL) {
+    printf("ERROR - unsupported sector size %ld\n", sector_size);
+    return 1;
+  }
+  bool   verify      = argc > 2 && strcmp(argv[2], "--verify") == 0;
+  const char* compact_env = getenv("SDR_COMPACT");
+  bool   compact     = !verify && compact_env != NULL;
+  const char* filename = argc > (verify ? 3 : 2) ? argv[verify ? 3 : 2] :
+                         config->parents_cache_filename;
+  std::string compact_filename;
+  if (compact && argc <= 2 && filename != NULL) {
+    compact_filename = std::string(filename) + ".compact";
+    filename = compact_filename.c_str();
+  }
+  if (filename == NULL) {
+    printf("ERROR - no default cache file for sector size %ld\n", sector_size);
+    return 1;
+  }
+
+  sdr_api_version api = SDR_API_V1_0;
+  const char* api_env = getenv("SDR_API");
+  if (api_env != NULL && strcmp(api_env, "1.1") == 0) {
+    api = SDR_API_V1_1;
+  }
+  size_t num_threads = 0;
+  const char* threads_env = getenv("SDR_THREADS");
+  if (threads_env != NULL) {
+    num_threads = strtoul(threads_env, NULL, 0);
+  }
+
+  size_t parents_size = config->parents_size;
+  auto start = std::chrono::steady_clock::now();
+
+  if (verify) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+      printf("open %s failed err %s\n", filename, strerror(errno));
+      return 1;
+    }
+    uint32_t* parents = (uint32_t*)mmap(NULL, parents_size, PROT_READ,
+                                        MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if (parents == (void *)-1) {
+      printf("mmap parents failed err %s\n", strerror(errno));
+      return 1;
+    }
+    int ret = verify_parent_cache(parents, sector_size, api, num_threads);
+    munmap(parents, parents_size);
+    close(fd);
+    if (ret != 0) {
+      return ret;
+    }
+    printf("%s verified", filename);
+  } else if (compact) {
+    compact_exp_mode mode = strcmp(compact_env, "recompute") == 0 ?
+                            COMPACT_EXP_RECOMPUTE : COMPACT_EXP_PACKED;
+    compact_parents cp;
+    if (cp.generate(sector_size, api, mode, num_threads) != 0 ||
+        cp.save(filename) != 0) {
+      return 1;
+    }
+    printf("%s generated, %.2f bytes per node", filename,
+           (double)cp.size() / config->node_count);
+  } else {
+    // Size the file and generate straight into its shared mapping
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      printf("open %s failed err %s\n", filename, strerror(errno));
+      return 1;
+    }
+    if (ftruncate(fd, parents_size) != 0) {
+      printf("ftruncate failed err %s\n", strerror(errno));
+      return 1;
+    }
+    uint32_t* parents = (uint32_t*)mmap(NULL, parents_size,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED, fd, 0);
+    if (parents == (void *)-1) {
+      printf("mmap parents failed err %s\n", strerror(errno));
+      return 1;
+    }
+    if (generate_parent_cache(parents, sector_size, api, num_threads) != 0) {
+      return 1;
+    }
+    if (msync(parents, parents_size, MS_SYNC) != 0) {
+      printf("msync failed err %s\n", strerror(errno));
+      return 1;
+    }
+    munmap(parents, parents_size);
+    close(fd);
+    printf("%s generated", filename);
+  }
+
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+  printf(" in %.2fs\n", elapsed.count());
+  return 0;
+}
@@ -0,0 +1,333 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>       // uint*
+#include <cstdio>        // fprintf
+#include <cstring>       // memcpy
+#include <fstream>       // /proc/meminfo
+#include <algorithm>
+#include "label_context.h"
+#include "layer_pipeline.h"
+
+parents_handle::parents_handle()
+  : cfg(NULL), flat_cache(NULL), compact_cache(NULL) {}
+
+parents_handle::~parents_handle() {
+  close();
+}
+
+int parents_handle::open(const sector_config_t& config) {
+  close();
+  flat_cache = map_parent_cache(config);
+  if (flat_cache == NULL) {
+    return 1;
+  }
+  cfg        = &config;
+  return 0;
+}
+
+int parents_handle::open_compact(const sector_config_t& config,
+                                 const char* filename) {
+  close();
+  compact_cache = new compact_parents();
+  if (compact_cache->load(filename) != 0) {
+    close();
+    return 1;
+  }
+  if (compact_cache->node_count() != config.node_count) {
+    fprintf(stderr, "ERROR - %s is for a different sector size\n", filename);
+    close();
+    return 1;
+  }
+  cfg = &config;
+  return 0;
+}
+
+void parents_handle::close() {
+  if (flat_cache != NULL) {
+    unmap_parent_cache(*cfg, flat_cache);
+  }
+  delete compact_cache;
+  cfg           = NULL;
+  flat_cache    = NULL;
+  compact_cache = NULL;
+}
+
+size_t parents_handle::size() const {
+  if (compact_cache != NULL) {
+    return compact_cache->size();
+  }
+  return flat_cache != NULL ? cfg->parents_size : 0;
+}
+
+size_t parents_handle::threads_per_sector() const {
+  size_t producers = get_label_params(false).num_producers;
+  if (compact_cache != NULL &&
+      compact_cache->exp_mode() == COMPACT_EXP_RECOMPUTE) {
+    producers *= COMPACT_RECOMPUTE_PRODUCER_SCALE;
+  }
+  return 1 + producers;
+}
+
+label_context::label_context(const parents_handle& parents)
+  : parents(parents), layer_labels(NULL), exp_labels(NULL),
+    final_labels(NULL) {}
+
+label_context::~label_context() {
+  release();
+}
+
+size_t label_context::memory_size(const sector_config_t& config,
+                                  bool low_ram) {
+  return config.sector_size * (low_ram ? 1 : 2);
+}
+
+int label_context::setup(bool low_ram, int numa_node) {
+  release();
+  if (parents.config() == NULL) {
+    fprintf(stderr, "ERROR - parents cache is not open\n");
+    return 1;
+  }
+  size_t sector_size = parents.config()->sector_size;
+  layer_labels = allocate_layer(sector_size, numa_node);
+  if (!low_ram) {
+    exp_labels = allocate_layer(sector_size, numa_node);
+  }
+  if (layer_labels == NULL || (!low_ram && exp_labels == NULL)) {
+    release();
+    return 1;
+  }
+  return 0;
+}
+
+void label_context::release() {
+  if (layer_labels != NULL) {
+    free_layer(layer_labels, parents.config()->sector_size);
+  }
+  if (exp_labels != NULL) {
+    free_layer(exp_labels, parents.config()->sector_size);
+  }
+  layer_labels = NULL;
+  exp_labels   = NULL;
+  final_labels = NULL;
+}
+
+int label_context::run(const uint8_t replica_id[32], size_t num_layers,
+                       const char* output_dir,
+                       const label_placement_t* placement,
+                       layers_progress_t* status, const char* data_path) {
+  if (layer_labels == NULL) {
+    fprintf(stderr, "ERROR - label_context is not set up\n");
+    return 1;
+  }
+  uint8_t id[32];
+  std::memcpy(id, replica_id, sizeof(id));
+
+  // Placement is per thread, so it only applies to this sector
+  set_label_placement(placement);
+  int ret;
+  if (parents.compact() != NULL) {
+    ret = create_layers(*parents.config(), *parents.compact(), id,
+                        layer_labels, exp_labels, num_layers, output_dir,
+                        &final_labels, status, data_path);
+  } else {
+    ret = create_layers(*parents.config(), parents.flat(), id, layer_labels,
+                        exp_labels, num_layers, output_dir, &final_labels,
+                        status, data_path);
+  }
+  set_label_placement(NULL);
+  return ret;
+}
+
+size_t available_memory() {
+  std::ifstream meminfo("/proc/meminfo");
+  std::string   key;
+  size_t        kb;
+  while (meminfo >> key >> kb) {
+    if (key == "MemAvailable:") {
+      return kb << 10;
+    }
+    meminfo.ignore(64, '\n');
+  }
+  return 0;
+}
+
+label_scheduler::label_scheduler(const parents_handle& parents,
+                                 size_t max_cores, size_t max_memory,
+                                 bool pin)
+  : parents(parents), memory_budget(max_memory), memory_used(0),
+    running(0), peak(0), failed(0) {
+  if (max_cores == 0) {
+    max_cores = std::thread::hardware_concurrency();
+  }
+  if (memory_budget == 0) {
+    memory_budget = available_memory();
+  }
+  // One sector always runs, even with fewer cores than threads
+  size_t sector_threads = parents.threads_per_sector();
+  concurrency = std::max(max_cores / sector_threads, (size_t)1);
+
+  if (pin) {
+    cpu_topology_t topo;
+    if (load_cpu_topology(topo) == 0) {
+      plan_label_placement(topo, concurrency, sector_threads - 1,
+                           placements);
+    }
+  }
+  for (size_t i = 0; i < concurrency; i++) {
+    slots.push_back(concurrency - 1 - i);
+  }
+  kept.assign(concurrency, NULL);
+}
+
+label_scheduler::~label_scheduler() {
+  wait();
+  for (label_context* ctx : kept) {
+    delete ctx;
+  }
+}
+
+size_t label_scheduler::preallocate() {
+  std::lock_guard<std::mutex> guard(lock);
+  size_t layers_size = label_context::memory_size(*parents.config(), false);
+  size_t count = 0;
+  for (size_t slot = 0; slot < concurrency; slot++) {
+    if (kept[slot] == NULL) {
+      if (memory_used + layers_size > memory_budget) {
+        break;
+      }
+      // A slot whose allocation fails keeps setting up per job
+      label_context* ctx = new label_context(parents);
+      if (ctx->setup(false, placements.empty() ? -1 :
+                            placements[slot].numa_node) != 0) {
+        delete ctx;
+        break;
+      }
+      kept[slot] = ctx;
+      memory_used += layers_size;
+    }
+    count++;
+  }
+  return count;
+}
+
+size_t label_scheduler::job_memory(const label_job_t& job,
+                                   size_t slot) const {
+  if (kept[slot] != NULL && !job.low_ram) {
+    return 0;
+  }
+  return label_context::memory_size(*parents.config(), job.low_ram);
+}
+
+int label_scheduler::submit(const label_job_t& job) {
+  if (job.low_ram && job.output_dir.empty()) {
+    fprintf(stderr, "ERROR - low_ram jobs need an output_dir\n");
+    return 1;
+  }
+  if (!job.data_path.empty() && job.output_dir.empty()) {
+    fprintf(stderr, "ERROR - encoding jobs need an output_dir\n");
+    return 1;
+  }
+  if (label_context::memory_size(*parents.config(), job.low_ram) >
+      memory_budget) {
+    fprintf(stderr,
+            "ERROR - sector needs more than the %ld bytes memory budget\n",
+            memory_budget);
+    return 1;
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  queue.push_back(job);
+  admit();
+  return 0;
+}
+
+void label_scheduler::reap() {
+  // A finished thread only returns after adding itself, joining it doesn't
+  // wait on the lock
+  std::thread::id self = std::this_thread::get_id();
+  for (size_t i = 0; i < threads.size();) {
+    std::thread::id id = threads[i].get_id();
+    auto done = std::find(finished.begin(), finished.end(), id);
+    if (id == self || done == finished.end()) {
+      i++;
+      continue;
+    }
+    threads[i].join();
+    finished.erase(done);
+    threads[i] = std::move(threads.back());
+    threads.pop_back();
+  }
+}
+
+void label_scheduler::admit() {
+  // Threads of earlier jobs are joined here, a long running daemon keeps
+  // at most one per slot
+  reap();
+  // Strictly in order, so a large job is not starved by smaller ones
+  while (!queue.empty() && !slots.empty()) {
+    size_t slot   = slots.back();
+    size_t memory = job_memory(queue.front(), slot);
+    if (memory_used + memory > memory_budget) {
+      break;
+    }
+    slots.pop_back();
+    memory_used += memory;
+    running++;
+    peak = std::max(peak, running);
+    threads.emplace_back(&label_scheduler::run_job, this,
+                         std::move(queue.front()), slot);
+    queue.pop_front();
+  }
+}
+
+void label_scheduler::run_job(label_job_t job, size_t slot) {
+  const label_placement_t* placement =
+    placements.empty() ? NULL : &placements[slot];
+
+  // Preallocated layers are only used by jobs that need both
+  size_t memory = job_memory(job, slot);
+  label_context  local(parents);
+  label_context& ctx = memory == 0 ? *kept[slot] : local;
+  int ret = 0;
+  if (memory != 0) {
+    ret = ctx.setup(job.low_ram,
+                    placement != NULL ? placement->numa_node : -1);
+  }
+  if (ret == 0) {
+    ret = ctx.run(job.replica_id, job.num_layers,
+                  job.output_dir.empty() ? NULL : job.output_dir.c_str(),
+                  placement, job.progress,
+                  job.data_path.empty() ? NULL : job.data_path.c_str());
+  }
+  if (job.done) {
+    job.done(ret, ctx.labels());
+  }
+  local.release();
+
+  std::lock_guard<std::mutex> guard(lock);
+  memory_used -= memory;
+  running--;
+  failed += ret != 0;
+  slots.push_back(slot);
+  finished.push_back(std::this_thread::get_id());
+  admit();
+  idle.notify_all();
+}
+
+size_t label_scheduler::wait() {
+  std::vector<std::thread> done;
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    idle.wait(guard, [&] { return queue.empty() && running == 0; });
+    done.swap(threads);
+    finished.clear();
+  }
+  for (std::thread& t : done) {
+    t.join();
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  size_t ret = failed;
+  failed = 0;
+  return ret;
+}
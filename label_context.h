@@ -0,0 +1,178 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __LABEL_CONTEXT_H__
+#define __LABEL_CONTEXT_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include "create_labels.h"
+#include "compact_parents.h"
+#include "topology.h"
+#include "layer_pipeline.h"
+
+// Reentrant labeling API
+//
+// setup_create_label_memory keeps one sector in file statics. Here the
+// parents cache is opened once per process as a read-only parents_handle
+// and each sector gets a label_context owning its layers. create_label
+// keeps the ring buffer and producer threads on the stack of the calling
+// thread, so contexts on different threads label concurrently against the
+// same handle. label_scheduler runs a queue of sectors that way, as many
+// at a time as the cores and memory allow.
+
+// Read-only parents cache, flat or compact, shared by every sector of its
+// size in the process. Has to outlive the contexts using it.
+class parents_handle {
+public:
+  parents_handle();
+  ~parents_handle();
+
+  // Map the lotus cache file of config, or generate it
+  int open(const sector_config_t& config);
+  // Load a compact cache written by gen_parents_cache
+  int open_compact(const sector_config_t& config, const char* filename);
+  void close();
+
+  const sector_config_t* config() const { return cfg; }
+  // Exactly one of these is set while open
+  uint32_t*              flat() const { return flat_cache; }
+  const compact_parents* compact() const { return compact_cache; }
+  // Resident bytes
+  size_t                 size() const;
+  // Labeling threads per sector, the consumer and the layer 2+ producers
+  size_t                 threads_per_sector() const;
+
+private:
+  parents_handle(const parents_handle&) = delete;
+  parents_handle& operator=(const parents_handle&) = delete;
+
+  const sector_config_t* cfg;
+  uint32_t*              flat_cache;
+  compact_parents*       compact_cache;
+};
+
+// Layers of one sector. run() labels on the calling thread, which becomes
+// the consumer of every layer.
+class label_context {
+public:
+  explicit label_context(const parents_handle& parents);
+  ~label_context();
+
+  // Allocate the layers, bound to numa_node when it is not negative.
+  // low_ram keeps a single layer (see create_layers), run() then needs an
+  // output_dir.
+  int setup(bool low_ram = false, int numa_node = -1);
+  void release();
+
+  // Label num_layers layers, written to output_dir when it is not NULL.
+  // Threads are pinned following placement and status follows the
+  // labeling when they are not NULL. data_path is encoded into a replica,
+  // see create_layers.
+  int run(const uint8_t replica_id[32], size_t num_layers,
+          const char* output_dir,
+          const label_placement_t* placement = NULL,
+          layers_progress_t* status = NULL,
+          const char* data_path = NULL);
+
+  // Labels of the last layer of the last run
+  const uint32_t* labels() const { return final_labels; }
+
+  // Layer memory setup() allocates
+  static size_t memory_size(const sector_config_t& config, bool low_ram);
+
+private:
+  label_context(const label_context&) = delete;
+  label_context& operator=(const label_context&) = delete;
+
+  const parents_handle& parents;
+  uint32_t*             layer_labels;
+  uint32_t*             exp_labels;
+  uint32_t*             final_labels;
+};
+
+struct label_job_t {
+  uint8_t            replica_id[32];
+  size_t             num_layers = LAYER_COUNT;
+  std::string        output_dir;        // Empty to keep the layers in memory
+  bool               low_ram = false;   // One layer in memory, needs output_dir
+  std::string        data_path;         // Unsealed data to encode, needs
+                                        // output_dir. Empty for none.
+  layers_progress_t* progress = NULL;   // Followed while the job runs
+  // Called on the job thread once labeling finished, with the labels of
+  // the last layer (NULL if the job failed before labeling)
+  std::function<void(int ret, const uint32_t* labels)> done;
+};
+
+// Runs queued sectors concurrently in this process. Jobs start in
+// submission order when their threads fit in the free cores and their
+// layers in the free memory.
+class label_scheduler {
+public:
+  // max_cores 0 uses all online CPUs, max_memory 0 the MemAvailable of
+  // /proc/meminfo at construction. With pin every running sector gets its
+  // own cores and NUMA local layers from plan_label_placement.
+  label_scheduler(const parents_handle& parents, size_t max_cores = 0,
+                  size_t max_memory = 0, bool pin = false);
+  // Waits for the queued jobs
+  ~label_scheduler();
+
+  // Allocate and prefault the layers of every slot now and keep them for
+  // the following jobs, as far as the memory budget and the allocations
+  // allow. Jobs then start without any setup cost. Returns the number of
+  // slots with layers.
+  size_t preallocate();
+
+  // Queue a job. Fails if it could never be admitted.
+  int submit(const label_job_t& job);
+
+  // Block until every submitted job finished. Returns the number of jobs
+  // that failed.
+  size_t wait();
+
+  // Sectors the limits allow at once
+  size_t max_concurrent() const { return concurrency; }
+  // Most sectors seen running at once
+  size_t peak_running() const { return peak; }
+
+private:
+  label_scheduler(const label_scheduler&) = delete;
+  label_scheduler& operator=(const label_scheduler&) = delete;
+
+  // Start queued jobs while they fit, with lock held
+  void admit();
+  // Join the threads of finished jobs but the calling one, with lock held
+  void reap();
+  // Memory a job adds on slot
+  size_t job_memory(const label_job_t& job, size_t slot) const;
+  void run_job(label_job_t job, size_t slot);
+
+  const parents_handle&          parents;
+  size_t                         concurrency;
+  size_t                         memory_budget;
+  size_t                         memory_used;
+  std::vector<label_placement_t> placements;  // By slot, empty without pin
+  std::vector<size_t>            slots;       // Free slots
+  std::vector<label_context*>    kept;        // Preallocated layers by slot
+  std::deque<label_job_t>        queue;
+  std::vector<std::thread>       threads;
+  std::vector<std::thread::id>   finished;    // Threads done with their job
+  size_t                         running;
+  size_t                         peak;
+  size_t                         failed;
+  std::mutex                     lock;
+  std::condition_variable        idle;
+};
+
+// MemAvailable from /proc/meminfo in bytes, 0 if it can't be read
+size_t available_memory();
+
+#endif // __LABEL_CONTEXT_H__
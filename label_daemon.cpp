@@ -0,0 +1,329 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>       // uint*
+#include <cctype>        // isxdigit
+#include <cstdio>        // printf
+#include <cstdlib>       // strtoul
+#include <cstring>       // strerror
+#include <sstream>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>    // mkdir
+#include <sys/time.h>    // timeval
+#include <sys/un.h>
+#include <errno.h>
+#include <unistd.h>
+#include "label_daemon.h"
+#include "label_metrics.h"
+
+label_daemon::label_daemon()
+  : listen_fd(-1), next_id(1), connections(0), stopping(false) {}
+
+label_daemon::~label_daemon() {
+  if (listen_fd >= 0) {
+    close(listen_fd);
+    unlink(socket_path.c_str());
+  }
+}
+
+int label_daemon::start(const char* path,
+                        const std::vector<size_t>& sector_sizes,
+                        size_t max_cores, bool pin) {
+  for (size_t sector_size : sector_sizes) {
+    const sector_config_t* config = get_sector_config(sector_size);
+    if (config == NULL) {
+      printf("ERROR - unsupported sector size %ld\n", sector_size);
+      return 1;
+    }
+    std::unique_ptr<sector_service_t> service(new sector_service_t());
+    if (service->parents.open(*config) != 0) {
+      return 1;
+    }
+    service->scheduler.reset(new label_scheduler(service->parents, max_cores,
+                                                 0, pin));
+    size_t kept = service->scheduler->preallocate();
+    printf("Serving %ld byte sectors, %ld at a time, %ld preallocated\n",
+           sector_size, service->scheduler->max_concurrent(), kept);
+    services[sector_size] = std::move(service);
+  }
+
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    printf("ERROR - socket path %s is too long\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+  socket_path = path;
+
+  // A socket left behind by a daemon that died is replaced, one that
+  // still accepts connections is left to its daemon
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      printf("ERROR - %s exists and is not a socket\n", path);
+      return 1;
+    }
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool live = probe >= 0 &&
+                connect(probe, (sockaddr*)&addr, sizeof(addr)) == 0;
+    if (probe >= 0) {
+      close(probe);
+    }
+    if (live) {
+      printf("ERROR - a daemon is already listening on %s\n", path);
+      return 1;
+    }
+    unlink(path);
+  }
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0 ||
+      bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(listen_fd, 64) != 0) {
+    printf("listen on %s failed err %s\n", path, strerror(errno));
+    return 1;
+  }
+  printf("Listening on %s\n", path);
+  return 0;
+}
+
+void label_daemon::serve() {
+  while (!stopping.load()) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EINTR && !stopping.load()) {
+        printf("accept failed err %s\n", strerror(errno));
+      }
+      continue;
+    }
+    // A client that stops sending or reading is dropped, it would hold
+    // its thread and shutdown
+    struct timeval timeout = { LABEL_DAEMON_IO_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (connections >= LABEL_DAEMON_MAX_CONNECTIONS) {
+        const char busy[] = "error too many connections\n";
+        send(fd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(fd);
+        continue;
+      }
+      connections++;
+    }
+    // Connections are short except for wait, which blocks on its job
+    std::thread([this, fd]() {
+      handle(fd);
+      std::lock_guard<std::mutex> guard(lock);
+      connections--;
+      changed.notify_all();
+    }).detach();
+  }
+
+  for (auto& service : services) {
+    service.second->scheduler->wait();
+  }
+  std::unique_lock<std::mutex> guard(lock);
+  changed.wait(guard, [&] { return connections == 0; });
+}
+
+static bool parse_replica_id(const std::string& hex, uint8_t replica_id[32]) {
+  if (hex.size() != 64) {
+    return false;
+  }
+  // strtoul alone would take a sign or a space
+  for (size_t i = 0; i < 32; i++) {
+    std::string byte = hex.substr(i * 2, 2);
+    if (!isxdigit((unsigned char)byte[0]) ||
+        !isxdigit((unsigned char)byte[1])) {
+      return false;
+    }
+    replica_id[i] = (uint8_t)strtoul(byte.c_str(), NULL, 16);
+  }
+  return true;
+}
+
+std::string label_daemon::submit(const std::string& args) {
+  std::istringstream in(args);
+  size_t      sector_size = 0;
+  std::string replica_hex;
+  size_t      num_layers = 0;
+  std::string output_dir;
+  std::string data_path;
+  if (!(in >> sector_size >> replica_hex >> num_layers >> output_dir)) {
+    return "error usage: submit <sector_size> <replica_id> <num_layers> "
+           "<output_dir | -> [data_file]";
+  }
+  in >> data_path;
+  auto service = services.find(sector_size);
+  if (service == services.end()) {
+    return "error sector size " + std::to_string(sector_size) +
+           " is not served";
+  }
+  label_job_t job;
+  if (!parse_replica_id(replica_hex, job.replica_id)) {
+    return "error replica_id must be 64 hex digits";
+  }
+  if (num_layers == 0) {
+    return "error num_layers must be at least 1";
+  }
+  job.num_layers = num_layers;
+  if (output_dir != "-") {
+    if (mkdir(output_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      return "error mkdir " + output_dir + ": " + strerror(errno);
+    }
+    job.output_dir = output_dir;
+  }
+  if (!data_path.empty()) {
+    if (job.output_dir.empty()) {
+      return "error encoding a replica needs an output_dir";
+    }
+    job.data_path = data_path;
+  }
+
+  job_t* state;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (stopping.load()) {
+      return "error shutting down";
+    }
+    std::unique_ptr<job_t> entry(new job_t());
+    entry->id          = next_id++;
+    entry->sector_size = sector_size;
+    entry->progress.layer.store(0);
+    entry->progress.nodes.store(0);
+    entry->state       = JOB_QUEUED;
+    entry->waiters     = 0;
+    state = entry.get();
+    jobs[state->id] = std::move(entry);
+    trim();
+  }
+  job.progress = &state->progress;
+  job.done = [this, state](int ret, const uint32_t*) {
+    std::lock_guard<std::mutex> guard(lock);
+    state->state = ret == 0 ? JOB_DONE : JOB_FAILED;
+    changed.notify_all();
+  };
+  if (service->second->scheduler->submit(job) != 0) {
+    std::lock_guard<std::mutex> guard(lock);
+    state->state = JOB_FAILED;
+    return "error job rejected";
+  }
+  return "ok " + std::to_string(state->id);
+}
+
+std::string label_daemon::status_line(const job_t& job) const {
+  const char* state = job.state == JOB_DONE   ? "done" :
+                      job.state == JOB_FAILED ? "failed" :
+                      job.progress.layer.load() > 0 ? "running" : "queued";
+  return std::to_string(job.id) + " " + state + " " +
+         std::to_string(job.progress.layer.load()) + " " +
+         std::to_string(job.progress.nodes.load());
+}
+
+label_daemon::job_t* label_daemon::find(const std::string& args) {
+  auto job = jobs.find(strtoull(args.c_str(), NULL, 10));
+  return job == jobs.end() ? NULL : job->second.get();
+}
+
+void label_daemon::release(job_t* job) {
+  if (job->state != JOB_QUEUED && job->waiters == 0) {
+    jobs.erase(job->id);
+  }
+}
+
+void label_daemon::trim() {
+  size_t finished = 0;
+  for (auto& job : jobs) {
+    finished += job.second->state != JOB_QUEUED;
+  }
+  // Ids grow with submission, the map starts at the oldest
+  for (auto job = jobs.begin();
+       job != jobs.end() && finished > LABEL_DAEMON_MAX_FINISHED;) {
+    if (job->second->state != JOB_QUEUED && job->second->waiters == 0) {
+      job = jobs.erase(job);
+      finished--;
+    } else {
+      ++job;
+    }
+  }
+}
+
+void label_daemon::handle(int fd) {
+  // One request line per connection
+  std::string request;
+  char buf[256];
+  while (request.find('\n') == std::string::npos &&
+         request.size() < LABEL_DAEMON_MAX_REQUEST) {
+    ssize_t ret = read(fd, buf, sizeof(buf));
+    if (ret < 0) {
+      // Timed out before a whole request
+      close(fd);
+      return;
+    }
+    if (ret == 0) {
+      break;
+    }
+    request.append(buf, ret);
+  }
+  request = request.substr(0, request.find('\n'));
+  std::string command = request.substr(0, request.find(' '));
+  std::string args    = request.size() > command.size() ?
+                        request.substr(command.size() + 1) : "";
+
+  std::string reply;
+  if (command == "submit") {
+    reply = submit(args);
+  } else if (command == "status" || command == "wait") {
+    std::unique_lock<std::mutex> guard(lock);
+    job_t* job = find(args);
+    if (job == NULL) {
+      reply = "error no job " + args;
+    } else {
+      if (command == "wait") {
+        job->waiters++;
+        changed.wait(guard, [&] { return job->state != JOB_QUEUED; });
+        job->waiters--;
+      }
+      reply = status_line(*job);
+      release(job);
+    }
+  } else if (command == "list") {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto& job : jobs) {
+      reply += (reply.empty() ? "" : "\n") + status_line(*job.second);
+    }
+  } else if (command == "metrics") {
+    reply = args == "json" ? label_metrics_json() :
+                             label_metrics_prometheus();
+    // Both end in a newline, one is added below
+    if (!reply.empty()) {
+      reply.pop_back();
+    }
+  } else if (command == "shutdown") {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping.store(true);
+    }
+    // Wakes the accept in serve()
+    shutdown(listen_fd, SHUT_RDWR);
+    for (auto& service : services) {
+      service.second->scheduler->wait();
+    }
+    reply = "ok";
+  } else {
+    reply = "error unknown command " + command;
+  }
+
+  reply += "\n";
+  for (size_t done = 0; done < reply.size();) {
+    ssize_t ret = write(fd, reply.data() + done, reply.size() - done);
+    if (ret <= 0) {
+      break;
+    }
+    done += ret;
+  }
+  close(fd);
+}
@@ -0,0 +1,111 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __LABEL_DAEMON_H__
+#define __LABEL_DAEMON_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include "label_context.h"
+
+// Resident labeling service
+//
+// Keeps a parents_handle and a label_scheduler with preallocated layers
+// for every sector size it serves, and takes jobs over a local UNIX stream
+// socket. Each connection carries one request line and gets the reply,
+// then the daemon closes it:
+//
+//   submit <sector_size> <replica_id hex> <num_layers> <output_dir | ->
+//          [data_file]
+//     -> ok <job>
+//   status <job>   -> <job> <queued|running|done|failed> <layer> <nodes>
+//   wait <job>     -> the status line once the job finished
+//   list           -> a status line per job
+//   metrics [json] -> label_metrics_prometheus, or label_metrics_json
+//   shutdown       -> ok, after the running and queued jobs finished
+//
+// Errors reply "error <message>". Output directories are created if
+// missing, "-" keeps the layers in memory only. A data_file is encoded
+// with the last layer into the replica file of output_dir. A finished job
+// is forgotten once status or wait reported it, and beyond the newest
+// LABEL_DAEMON_MAX_FINISHED finished jobs. A request has to arrive within
+// LABEL_DAEMON_IO_TIMEOUT, beyond LABEL_DAEMON_MAX_CONNECTIONS open
+// connections (waits included) new ones get an error.
+
+// Default socket path of sdr_daemon and sdr_client
+const char* const LABEL_DAEMON_SOCKET = "/tmp/sdr-label.sock";
+// Longest request line
+const size_t LABEL_DAEMON_MAX_REQUEST = 4096;
+// Finished jobs kept for status and list until they are reported
+const size_t LABEL_DAEMON_MAX_FINISHED = 1024;
+// Seconds a client may take to send its request or read the reply
+const long   LABEL_DAEMON_IO_TIMEOUT = 10;
+// Connections handled at once, one thread each
+const size_t LABEL_DAEMON_MAX_CONNECTIONS = 256;
+
+class label_daemon {
+public:
+  label_daemon();
+  ~label_daemon();
+
+  // Open the parents cache and preallocate the layers of every size in
+  // sector_sizes, then listen on socket_path. max_cores and pin are passed
+  // to each size's label_scheduler. Fails if another daemon answers on
+  // socket_path, a stale socket is replaced.
+  int start(const char* socket_path, const std::vector<size_t>& sector_sizes,
+            size_t max_cores = 0, bool pin = false);
+
+  // Accept connections until a shutdown request, then wait for the jobs
+  void serve();
+
+private:
+  // Queued jobs are running once progress.layer is set
+  enum job_state_t { JOB_QUEUED, JOB_DONE, JOB_FAILED };
+
+  struct job_t {
+    uint64_t          id;
+    size_t            sector_size;
+    layers_progress_t progress;
+    job_state_t       state;
+    size_t            waiters;      // wait requests blocked on the job
+  };
+
+  // One served sector size
+  struct sector_service_t {
+    parents_handle                   parents;
+    std::unique_ptr<label_scheduler> scheduler;
+  };
+
+  label_daemon(const label_daemon&) = delete;
+  label_daemon& operator=(const label_daemon&) = delete;
+
+  void handle(int fd);
+  std::string submit(const std::string& args);
+  // With lock held
+  std::string status_line(const job_t& job) const;
+  job_t* find(const std::string& args);
+  // Drop job if it finished and no wait still needs it, with lock held
+  void release(job_t* job);
+  // Drop the oldest finished jobs beyond LABEL_DAEMON_MAX_FINISHED
+  void trim();
+
+  std::string socket_path;
+  int         listen_fd;
+  std::map<size_t, std::unique_ptr<sector_service_t>> services;
+  std::map<uint64_t, std::unique_ptr<job_t>>          jobs;
+  uint64_t                next_id;
+  size_t                  connections;    // Requests being handled
+  std::atomic<bool>       stopping;
+  std::mutex              lock;
+  std::condition_variable changed;        // A job or connection finished
+};
+
+#endif // __LABEL_DAEMON_H__
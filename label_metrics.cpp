@@ -0,0 +1,285 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>       // uint*
+#include <cstdio>        // fprintf
+#include <cstring>       // strlen, strcmp
+#include <deque>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include "label_metrics.h"
+
+// Sums of every recorded layer with the same layer number
+struct layer_totals_t {
+  uint64_t      count;        // Layers recorded
+  uint64_t      nodes;        // Nodes of all lanes
+  uint64_t      perf_nodes;   // of which counted with perf
+  double        seconds;
+  double        last_rate;    // Nodes per second of the last layer
+  label_stats_t stats;
+  uint64_t      perf[PERF_COUNTER_COUNT];
+};
+
+static std::mutex                         metrics_lock;
+static std::deque<layer_metrics_t>        metrics_recent;
+static std::map<uint32_t, layer_totals_t> metrics_totals;
+static std::atomic<bool>                  metrics_perf(false);
+
+bool label_metrics_enabled() {
+#ifdef LABEL_METRICS
+  return true;
+#else
+  return false;
+#endif
+}
+
+void set_label_metrics_perf(bool enable) {
+  metrics_perf.store(enable);
+}
+
+bool get_label_metrics_perf() {
+  return metrics_perf.load();
+}
+
+static void add_stats(label_stats_t& dst, const label_stats_t& src) {
+  dst.producer_not_ready   += src.producer_not_ready;
+  dst.wait_ns              += src.wait_ns;
+  dst.gather_reads         += src.gather_reads;
+  dst.gather_hits          += src.gather_hits;
+  dst.producer_waits       += src.producer_waits;
+  dst.backpressure_ns      += src.backpressure_ns;
+  dst.base_parents         += src.base_parents;
+  dst.base_parents_missing += src.base_parents_missing;
+  for (size_t i = 0; i < WAIT_HIST_BUCKETS; i++) {
+    dst.wait_hist[i]         += src.wait_hist[i];
+    dst.backpressure_hist[i] += src.backpressure_hist[i];
+  }
+}
+
+void record_layer_metrics(const layer_metrics_t& metrics) {
+  std::lock_guard<std::mutex> guard(metrics_lock);
+  metrics_recent.push_back(metrics);
+  if (metrics_recent.size() > LABEL_METRICS_HISTORY) {
+    metrics_recent.pop_front();
+  }
+
+  auto it = metrics_totals.find(metrics.layer);
+  if (it == metrics_totals.end()) {
+    it = metrics_totals.emplace(metrics.layer, layer_totals_t()).first;
+  }
+  layer_totals_t& totals = it->second;
+  uint64_t nodes = metrics.nodes * metrics.lanes;
+  totals.count++;
+  totals.nodes   += nodes;
+  totals.seconds += metrics.seconds;
+  totals.last_rate = metrics.seconds > 0 ? nodes / metrics.seconds : 0;
+  add_stats(totals.stats, metrics.stats);
+  if (metrics.has_perf) {
+    totals.perf_nodes += nodes;
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+      totals.perf[i] += metrics.perf[i];
+    }
+  }
+}
+
+void reset_label_metrics() {
+  std::lock_guard<std::mutex> guard(metrics_lock);
+  metrics_recent.clear();
+  metrics_totals.clear();
+}
+
+static double ratio(uint64_t num, uint64_t den) {
+  return den == 0 ? 0 : (double)num / den;
+}
+
+// Bucket counts up to the last non-empty one
+static void json_hist(std::ostream& out, const uint64_t* hist) {
+  size_t used = WAIT_HIST_BUCKETS;
+  while (used > 0 && hist[used - 1] == 0) {
+    used--;
+  }
+  out << "[";
+  for (size_t i = 0; i < used; i++) {
+    out << (i == 0 ? "" : ",") << hist[i];
+  }
+  out << "]";
+}
+
+static void json_stats(std::ostream& out, const label_stats_t& stats) {
+  out << "\"consumer_stalls\":" << stats.producer_not_ready
+      << ",\"consumer_stall_ns\":" << stats.wait_ns
+      << ",\"consumer_stall_hist\":";
+  json_hist(out, stats.wait_hist);
+  out << ",\"producer_waits\":" << stats.producer_waits
+      << ",\"producer_wait_ns\":" << stats.backpressure_ns
+      << ",\"producer_wait_hist\":";
+  json_hist(out, stats.backpressure_hist);
+  out << ",\"base_parents\":" << stats.base_parents
+      << ",\"base_parents_missing\":" << stats.base_parents_missing
+      << ",\"base_parent_missing_rate\":"
+      << ratio(stats.base_parents_missing, stats.base_parents)
+      << ",\"gather_reads\":" << stats.gather_reads
+      << ",\"gather_hits\":" << stats.gather_hits;
+}
+
+static void json_perf(std::ostream& out, const uint64_t* perf,
+                      uint64_t nodes) {
+  out << ",\"perf\":{";
+  for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+    const char* name = perf_counters::name((perf_counter_t)i);
+    out << (i == 0 ? "" : ",") << "\"" << name << "\":" << perf[i]
+        << ",\"" << name << "/node\":" << ratio(perf[i], nodes);
+  }
+  out << "}";
+}
+
+std::string label_metrics_json() {
+  std::lock_guard<std::mutex> guard(metrics_lock);
+  std::ostringstream out;
+  out.precision(9);
+  out << "{\"enabled\":" << (label_metrics_enabled() ? "true" : "false")
+      << ",\"hist_buckets\":\"bucket i counts waits of [2^i, 2^(i+1)) ns\""
+      << ",\"layers\":[";
+  bool first = true;
+  for (const layer_metrics_t& m : metrics_recent) {
+    uint64_t nodes = m.nodes * m.lanes;
+    out << (first ? "" : ",") << "\n{\"layer\":" << m.layer
+        << ",\"lanes\":" << m.lanes << ",\"nodes\":" << m.nodes
+        << ",\"seconds\":" << m.seconds
+        << ",\"nodes_per_sec\":" << (m.seconds > 0 ? nodes / m.seconds : 0)
+        << ",";
+    json_stats(out, m.stats);
+    if (m.has_perf) {
+      json_perf(out, m.perf, nodes);
+    }
+    out << "}";
+    first = false;
+  }
+  out << "],\"totals\":[";
+  first = true;
+  for (const auto& entry : metrics_totals) {
+    const layer_totals_t& t = entry.second;
+    out << (first ? "" : ",") << "\n{\"layer\":" << entry.first
+        << ",\"count\":" << t.count << ",\"nodes\":" << t.nodes
+        << ",\"seconds\":" << t.seconds
+        << ",\"nodes_per_sec\":" << (t.seconds > 0 ? t.nodes / t.seconds : 0)
+        << ",";
+    json_stats(out, t.stats);
+    if (t.perf_nodes != 0) {
+      json_perf(out, t.perf, t.perf_nodes);
+    }
+    out << "}";
+    first = false;
+  }
+  out << "]}\n";
+  return out.str();
+}
+
+static void prom_header(std::ostream& out, const char* name,
+                        const char* type, const char* help) {
+  out << "# HELP " << name << " " << help << "\n"
+      << "# TYPE " << name << " " << type << "\n";
+}
+
+// One value per layer number
+template<typename VALUE>
+static void prom_metric(std::ostream& out, const char* name,
+                        const char* type, const char* help, VALUE value) {
+  prom_header(out, name, type, help);
+  for (const auto& entry : metrics_totals) {
+    out << name << "{layer=\"" << entry.first << "\"} "
+        << value(entry.second) << "\n";
+  }
+}
+
+// Wait histogram in seconds, buckets are cumulative in Prometheus
+// The last bucket also holds longer waits, it only goes into +Inf.
+typedef uint64_t (label_stats_t::* wait_hist_field_t)[WAIT_HIST_BUCKETS];
+
+static void prom_hist(std::ostream& out, const char* name, const char* help,
+                      wait_hist_field_t hist_field,
+                      uint64_t label_stats_t::* ns_field) {
+  prom_header(out, name, "histogram", help);
+  for (const auto& entry : metrics_totals) {
+    const label_stats_t& stats = entry.second.stats;
+    const uint64_t* hist = stats.*hist_field;
+    uint64_t count = 0;
+    for (size_t i = 0; i < WAIT_HIST_BUCKETS - 1; i++) {
+      count += hist[i];
+      out << name << "_bucket{layer=\"" << entry.first << "\",le=\""
+          << (double)(2UL << i) * 1e-9 << "\"} " << count << "\n";
+    }
+    count += hist[WAIT_HIST_BUCKETS - 1];
+    out << name << "_bucket{layer=\"" << entry.first << "\",le=\"+Inf\"} "
+        << count << "\n"
+        << name << "_sum{layer=\"" << entry.first << "\"} "
+        << stats.*ns_field * 1e-9 << "\n"
+        << name << "_count{layer=\"" << entry.first << "\"} " << count
+        << "\n";
+  }
+}
+
+std::string label_metrics_prometheus() {
+  std::lock_guard<std::mutex> guard(metrics_lock);
+  std::ostringstream out;
+  out.precision(9);
+  typedef const layer_totals_t& T;
+  prom_metric(out, "sdr_label_layers_total", "counter",
+              "Layers labeled", [](T t) { return t.count; });
+  prom_metric(out, "sdr_label_nodes_total", "counter",
+              "Nodes labeled, all lanes", [](T t) { return t.nodes; });
+  prom_metric(out, "sdr_label_seconds_total", "counter",
+              "Wall time labeling", [](T t) { return t.seconds; });
+  prom_metric(out, "sdr_label_nodes_per_second", "gauge",
+              "Labeling rate of the last layer",
+              [](T t) { return t.last_rate; });
+  prom_metric(out, "sdr_label_base_parents_total", "counter",
+              "Base parents of the labeled nodes",
+              [](T t) { return t.stats.base_parents; });
+  prom_metric(out, "sdr_label_base_parents_missing_total", "counter",
+              "Base parents producers left to the consumer",
+              [](T t) { return t.stats.base_parents_missing; });
+  prom_metric(out, "sdr_label_gather_reads_total", "counter",
+              "Pages read for low memory labeling",
+              [](T t) { return t.stats.gather_reads; });
+  prom_hist(out, "sdr_label_consumer_stall_seconds",
+            "Consumer waits for an unfilled node",
+            &label_stats_t::wait_hist, &label_stats_t::wait_ns);
+  prom_hist(out, "sdr_label_producer_wait_seconds",
+            "Producer waits for ring buffer space",
+            &label_stats_t::backpressure_hist,
+            &label_stats_t::backpressure_ns);
+
+  prom_metric(out, "sdr_label_perf_nodes_total", "counter",
+              "Nodes labeled with hardware counters on",
+              [](T t) { return t.perf_nodes; });
+  prom_header(out, "sdr_label_perf_events_total", "counter",
+              "Hardware events of the labeling threads");
+  for (const auto& entry : metrics_totals) {
+    if (entry.second.perf_nodes == 0) {
+      continue;
+    }
+    for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+      out << "sdr_label_perf_events_total{layer=\"" << entry.first
+          << "\",event=\"" << perf_counters::name((perf_counter_t)i) << "\"} "
+          << entry.second.perf[i] << "\n";
+    }
+  }
+  return out.str();
+}
+
+int write_label_metrics(const char* path) {
+  size_t len = strlen(path);
+  bool   prom = len >= 5 && strcmp(path + len - 5, ".prom") == 0;
+  std::ofstream out(path);
+  out << (prom ? label_metrics_prometheus() : label_metrics_json());
+  if (!out) {
+    fprintf(stderr, "write %s failed\n", path);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,58 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __LABEL_METRICS_H__
+#define __LABEL_METRICS_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include "create_labels.h"
+#include "perf_counters.h"
+
+// Per layer labeling metrics
+//
+// Built with -DLABEL_METRICS every create_label* call records a
+// layer_metrics_t: wall time, consumer stalls and producer backpressure
+// waits as histograms, the share of base parents the producers could not
+// fill, and optionally hardware counters of the labeling threads. Records
+// are kept process wide, so one export covers all the sectors a process
+// labels. Without the flag labeling only keeps the consumer stalls of
+// label_stats_t and nothing is recorded here.
+
+// Recent layers kept for label_metrics_json, totals cover all of them
+const size_t LABEL_METRICS_HISTORY = 256;
+
+struct layer_metrics_t {
+  uint32_t      layer;
+  size_t        lanes;
+  uint64_t      nodes;          // Nodes labeled in each lane
+  double        seconds;        // Wall time of the layer
+  label_stats_t stats;
+  bool          has_perf;       // perf holds counts of the layer's threads
+  uint64_t      perf[PERF_COUNTER_COUNT];
+};
+
+// True when built with -DLABEL_METRICS
+bool label_metrics_enabled();
+
+// Count cycles, LLC and dTLB misses of each layer through perf_event_open.
+// Off by default, a few syscalls per layer. Applies to labeling started
+// after the call.
+void set_label_metrics_perf(bool enable);
+bool get_label_metrics_perf();
+
+void record_layer_metrics(const layer_metrics_t& metrics);
+void reset_label_metrics();
+
+// The recent layers and the totals per layer number as JSON
+std::string label_metrics_json();
+// Totals per layer number in the Prometheus text exposition format
+std::string label_metrics_prometheus();
+
+// Write label_metrics_prometheus to path if it ends in ".prom", else
+// label_metrics_json. Returns non-zero on error.
+int write_label_metrics(const char* path);
+
+#endif // __LABEL_METRICS_H__
@@ -0,0 +1,269 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>       // uint*
+#include <cstdio>        // printf, rename
+#include <cstring>       // memset
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>      // getpid, unlink
+#include "label_tune.h"
+#include "compact_parents.h"
+
+// Candidates of each parameter, tried in this order
+// Layer 1 also tries the producer-less engine
+static const size_t TUNE_PRODUCERS_LAYER1[] = { 0, 1, 2, 3, 4 };
+static const size_t TUNE_PRODUCERS_EXP[]    = { 1, 2, 3, 4, 6, 8 };
+static const size_t TUNE_STRIDE_LAYER1[]    = { 4, 8, 16, 32, 64 };
+static const size_t TUNE_STRIDE_EXP[]       = { 16, 32, 64, 128, 256, 512 };
+static const size_t TUNE_LOOKAHEAD[]        = { 200, 400, 800, 1600, 3200 };
+
+// Fastest of LABEL_TUNE_PASSES passes over the first nodes, in ns per node
+template<typename PARENTS>
+static double time_pass(const sector_config_t& config, const PARENTS& parents,
+                        uint32_t* layer_labels, uint32_t* exp_labels,
+                        bool layer1, uint64_t nodes) {
+  uint8_t replica_id[32];
+  std::memset(replica_id, 0x5a, sizeof(replica_id));
+  double best = 0;
+  for (size_t pass = 0; pass < LABEL_TUNE_PASSES; pass++) {
+    auto start = std::chrono::steady_clock::now();
+    if (layer1) {
+      create_label(config, parents, replica_id, layer_labels, NULL, nodes, 1);
+    } else {
+      create_label(config, parents, replica_id, exp_labels, layer_labels,
+                   nodes, 2);
+    }
+    double ns = std::chrono::duration<double, std::nano>(
+      std::chrono::steady_clock::now() - start).count() / nodes;
+    best = pass == 0 ? ns : std::min(best, ns);
+  }
+  return best;
+}
+
+// Try every candidate for one field of params, keep the fastest
+template<typename PARENTS, size_t N>
+static void tune_field(const sector_config_t& config, const PARENTS& parents,
+                       uint32_t* layer_labels, uint32_t* exp_labels,
+                       bool layer1, uint64_t nodes, label_params_t& params,
+                       size_t label_params_t::* field,
+                       const size_t (&candidates)[N], size_t max_value) {
+  size_t best_value = params.*field;
+  double best_ns    = 0;
+  for (size_t value : candidates) {
+    if (value > max_value) {
+      continue;
+    }
+    label_params_t trial = params;
+    trial.*field = value;
+    set_label_params(layer1, trial);
+    double ns = time_pass(config, parents, layer_labels, exp_labels, layer1,
+                          nodes);
+    printf("tune layer %s lookahead %ld producers %ld stride %ld: "
+           "%.1f ns/node\n", layer1 ? "1" : "2+", trial.lookahead,
+           trial.num_producers, trial.producer_stride, ns);
+    if (best_ns == 0 || ns < best_ns) {
+      best_ns    = ns;
+      best_value = value;
+    }
+  }
+  params.*field = best_value;
+  set_label_params(layer1, params);
+}
+
+template<typename PARENTS>
+static int tune_label_params_impl(const sector_config_t& config,
+                                  const PARENTS& parents,
+                                  uint32_t* layer_labels,
+                                  uint32_t* exp_labels,
+                                  label_tuning_t& tuning,
+                                  uint64_t tune_nodes) {
+  uint64_t nodes = std::min(tune_nodes, (uint64_t)config.node_count);
+  // Leave a core to the consumer
+  size_t max_producers =
+    std::max((size_t)std::thread::hardware_concurrency(), (size_t)2) - 1;
+
+  for (bool layer1 : { true, false }) {
+    // Low memory mode has no second layer to calibrate layer 2 with
+    if (!layer1 && exp_labels == NULL) {
+      tuning.exp = get_label_params(false);
+      break;
+    }
+    label_params_t params = get_label_params(layer1);
+    if (layer1) {
+      tune_field(config, parents, layer_labels, exp_labels, layer1, nodes,
+                 params, &label_params_t::num_producers,
+                 TUNE_PRODUCERS_LAYER1, max_producers);
+      // No ring to tune without producers
+      if (params.num_producers == 0) {
+        tuning.layer1 = params;
+        continue;
+      }
+      tune_field(config, parents, layer_labels, exp_labels, layer1, nodes,
+                 params, &label_params_t::producer_stride,
+                 TUNE_STRIDE_LAYER1, SIZE_MAX);
+    } else {
+      tune_field(config, parents, layer_labels, exp_labels, layer1, nodes,
+                 params, &label_params_t::num_producers,
+                 TUNE_PRODUCERS_EXP, max_producers);
+      tune_field(config, parents, layer_labels, exp_labels, layer1, nodes,
+                 params, &label_params_t::producer_stride,
+                 TUNE_STRIDE_EXP, SIZE_MAX);
+    }
+    tune_field(config, parents, layer_labels, exp_labels, layer1, nodes,
+               params, &label_params_t::lookahead, TUNE_LOOKAHEAD, SIZE_MAX);
+    (layer1 ? tuning.layer1 : tuning.exp) = params;
+  }
+  return 0;
+}
+
+int tune_label_params(const sector_config_t& config, uint32_t* parents_cache,
+                      uint32_t* layer_labels, uint32_t* exp_labels,
+                      label_tuning_t& tuning, uint64_t tune_nodes) {
+  return tune_label_params_impl(config, parents_cache, layer_labels,
+                                exp_labels, tuning, tune_nodes);
+}
+
+int tune_label_params(const sector_config_t& config,
+                      const compact_parents& parents,
+                      uint32_t* layer_labels, uint32_t* exp_labels,
+                      label_tuning_t& tuning, uint64_t tune_nodes) {
+  return tune_label_params_impl(config, parents, layer_labels, exp_labels,
+                                tuning, tune_nodes);
+}
+
+std::string label_tune_key(size_t sector_size) {
+  // "model name" on x86, aarch64 only has the part number
+  std::ifstream cpuinfo("/proc/cpuinfo");
+  std::string   line;
+  std::string   model = "unknown";
+  while (std::getline(cpuinfo, line)) {
+    if (line.compare(0, 10, "model name") == 0 ||
+        line.compare(0, 8, "CPU part") == 0) {
+      model = line.substr(line.find(':') + 2);
+      break;
+    }
+  }
+  return std::to_string(sector_size) + " " +
+         std::to_string(std::thread::hardware_concurrency()) + " " + model;
+}
+
+// Line format: the six parameters (layer 1, then layers 2+) and the key
+static bool parse_tuning_line(const std::string& line, std::string& key,
+                              label_tuning_t& tuning) {
+  std::istringstream in(line);
+  if (!(in >> tuning.layer1.lookahead >> tuning.layer1.num_producers
+           >> tuning.layer1.producer_stride >> tuning.exp.lookahead
+           >> tuning.exp.num_producers >> tuning.exp.producer_stride)) {
+    return false;
+  }
+  std::getline(in >> std::ws, key);
+  return true;
+}
+
+int load_label_tuning(const char* path, const std::string& key,
+                      label_tuning_t& tuning) {
+  std::ifstream in(path);
+  std::string   line;
+  while (std::getline(in, line)) {
+    std::string    line_key;
+    label_tuning_t line_tuning;
+    if (parse_tuning_line(line, line_key, line_tuning) && line_key == key) {
+      tuning = line_tuning;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int save_label_tuning(const char* path, const std::string& key,
+                      const label_tuning_t& tuning) {
+  // Keep the entries of other hosts sharing the file
+  std::vector<std::string> lines;
+  {
+    std::ifstream in(path);
+    std::string   line;
+    while (std::getline(in, line)) {
+      std::string    line_key;
+      label_tuning_t line_tuning;
+      if (parse_tuning_line(line, line_key, line_tuning) && line_key != key) {
+        lines.push_back(line);
+      }
+    }
+  }
+  std::ostringstream entry;
+  entry << tuning.layer1.lookahead << " " << tuning.layer1.num_producers
+        << " " << tuning.layer1.producer_stride << " "
+        << tuning.exp.lookahead << " " << tuning.exp.num_producers << " "
+        << tuning.exp.producer_stride << " " << key;
+  lines.push_back(entry.str());
+
+  // Per process, concurrent tuners each rename a complete file
+  std::string tmp_path = std::string(path) + "." +
+                         std::to_string(getpid()) + ".tmp";
+  {
+    std::ofstream out(tmp_path);
+    for (const std::string& line : lines) {
+      out << line << "\n";
+    }
+    if (!out) {
+      printf("write %s failed\n", tmp_path.c_str());
+      unlink(tmp_path.c_str());
+      return 1;
+    }
+  }
+  if (rename(tmp_path.c_str(), path) != 0) {
+    printf("rename %s failed\n", path);
+    unlink(tmp_path.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+template<typename PARENTS>
+static int auto_tune_impl(const sector_config_t& config,
+                          const PARENTS& parents,
+                          uint32_t* layer_labels, uint32_t* exp_labels,
+                          const char* cache_path) {
+  std::string    key = label_tune_key(config.sector_size);
+  label_tuning_t tuning;
+  if (load_label_tuning(cache_path, key, tuning) == 0) {
+    printf("Using tuned label parameters from %s\n", cache_path);
+  } else {
+    printf("Tuning label parameters for %s\n", key.c_str());
+    if (tune_label_params(config, parents, layer_labels, exp_labels,
+                          tuning) != 0) {
+      return 1;
+    }
+    save_label_tuning(cache_path, key, tuning);
+  }
+  set_label_params(true, tuning.layer1);
+  set_label_params(false, tuning.exp);
+  printf("Label parameters layer 1 %ld/%ld/%ld, layers 2+ %ld/%ld/%ld "
+         "(lookahead/producers/stride)\n", tuning.layer1.lookahead,
+         tuning.layer1.num_producers, tuning.layer1.producer_stride,
+         tuning.exp.lookahead, tuning.exp.num_producers,
+         tuning.exp.producer_stride);
+  return 0;
+}
+
+int auto_tune_label_params(const sector_config_t& config,
+                           uint32_t* parents_cache,
+                           uint32_t* layer_labels, uint32_t* exp_labels,
+                           const char* cache_path) {
+  return auto_tune_impl(config, parents_cache, layer_labels, exp_labels,
+                        cache_path);
+}
+
+int auto_tune_label_params(const sector_config_t& config,
+                           const compact_parents& parents,
+                           uint32_t* layer_labels, uint32_t* exp_labels,
+                           const char* cache_path) {
+  return auto_tune_impl(config, parents, layer_labels, exp_labels,
+                        cache_path);
+}
@@ -0,0 +1,70 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __LABEL_TUNE_H__
+#define __LABEL_TUNE_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include "create_labels.h"
+
+// Auto-tuning of label_params_t
+//
+// The LABEL_PARAMS_* defaults were tuned on one machine. tune_label_params
+// labels a prefix of layer 1 and layer 2 with candidate parameters and
+// keeps the fastest, one parameter at a time starting from the defaults
+// (producers, then stride, then lookahead). Layer 1 includes 0 producers,
+// the producer-less engine, which has nothing else to tune. Results are
+// cached in a text file keyed by CPU model, CPU count and sector size, so
+// later runs on the same kind of host skip the calibration.
+
+// Default cache of tuned parameters
+const char* const LABEL_TUNE_CACHE = "/var/tmp/sdr-label-params";
+// Nodes labeled per calibration pass
+const uint64_t LABEL_TUNE_NODES = 1 << 16;
+// Passes per candidate, the fastest counts
+const size_t LABEL_TUNE_PASSES = 2;
+
+struct label_tuning_t {
+  label_params_t layer1;
+  label_params_t exp;
+};
+
+class compact_parents;
+
+// Calibrate on layer_labels and exp_labels, whose contents are clobbered.
+// Layers 2 and up keep their parameters when exp_labels is NULL. Leaves
+// the winning parameters applied (set_label_params).
+int tune_label_params(const sector_config_t& config, uint32_t* parents_cache,
+                      uint32_t* layer_labels, uint32_t* exp_labels,
+                      label_tuning_t& tuning,
+                      uint64_t tune_nodes = LABEL_TUNE_NODES);
+int tune_label_params(const sector_config_t& config,
+                      const compact_parents& parents,
+                      uint32_t* layer_labels, uint32_t* exp_labels,
+                      label_tuning_t& tuning,
+                      uint64_t tune_nodes = LABEL_TUNE_NODES);
+
+// Cache key of this host for a sector size
+std::string label_tune_key(size_t sector_size);
+
+// Read or add the entry for key. load returns non-zero if there is none.
+int load_label_tuning(const char* path, const std::string& key,
+                      label_tuning_t& tuning);
+int save_label_tuning(const char* path, const std::string& key,
+                      const label_tuning_t& tuning);
+
+// Apply the cached parameters for this host, calibrating and caching them
+// first if there are none
+int auto_tune_label_params(const sector_config_t& config,
+                           uint32_t* parents_cache,
+                           uint32_t* layer_labels, uint32_t* exp_labels,
+                           const char* cache_path = LABEL_TUNE_CACHE);
+int auto_tune_label_params(const sector_config_t& config,
+                           const compact_parents& parents,
+                           uint32_t* layer_labels, uint32_t* exp_labels,
+                           const char* cache_path = LABEL_TUNE_CACHE);
+
+#endif // __LABEL_TUNE_H__
@@ -0,0 +1,262 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>          // uint*
+#include <cstdio>           // printf
+#include <cstring>          // memcmp, strerror
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+#include <fcntl.h>          // open
+#include <errno.h>
+#include <unistd.h>         // close
+#include <sys/mman.h>       // mmap
+#include <sys/stat.h>       // fstat
+#include "label_verify.h"
+#include "compact_parents.h"
+#include "layer_pipeline.h"
+#include "sha256_multi.h"
+
+// Parents cache readers, one per verify thread
+struct flat_verify_parents {
+  const uint32_t* cache;
+
+  const uint32_t* get(uint64_t node, uint32_t*) {
+    return cache + node * PARENT_COUNT;
+  }
+};
+
+struct compact_verify_parents {
+  compact_parents::reader reader;
+  bool                    expanders;
+
+  const uint32_t* get(uint64_t node, uint32_t* parents) {
+    return reader.get(node, parents, expanders);
+  }
+};
+
+static flat_verify_parents verify_reader(const uint32_t* cache, uint32_t) {
+  return flat_verify_parents{cache};
+}
+
+static compact_verify_parents verify_reader(const compact_parents* cp,
+                                            uint32_t cur_layer) {
+  return compact_verify_parents{compact_parents::reader(*cp), cur_layer > 1};
+}
+
+// Lowest mismatch across threads
+static void update_first(std::atomic<int64_t>& first, int64_t node) {
+  int64_t cur = first.load();
+  while ((cur < 0 || node < cur) &&
+         !first.compare_exchange_weak(cur, node)) {
+  }
+}
+
+// A verify thread: claims LABEL_VERIFY_CHUNK entries of the node list
+// (every node when sample is empty) and recomputes them
+// SHA256_MULTI_MAX_LANES at a time
+template<typename PARENTS>
+static void verify_runner(PARENTS parents, const uint8_t* replica_id,
+                          const uint32_t* layer_labels,
+                          const uint32_t* exp_labels, uint32_t cur_layer,
+                          const std::vector<uint64_t>& sample, uint64_t total,
+                          std::atomic<uint64_t>& next,
+                          std::atomic<uint64_t>& mismatches,
+                          std::atomic<int64_t>& first_mismatch) {
+  const size_t MAX_LANES = SHA256_MULTI_MAX_LANES;
+  auto reader = verify_reader(parents, cur_layer);
+  uint64_t        nodes[MAX_LANES];
+  const uint32_t* node_parents[MAX_LANES];
+  uint32_t        parent_bufs[MAX_LANES][PARENT_COUNT];
+  uint32_t        labels[MAX_LANES * NODE_WORDS];
+  uint64_t        local_mismatches = 0;
+
+  while (true) {
+    uint64_t work = next.fetch_add(LABEL_VERIFY_CHUNK);
+    if (work >= total) {
+      break;
+    }
+    uint64_t end = std::min(work + LABEL_VERIFY_CHUNK, total);
+    for (uint64_t i = work; i < end; i += MAX_LANES) {
+      size_t count = std::min((uint64_t)MAX_LANES, end - i);
+      for (size_t n = 0; n < count; n++) {
+        nodes[n] = sample.empty() ? i + n : sample[i + n];
+        // Node 0 has no parents
+        node_parents[n] = nodes[n] == 0 ? NULL :
+                          reader.get(nodes[n], parent_bufs[n]);
+      }
+      compute_labels(replica_id, cur_layer, layer_labels, exp_labels,
+                     nodes, node_parents, count, labels);
+      for (size_t n = 0; n < count; n++) {
+        if (std::memcmp(labels + n * NODE_WORDS,
+                        layer_labels + nodes[n] * NODE_WORDS,
+                        NODE_SIZE) != 0) {
+          local_mismatches++;
+          update_first(first_mismatch, nodes[n]);
+        }
+      }
+    }
+  }
+  mismatches += local_mismatches;
+}
+
+template<typename PARENTS>
+static int verify_layer_impl(PARENTS parents, const uint8_t* replica_id,
+                             const uint32_t* layer_labels,
+                             const uint32_t* exp_labels,
+                             uint64_t num_nodes, uint32_t cur_layer,
+                             label_verify_result_t& result, uint64_t sample,
+                             size_t threads, uint64_t seed) {
+  result = label_verify_result_t();
+  result.first_mismatch = -1;
+  if (cur_layer > 1 && exp_labels == NULL) {
+    printf("ERROR - layer %d needs the previous layer\n", cur_layer);
+    return 1;
+  }
+  auto start = std::chrono::steady_clock::now();
+
+  // Sorted so the threads walk the layers in order
+  std::vector<uint64_t> nodes;
+  if (sample != 0 && sample < num_nodes) {
+    std::mt19937_64 rng(seed != 0 ? seed : std::random_device()());
+    std::uniform_int_distribution<uint64_t> pick(1, num_nodes - 1);
+    nodes.resize(sample);
+    nodes[0] = 0;
+    for (uint64_t i = 1; i < sample; i++) {
+      nodes[i] = pick(rng);
+    }
+    std::sort(nodes.begin(), nodes.end());
+  }
+  uint64_t total = nodes.empty() ? num_nodes : nodes.size();
+
+  if (threads == 0) {
+    threads = std::max(std::thread::hardware_concurrency(), 1U);
+  }
+  threads = std::max(std::min(threads, (size_t)((total + LABEL_VERIFY_CHUNK -
+                                                 1) / LABEL_VERIFY_CHUNK)),
+                     (size_t)1);
+
+  std::atomic<uint64_t> next(0);
+  std::atomic<uint64_t> mismatches(0);
+  std::atomic<int64_t>  first_mismatch(-1);
+  std::vector<std::thread> runners;
+  for (size_t t = 0; t < threads; t++) {
+    runners.emplace_back([&]() {
+      verify_runner(parents, replica_id, layer_labels, exp_labels, cur_layer,
+                    nodes, total, next, mismatches, first_mismatch);
+    });
+  }
+  for (std::thread& runner : runners) {
+    runner.join();
+  }
+
+  result.checked        = total;
+  result.mismatches     = mismatches;
+  result.first_mismatch = first_mismatch;
+  result.seconds        = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+  return 0;
+}
+
+int verify_layer(const uint32_t* parents_cache, const uint8_t* replica_id,
+                 const uint32_t* layer_labels, const uint32_t* exp_labels,
+                 uint64_t num_nodes, uint32_t cur_layer,
+                 label_verify_result_t& result, uint64_t sample,
+                 size_t threads, uint64_t seed) {
+  return verify_layer_impl(parents_cache, replica_id, layer_labels,
+                           exp_labels, num_nodes, cur_layer, result, sample,
+                           threads, seed);
+}
+
+int verify_layer(const compact_parents& parents, const uint8_t* replica_id,
+                 const uint32_t* layer_labels, const uint32_t* exp_labels,
+                 uint64_t num_nodes, uint32_t cur_layer,
+                 label_verify_result_t& result, uint64_t sample,
+                 size_t threads, uint64_t seed) {
+  return verify_layer_impl(&parents, replica_id, layer_labels, exp_labels,
+                           num_nodes, cur_layer, result, sample, threads,
+                           seed);
+}
+
+// Map a whole layer file read-only
+static const uint32_t* map_layer(const std::string& path, size_t size) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    printf("open %s failed err %s\n", path.c_str(), strerror(errno));
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < size) {
+    printf("ERROR - %s is shorter than a layer\n", path.c_str());
+    close(fd);
+    return NULL;
+  }
+  void* labels = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (labels == MAP_FAILED) {
+    printf("mmap %s failed err %s\n", path.c_str(), strerror(errno));
+    return NULL;
+  }
+  return (const uint32_t*)labels;
+}
+
+template<typename PARENTS>
+static int verify_layers_impl(const sector_config_t& config, PARENTS parents,
+                              const uint8_t* replica_id, size_t num_layers,
+                              const char* output_dir, uint64_t sample,
+                              size_t threads) {
+  const uint32_t* exp_labels = NULL;
+  int failed = 0;
+  for (size_t layer = 1; layer <= num_layers; layer++) {
+    const uint32_t* layer_labels =
+      map_layer(layer_filename(output_dir, layer), config.sector_size);
+    if (layer_labels == NULL) {
+      failed = -1;
+      break;
+    }
+
+    label_verify_result_t result;
+    int ret = verify_layer_impl(parents, replica_id, layer_labels, exp_labels,
+                                config.node_count, layer, result, sample,
+                                threads, 0);
+    if (exp_labels != NULL) {
+      munmap((void*)exp_labels, config.sector_size);
+    }
+    exp_labels = layer_labels;
+    if (ret != 0) {
+      failed = -1;
+      break;
+    }
+
+    printf("Layer %ld verify: %ld nodes in %.2fs, %ld mismatches", layer,
+           result.checked, result.seconds, result.mismatches);
+    if (result.mismatches != 0) {
+      printf(", first at node %ld", result.first_mismatch);
+      failed++;
+    }
+    printf("\n");
+  }
+  if (exp_labels != NULL) {
+    munmap((void*)exp_labels, config.sector_size);
+  }
+  return failed;
+}
+
+int verify_layers(const sector_config_t& config, const uint32_t* parents_cache,
+                  const uint8_t* replica_id, size_t num_layers,
+                  const char* output_dir, uint64_t sample, size_t threads) {
+  return verify_layers_impl(config, parents_cache, replica_id, num_layers,
+                            output_dir, sample, threads);
+}
+
+int verify_layers(const sector_config_t& config,
+                  const compact_parents& parents,
+                  const uint8_t* replica_id, size_t num_layers,
+                  const char* output_dir, uint64_t sample, size_t threads) {
+  return verify_layers_impl(config, &parents, replica_id, num_layers,
+                            output_dir, sample, threads);
+}
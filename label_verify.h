@@ -0,0 +1,61 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __LABEL_VERIFY_H__
+#define __LABEL_VERIFY_H__
+
+#include <cstdint>
+#include <cstddef>
+#include "create_labels.h"
+
+// Verification of finished layers
+//
+// Labeling is sequential, checking is not: with layer L and layer L - 1 in
+// hand every label of layer L can be recomputed on its own from the
+// parents cache and replica_id (compute_labels). verify_layer spreads the
+// nodes over all cores, or checks a random sample of them, and reports the
+// lowest mismatching node.
+
+// Nodes a verify thread claims at a time
+const uint64_t LABEL_VERIFY_CHUNK = 4096;
+
+struct label_verify_result_t {
+  uint64_t checked;         // Nodes recomputed
+  uint64_t mismatches;
+  int64_t  first_mismatch;  // Lowest mismatching node checked, -1 if none
+  double   seconds;
+};
+
+class compact_parents;
+
+// Check layer cur_layer in layer_labels against exp_labels, the previous
+// layer (NULL for layer 1). sample 0 checks every node, otherwise sample
+// random nodes (node 0 always included), drawn from seed or from
+// std::random_device when seed is 0. threads 0 uses every core. Returns
+// non-zero on errors, mismatches are only reported in result.
+int verify_layer(const uint32_t* parents_cache, const uint8_t* replica_id,
+                 const uint32_t* layer_labels, const uint32_t* exp_labels,
+                 uint64_t num_nodes, uint32_t cur_layer,
+                 label_verify_result_t& result, uint64_t sample = 0,
+                 size_t threads = 0, uint64_t seed = 0);
+int verify_layer(const compact_parents& parents, const uint8_t* replica_id,
+                 const uint32_t* layer_labels, const uint32_t* exp_labels,
+                 uint64_t num_nodes, uint32_t cur_layer,
+                 label_verify_result_t& result, uint64_t sample = 0,
+                 size_t threads = 0, uint64_t seed = 0);
+
+// Check layers 1 to num_layers written to output_dir by create_layers,
+// e.g. by another process or before a resume. Prints a line per layer and
+// returns the count of layers with mismatches, or -1 on errors.
+int verify_layers(const sector_config_t& config, const uint32_t* parents_cache,
+                  const uint8_t* replica_id, size_t num_layers,
+                  const char* output_dir, uint64_t sample = 0,
+                  size_t threads = 0);
+int verify_layers(const sector_config_t& config,
+                  const compact_parents& parents,
+                  const uint8_t* replica_id, size_t num_layers,
+                  const char* output_dir, uint64_t sample = 0,
+                  size_t threads = 0);
+
+#endif // __LABEL_VERIFY_H__
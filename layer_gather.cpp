@@ -0,0 +1,181 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>       // uint*
+#include <cstdio>        // fprintf
+#include <cstring>       // memcpy
+#include <algorithm>
+#include <sys/mman.h>    // mmap
+#include <sys/stat.h>    // fstat
+#include <fcntl.h>       // fcntl, posix_fadvise
+#include <unistd.h>      // pread
+#include <errno.h>
+#include "create_labels.h"
+#include "layer_gather.h"
+
+// Cache tag of an empty slot
+const uint64_t GATHER_NO_PAGE = ~0ULL;
+
+layer_gather::layer_gather()
+  : reads(0), hits(0), fd(-1), file_size(0), block_size(GATHER_PAGE_SIZE),
+    buffers(NULL), cache(NULL), cache_pages(0), cache_blocks(0),
+    max_in_flight(0) {}
+
+layer_gather::~layer_gather() {
+  if (buffers != NULL) {
+    munmap(buffers, max_in_flight * GATHER_PAGE_SIZE);
+  }
+  if (cache != NULL) {
+    munmap(cache, cache_pages * GATHER_PAGE_SIZE);
+  }
+}
+
+// Smallest read the file takes: O_DIRECT files are probed for
+// GATHER_MIN_BLOCK_SIZE reads, buffered ones read whole pages with
+// readahead off since parents are spread over the whole layer
+static size_t gather_block_size(int fd, uint64_t file_size, uint8_t* buf) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || (flags & O_DIRECT) == 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+    return GATHER_PAGE_SIZE;
+  }
+  if (file_size >= 2 * GATHER_MIN_BLOCK_SIZE &&
+      pread(fd, buf, GATHER_MIN_BLOCK_SIZE, GATHER_MIN_BLOCK_SIZE) ==
+      (ssize_t)GATHER_MIN_BLOCK_SIZE) {
+    return GATHER_MIN_BLOCK_SIZE;
+  }
+  return GATHER_PAGE_SIZE;
+}
+
+int layer_gather::init(int layer_fd, unsigned in_flight_max,
+                       size_t num_cache_pages) {
+  struct stat st;
+  if (fstat(layer_fd, &st) != 0) {
+    fprintf(stderr, "fstat layer failed err %s\n", strerror(errno));
+    return 1;
+  }
+  if (io.init(in_flight_max) != 0) {
+    return 1;
+  }
+  fd            = layer_fd;
+  file_size     = st.st_size;
+  max_in_flight = io.capacity();
+  cache_pages   = num_cache_pages;
+
+  // Page aligned for O_DIRECT. No cache pages disables the cache.
+  buffers = (uint8_t*)mmap(NULL, max_in_flight * GATHER_PAGE_SIZE,
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (cache_pages > 0) {
+    cache = (uint8_t*)mmap(NULL, cache_pages * GATHER_PAGE_SIZE,
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (buffers == MAP_FAILED || cache == MAP_FAILED) {
+    fprintf(stderr, "mmap gather buffers failed err %s\n", strerror(errno));
+    buffers = buffers == MAP_FAILED ? NULL : buffers;
+    cache   = cache == MAP_FAILED ? NULL : cache;
+    return 1;
+  }
+  block_size   = gather_block_size(fd, file_size, buffers);
+  cache_blocks = cache_pages * (GATHER_PAGE_SIZE / block_size);
+
+  in_flight.resize(max_in_flight);
+  free_buffers.resize(max_in_flight);
+  for (unsigned i = 0; i < max_in_flight; i++) {
+    free_buffers[i] = max_in_flight - 1 - i;
+  }
+  in_flight_blocks.reserve(max_in_flight);
+  cache_tags.assign(cache_blocks, GATHER_NO_PAGE);
+  return 0;
+}
+
+int layer_gather::request(uint32_t node, uint8_t* dst, unsigned* pending) {
+  uint64_t byte_offset = (uint64_t)node * NODE_SIZE;
+  uint64_t block       = byte_offset / block_size;
+  uint32_t offset      = byte_offset % block_size;
+
+  size_t slot = cache_blocks > 0 ? block % cache_blocks : 0;
+  if (cache_blocks > 0 && cache_tags[slot] == block) {
+    std::memcpy(dst, cache + slot * block_size + offset, NODE_SIZE);
+    hits++;
+    return 0;
+  }
+  (*pending)++;
+  auto reading = in_flight_blocks.find(block);
+  if (reading != in_flight_blocks.end()) {
+    in_flight[reading->second].waiters.push_back({ dst, offset, pending });
+    hits++;
+    return 0;
+  }
+
+  if (free_buffers.empty() && (submit() != 0 || reap(1) != 0)) {
+    return 1;
+  }
+  unsigned buffer = free_buffers.back();
+  free_buffers.pop_back();
+  in_flight[buffer].block = block;
+  in_flight[buffer].waiters.push_back({ dst, offset, pending });
+  in_flight_blocks[block] = buffer;
+  // There is a ring entry for every buffer, so this can't fail
+  io.queue_read(fd, buffers + buffer * GATHER_PAGE_SIZE, block_size,
+                block * block_size, buffer);
+  reads++;
+  return 0;
+}
+
+int layer_gather::submit() {
+  return io.submit() != 0;
+}
+
+int layer_gather::wait(const unsigned* pending) {
+  if (submit() != 0) {
+    return 1;
+  }
+  while (*pending > 0) {
+    if (reap(1) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int layer_gather::reap(unsigned min_complete) {
+  async_io_completion done[64];
+  size_t count = io.reap(min_complete, done, 64);
+  if (count < min_complete) {
+    fprintf(stderr, "ERROR - layer gather ring failed\n");
+    return 1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    unsigned buffer = (unsigned)done[i].user_data;
+    read_t& read = in_flight[buffer];
+    // Only the last block of a layer smaller than a block is short
+    uint64_t expected = std::min((uint64_t)block_size,
+                                 file_size - read.block * block_size);
+    if (done[i].result != (int64_t)expected) {
+      // The labels can't be completed without the previous layer
+      fprintf(stderr, "ERROR - layer read at %ld failed err %s\n",
+              read.block * block_size,
+              done[i].result < 0 ? strerror(-done[i].result) : "short read");
+      return 1;
+    }
+
+    const uint8_t* block_data = buffers + buffer * GATHER_PAGE_SIZE;
+    for (const waiter_t& waiter : read.waiters) {
+      std::memcpy(waiter.dst, block_data + waiter.offset, NODE_SIZE);
+      (*waiter.pending)--;
+    }
+    if (cache_blocks > 0) {
+      size_t slot = read.block % cache_blocks;
+      std::memcpy(cache + slot * block_size, block_data, block_size);
+      cache_tags[slot] = read.block;
+    }
+
+    read.waiters.clear();
+    in_flight_blocks.erase(read.block);
+    free_buffers.push_back(buffer);
+  }
+  return 0;
+}
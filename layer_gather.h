@@ -0,0 +1,87 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __LAYER_GATHER_H__
+#define __LAYER_GATHER_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <unordered_map>
+#include "async_io.h"
+
+// Largest gather read and the alignment of the read buffers
+const size_t GATHER_PAGE_SIZE = 4096;
+// Smallest O_DIRECT read tried, the logical block size of most devices
+const size_t GATHER_MIN_BLOCK_SIZE = 512;
+// Reads in flight per producer
+const unsigned GATHER_MAX_IN_FLIGHT = 4096;
+// Pages in the hot-page cache of each producer (4MB)
+const size_t GATHER_CACHE_PAGES = 1024;
+
+// Reads single nodes of a layer file for a producer thread. Every node
+// costs a block read through io_uring unless its block is in a small
+// direct mapped cache of recently read blocks or already being read for
+// another node, then the node is copied from that read. Blocks are the
+// smallest O_DIRECT read the file allows (GATHER_MIN_BLOCK_SIZE on most
+// devices), whole pages for buffered files, which are read without
+// readahead. Requests are counted against a caller owned counter so a
+// window of nodes can be waited on as a group.
+class layer_gather {
+public:
+  layer_gather();
+  ~layer_gather();
+
+  // fd is the layer file, opened with O_DIRECT where possible. With
+  // cache_pages 0 every request not already being read reads its block.
+  int init(int fd, unsigned max_in_flight = GATHER_MAX_IN_FLIGHT,
+           size_t cache_pages = GATHER_CACHE_PAGES);
+
+  // Copy node to dst, right away on a cache hit and otherwise once the read
+  // completes. *pending is incremented until the copy is done.
+  int request(uint32_t node, uint8_t* dst, unsigned* pending);
+
+  // Start the queued reads
+  int submit();
+
+  // Wait until *pending drops to zero
+  int wait(const unsigned* pending);
+
+  // The functions above return non-zero once a read or the ring failed,
+  // the gather can't be used after that
+
+  uint64_t reads;    // Blocks read from the file
+  uint64_t hits;     // Nodes served from the cache or a read in flight
+
+private:
+  struct waiter_t {
+    uint8_t*  dst;
+    uint32_t  offset;  // Of the node within the block
+    unsigned* pending;
+  };
+  struct read_t {
+    uint64_t              block;
+    std::vector<waiter_t> waiters;
+  };
+
+  // Handle completions, blocking for at least min_complete
+  int reap(unsigned min_complete);
+
+  async_io              io;
+  int                   fd;
+  uint64_t              file_size;
+  size_t                block_size;
+  uint8_t*              buffers;     // One page per read in flight
+  std::vector<read_t>   in_flight;   // Indexed by buffer
+  std::vector<unsigned> free_buffers;
+  // Buffer reading each block in flight
+  std::unordered_map<uint64_t, unsigned> in_flight_blocks;
+  uint8_t*              cache;
+  std::vector<uint64_t> cache_tags;  // Block held by each cache slot
+  size_t                cache_pages;
+  size_t                cache_blocks;
+  unsigned              max_in_flight;
+};
+
+#endif // __LAYER_GATHER_H__
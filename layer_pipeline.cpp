@@ -0,0 +1,497 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>          // uint*
+#include <cstdio>           // fprintf
+#include <cstring>          // strerror
+#include <iostream>         // printing
+#include <fcntl.h>          // open
+#include <errno.h>
+#include <unistd.h>         // usleep, fdatasync
+#include <sys/stat.h>       // stat
+#include <vector>
+#include "layer_pipeline.h"
+#include "layer_tree.h"
+#include "replica_encode.h"
+#include "async_io.h"
+
+std::string layer_filename(const char* output_dir, size_t layer) {
+  return std::string(output_dir) + "/sc-02-data-layer-" +
+         std::to_string(layer) + ".dat";
+}
+
+layer_writer::layer_writer()
+  : progress(0), source(&progress), labels(NULL), num_nodes(0), layer(0), start_node(0),
+    ckpt(NULL), stopping(false), error(0) {
+}
+
+layer_writer::~layer_writer() {
+  finish();
+}
+
+int layer_writer::start(const std::string& file_path,
+                        const uint32_t* layer_labels, uint64_t nodes,
+                        uint64_t layer_num, uint64_t first_node,
+                        checkpoint* layer_ckpt,
+                        std::atomic<uint64_t>* progress_source) {
+  path       = file_path;
+  source     = progress_source != NULL ? progress_source : &progress;
+  labels     = layer_labels;
+  num_nodes  = nodes;
+  layer      = layer_num;
+  start_node = first_node;
+  ckpt       = layer_ckpt;
+  error      = 0;
+  stopping.store(false);
+  source->store(first_node);
+  thread = std::thread([this]() { run(); });
+  return 0;
+}
+
+int layer_writer::finish() {
+  if (thread.joinable()) {
+    thread.join();
+  }
+  return error;
+}
+
+void layer_writer::cancel() {
+  stopping.store(true);
+  finish();
+}
+
+void layer_writer::run() {
+  const size_t total = num_nodes * NODE_SIZE;
+
+  // O_DIRECT needs block aligned lengths, the 2K sector is too small for it.
+  // Some filesystems (tmpfs) refuse O_DIRECT, fall back to buffered writes.
+  // When resuming, the persisted prefix of the file is kept.
+  int flags = O_WRONLY | O_CREAT | (start_node == 0 ? O_TRUNC : 0);
+  int fd = -1;
+  if (total % 4096 == 0) {
+    fd = open(path.c_str(), flags | O_DIRECT, 0644);
+  }
+  if (fd < 0) {
+    fd = open(path.c_str(), flags, 0644);
+  }
+  if (fd < 0) {
+    fprintf(stderr, "open %s failed err %s\n", path.c_str(), strerror(errno));
+    error = 1;
+    return;
+  }
+
+  async_io io;
+  if (io.init(LAYER_WRITE_DEPTH) != 0) {
+    close(fd);
+    error = 1;
+    return;
+  }
+
+  // Writes complete out of order, track which chunks are done to know the
+  // prefix that is on disk. start_node is always chunk aligned.
+  const size_t first_chunk = start_node * NODE_SIZE / LAYER_WRITE_CHUNK;
+  std::vector<bool> chunk_done((total + LAYER_WRITE_CHUNK - 1) /
+                               LAYER_WRITE_CHUNK, false);
+  size_t persisted_chunks = first_chunk;
+  size_t checkpointed     = first_chunk * LAYER_WRITE_CHUNK;
+
+  async_io_completion done[LAYER_WRITE_DEPTH];
+  size_t queued  = std::min(total, start_node * NODE_SIZE);
+  size_t written = queued;
+  while (written < total && error == 0) {
+    // Labels below progress are final. Queue every full chunk that is
+    // ready, and the last partial chunk once the layer is done.
+    size_t ready = source->load(std::memory_order_acquire) * NODE_SIZE;
+    while (queued < total) {
+      size_t len = std::min(LAYER_WRITE_CHUNK, total - queued);
+      if (queued + len > ready ||
+          io.queue_write(fd, (const uint8_t*)labels + queued, len, queued,
+                         queued) != 0) {
+        break;
+      }
+      queued += len;
+    }
+    if (io.submit() != 0) {
+      error = 1;
+      break;
+    }
+
+    if (io.in_flight() == 0) {
+      // Waiting on the labeling, not on the disk
+      if (stopping.load()) {
+        error = 1;
+        break;
+      }
+      usleep(1000);
+      continue;
+    }
+
+    size_t count = io.reap(1, done, LAYER_WRITE_DEPTH);
+    if (count == 0) {
+      error = 1;
+      break;
+    }
+    for (size_t i = 0; i < count; i++) {
+      uint64_t offset = done[i].user_data;
+      size_t   len    = std::min(LAYER_WRITE_CHUNK, total - offset);
+      if (done[i].result != (int64_t)len) {
+        fprintf(stderr, "write %s failed err %s\n", path.c_str(),
+                done[i].result < 0 ? strerror(-done[i].result) : "short write");
+        error = 1;
+      }
+      chunk_done[offset / LAYER_WRITE_CHUNK] = true;
+      written += len;
+    }
+    while (persisted_chunks < chunk_done.size() &&
+           chunk_done[persisted_chunks]) {
+      persisted_chunks++;
+    }
+
+    // Record the durable prefix, the final one is recorded below
+    size_t persisted = std::min(total, persisted_chunks * LAYER_WRITE_CHUNK);
+    if (ckpt != NULL && error == 0 && persisted < total &&
+        persisted - checkpointed >= CHECKPOINT_INTERVAL) {
+      if (fdatasync(fd) != 0 ||
+          ckpt->persisted(layer, persisted / NODE_SIZE,
+                          source->load(std::memory_order_acquire)) != 0) {
+        error = 1;
+      }
+      checkpointed = persisted;
+    }
+  }
+
+  if (ckpt != NULL && error == 0) {
+    if (fdatasync(fd) != 0 || ckpt->layer_done(layer) != 0) {
+      fprintf(stderr, "sync %s failed\n", path.c_str());
+      error = 1;
+    }
+  }
+
+  // Drain anything still in flight after an error, unless the ring itself
+  // failed
+  while (io.in_flight() > 0) {
+    if (io.reap(io.in_flight(), done, LAYER_WRITE_DEPTH) == 0) {
+      error = 1;
+      break;
+    }
+  }
+  if (close(fd) != 0) {
+    fprintf(stderr, "close %s failed err %s\n", path.c_str(), strerror(errno));
+    error = 1;
+  }
+}
+
+// Read the first 'bytes' of a layer file back into labels
+static int read_layer(const std::string& path, uint32_t* labels,
+                      size_t bytes) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "open %s failed err %s\n", path.c_str(), strerror(errno));
+    return 1;
+  }
+  size_t done = 0;
+  while (done < bytes) {
+    ssize_t ret = pread(fd, (uint8_t*)labels + done, bytes - done, done);
+    if (ret <= 0) {
+      fprintf(stderr, "read %s failed err %s\n", path.c_str(),
+              ret < 0 ? strerror(errno) : "short file");
+      close(fd);
+      return 1;
+    }
+    done += ret;
+  }
+  close(fd);
+  return 0;
+}
+
+// Open a finished layer for gathers, bypassing the page cache so reads
+// don't take the memory low memory mode saves
+static int open_layer_direct(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+  if (fd < 0) {
+    fd = open(path.c_str(), O_RDONLY);
+  }
+  if (fd < 0) {
+    fprintf(stderr, "open %s failed err %s\n", path.c_str(), strerror(errno));
+  }
+  return fd;
+}
+
+// Wait for the tree of layer and print its root
+static int finish_tree(layer_tree& tree, size_t layer) {
+  if (layer == 0) {
+    return 0;
+  }
+  int ret = tree.finish();
+  if (ret == 0) {
+    fprintf(stderr, "layer %ld tree root ", layer);
+    for (size_t i = 0; i < NODE_SIZE; i++) {
+      fprintf(stderr, "%02x", tree.root()[i]);
+    }
+    fprintf(stderr, "\n");
+  }
+  return ret;
+}
+
+// A file written whole and renamed into place, as trees and the replica are
+static bool file_complete(const std::string& path, size_t size) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 && (size_t)st.st_size == size;
+}
+
+// The checkpoint records a layer once its file is synced, while its tree
+// (which lags the labeling) and, for the last layer, the replica may still
+// be in progress. Redo those missing for the layers below first_layer from
+// their files, read into labels.
+static int finish_resumed_layers(const sector_config_t& config,
+                                 const char* output_dir, size_t first_layer,
+                                 size_t num_layers, bool trees_enabled,
+                                 const char* data_path, uint32_t* labels) {
+  // Levels 1 and up of the tree, num_nodes - 1 nodes
+  const size_t tree_size    = (config.node_count - 1) * NODE_SIZE;
+  std::string  replica_path = replica_filename(output_dir);
+  for (size_t layer = 1; layer < first_layer && layer <= num_layers;
+       layer++) {
+    std::string tree_path = layer_tree_filename(output_dir, layer);
+    bool tree    = trees_enabled && !file_complete(tree_path, tree_size);
+    bool replica = data_path != NULL && layer == num_layers &&
+                   !file_complete(replica_path, config.sector_size);
+    if (!tree && !replica) {
+      continue;
+    }
+    if (read_layer(layer_filename(output_dir, layer), labels,
+                   config.sector_size) != 0) {
+      return 1;
+    }
+    if (tree) {
+      fprintf(stderr, "rebuilding the tree of layer %ld\n", layer);
+      layer_tree rebuilt;
+      if (rebuilt.start(labels, config.node_count, tree_path.c_str(),
+                        config.node_count) != 0 ||
+          finish_tree(rebuilt, layer) != 0) {
+        return 1;
+      }
+    }
+    if (replica) {
+      fprintf(stderr, "encoding the replica from layer %ld\n", layer);
+      if (encode_replica(data_path, replica_path.c_str(), labels,
+                         config.node_count) != 0) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// PARENTS is the flat cache pointer or a compact_parents
+template<typename PARENTS>
+static int create_layers_impl(const sector_config_t& config,
+                              const PARENTS& parents, uint8_t* replica_id,
+                              uint32_t* layer_labels,  uint32_t* exp_labels,
+                              size_t    num_layers,
+                              const char* output_dir,
+                              uint32_t** final_labels,
+                              layers_progress_t* status,
+                              const char* data_path) {
+  // Layer N is labeled into buffers[(N - 1) % 2] and reads layer N - 1 from
+  // the other buffer
+  // Low memory mode without exp_labels, every layer is labeled into
+  // layer_labels and the previous one is read back from its file
+  const bool low_ram = exp_labels == NULL;
+  uint32_t*    buffers[2] = { layer_labels, low_ram ? layer_labels :
+                                                      exp_labels };
+  layer_writer writers[2];
+  checkpoint   ckpt;
+  // Trees of the layers in the buffers, tree_layers[i] is 0 when unused
+  const bool trees_enabled = get_layer_trees();
+  layer_tree trees[2];
+  size_t     tree_layers[2] = { 0, 0 };
+  replica_encoder encoder;
+  int ret = 0;
+
+  if (num_layers == 0) {
+    fprintf(stderr, "ERROR - num_layers must be at least 1\n");
+    return 1;
+  }
+  if (low_ram && output_dir == NULL) {
+    fprintf(stderr,
+            "ERROR - labeling without exp_labels needs an output_dir\n");
+    return 1;
+  }
+  if (data_path != NULL && output_dir == NULL) {
+    fprintf(stderr, "ERROR - encoding a replica needs an output_dir\n");
+    return 1;
+  }
+
+  // Resume point, restore the previous layer and the persisted part of the
+  // current one from disk
+  size_t   first_layer = 1;
+  uint64_t start_node  = 0;
+  if (output_dir != NULL) {
+    if (ckpt.open(output_dir, config.sector_size, num_layers,
+                  replica_id) != 0) {
+      return 1;
+    }
+    first_layer = ckpt.layer();
+    start_node  = ckpt.nodes_persisted();
+    if (finish_resumed_layers(config, output_dir, first_layer, num_layers,
+                              trees_enabled, data_path, buffers[0]) != 0) {
+      return 1;
+    }
+    if (first_layer > 1 && !low_ram &&
+        read_layer(layer_filename(output_dir, first_layer - 1),
+                   buffers[first_layer % 2], config.sector_size) != 0) {
+      return 1;
+    }
+    if (start_node > 0 &&
+        read_layer(layer_filename(output_dir, first_layer),
+                   buffers[(first_layer - 1) % 2],
+                   start_node * NODE_SIZE) != 0) {
+      return 1;
+    }
+  }
+
+  for (size_t layer = first_layer; layer <= num_layers; layer++) {
+    #ifdef NO_LAYER_1
+      // Profile the expander layers alone, layer 2 reads whatever the
+      // buffer holds. Needs both layers in memory.
+      if (layer == 1 && !low_ram) {
+        continue;
+      }
+    #endif
+    uint32_t* cur  = buffers[(layer - 1) % 2];
+    uint32_t* prev = layer == 1 ? NULL : buffers[layer % 2];
+    layer_writer& writer = writers[(layer - 1) % 2];
+    uint64_t first_node = layer == first_layer ? start_node : 0;
+
+    // cur still holds layer - 2, it has to be on disk before reuse. In low
+    // memory mode it holds layer - 1, which is read back from its file.
+    ret |= writer.finish();
+    ret |= finish_tree(trees[(layer - 1) % 2], tree_layers[(layer - 1) % 2]);
+    if (low_ram) {
+      ret |= writers[layer % 2].finish();
+      ret |= finish_tree(trees[layer % 2], tree_layers[layer % 2]);
+      tree_layers[layer % 2] = 0;
+    }
+    tree_layers[(layer - 1) % 2] = 0;
+    if (ret != 0) {
+      break;
+    }
+
+    // The labeling publishes to status if there is one, the writer follows
+    std::atomic<uint64_t>* progress = NULL;
+    if (status != NULL) {
+      progress = &status->nodes;
+      progress->store(first_node);
+      status->layer.store(layer);
+    }
+    if (output_dir != NULL) {
+      writer.start(layer_filename(output_dir, layer), cur, config.node_count,
+                   layer, first_node, &ckpt, progress);
+      progress = progress != NULL ? progress : &writer.progress;
+    }
+    // Hashed into a tree as the labels become final, the whole layer is
+    // in memory even when resuming
+    if (trees_enabled) {
+      layer_tree& tree = trees[(layer - 1) % 2];
+      std::string tree_path = output_dir != NULL ?
+        layer_tree_filename(output_dir, layer) : "";
+      if (tree.start(cur, config.node_count,
+                     output_dir != NULL ? tree_path.c_str() : NULL,
+                     first_node, progress) != 0) {
+        ret = 1;
+        break;
+      }
+      tree_layers[(layer - 1) % 2] = layer;
+      progress = progress != NULL ? progress : &tree.progress;
+    }
+    // The last layer is the key, encoded as its labels become final
+    if (data_path != NULL && layer == num_layers) {
+      if (encoder.start(data_path, replica_filename(output_dir).c_str(),
+                        cur, config.node_count, first_node,
+                        progress) != 0) {
+        ret = 1;
+        break;
+      }
+    }
+
+    fprintf(stderr, "starting layer %ld\n", layer);
+    #ifdef PRINT_DIGEST_DEBUG
+      std::cout << std::endl << "Layer " << std::dec << layer << std::endl;
+    #endif
+    if (low_ram && layer > 1) {
+      int prev_fd = open_layer_direct(layer_filename(output_dir, layer - 1));
+      if (prev_fd < 0) {
+        ret = 1;
+        break;
+      }
+      ret = create_label_file(config, parents, replica_id, cur, prev_fd,
+                              config.node_count, (uint32_t)layer, progress,
+                              first_node);
+      close(prev_fd);
+      if (ret != 0) {
+        break;
+      }
+    } else if (create_label(config, parents, replica_id, cur, prev,
+                            config.node_count, (uint32_t)layer, progress,
+                            first_node) != 0) {
+      ret = 1;
+      break;
+    }
+  }
+
+  // Followers of a layer that was not finished stop waiting on an error
+  for (layer_writer& w : writers) {
+    if (ret != 0) {
+      w.cancel();
+    } else {
+      ret |= w.finish();
+    }
+  }
+  if (ret != 0) {
+    encoder.cancel();
+  } else {
+    ret |= encoder.finish();
+  }
+  // Lower layer first
+  size_t lower = tree_layers[0] <= tree_layers[1] ? 0 : 1;
+  for (size_t i : { lower, 1 - lower }) {
+    if (ret != 0) {
+      trees[i].cancel();
+    } else {
+      ret |= finish_tree(trees[i], tree_layers[i]);
+    }
+  }
+
+  if (output_dir != NULL && ret == 0) {
+    ret = ckpt.remove();
+  }
+
+  if (final_labels != NULL) {
+    *final_labels = buffers[(num_layers - 1) % 2];
+  }
+  return ret;
+}
+
+int create_layers(const sector_config_t& config,
+                  uint32_t* parents_cache, uint8_t* replica_id,
+                  uint32_t* layer_labels,  uint32_t* exp_labels,
+                  size_t    num_layers,    const char* output_dir,
+                  uint32_t** final_labels, layers_progress_t* status,
+                  const char* data_path) {
+  return create_layers_impl(config, parents_cache, replica_id, layer_labels,
+                            exp_labels, num_layers, output_dir, final_labels,
+                            status, data_path);
+}
+
+int create_layers(const sector_config_t& config,
+                  const compact_parents& parents, uint8_t* replica_id,
+                  uint32_t* layer_labels,  uint32_t* exp_labels,
+                  size_t    num_layers,    const char* output_dir,
+                  uint32_t** final_labels, layers_progress_t* status,
+                  const char* data_path) {
+  return create_layers_impl(config, parents, replica_id, layer_labels,
+                            exp_labels, num_layers, output_dir, final_labels,
+                            status, data_path);
+}
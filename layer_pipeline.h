@@ -0,0 +1,108 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __LAYER_PIPELINE_H__
+#define __LAYER_PIPELINE_H__
+
+#include <cstdint>
+#include <atomic>
+#include <string>
+#include <thread>
+#include "create_labels.h"
+#include "checkpoint.h"
+
+// Bytes per write request when streaming a layer to disk
+const size_t LAYER_WRITE_CHUNK = (1UL << 20) * 16;
+// Write requests kept in flight per layer
+const unsigned LAYER_WRITE_DEPTH = 8;
+
+// Streams one layer to <output_dir>/sc-02-data-layer-N.dat while it is
+// being labeled. Chunks are written with O_DIRECT through io_uring as soon
+// as 'progress' (published by create_label) moves past them, the rest is
+// flushed once the layer completes. With a checkpoint the file is synced
+// and the persisted prefix recorded every CHECKPOINT_INTERVAL bytes.
+class layer_writer {
+public:
+  layer_writer();
+  ~layer_writer();
+
+  // Start the writer thread for 'labels', which will be filled up to
+  // num_nodes. Nodes below start_node are already in the file, progress is
+  // reset to start_node. The labeling publishes its progress to source
+  // instead of the progress member when source is set.
+  int start(const std::string& path, const uint32_t* labels,
+            uint64_t num_nodes, uint64_t layer = 0, uint64_t start_node = 0,
+            checkpoint* ckpt = NULL,
+            std::atomic<uint64_t>* source = NULL);
+
+  // Wait for all data to reach the file. Returns non-zero on I/O errors.
+  // Safe to call when nothing was started.
+  int finish();
+  // Stop waiting for labels that will not come, e.g. after a labeling
+  // error. Labels already final are still written, the layer is not
+  // recorded as done.
+  void cancel();
+
+  std::atomic<uint64_t> progress;
+
+private:
+  void run();
+
+  std::string     path;
+  std::atomic<uint64_t>* source;  // progress or the caller's counter
+  const uint32_t* labels;
+  uint64_t        num_nodes;
+  uint64_t        layer;
+  uint64_t        start_node;
+  checkpoint*     ckpt;
+  std::thread     thread;
+  std::atomic<bool> stopping;
+  int             error;
+};
+
+// Progress of a create_layers run, readable from any thread
+struct layers_progress_t {
+  std::atomic<uint64_t> layer;    // Layer being labeled (1 based), 0 before
+  std::atomic<uint64_t> nodes;    // Final labels of that layer
+};
+
+// Label num_layers layers, alternating between the two label buffers so
+// any layer count works. Layer N is written to output_dir if it is set,
+// overlapping with labeling of layer N + 1. The last layer is returned in
+// final_labels when not NULL.
+// With an output_dir the run is checkpointed there. An interrupted run
+// resumes from the layer files and produces identical labels, the
+// checkpoint is removed once all layers are written and the replica is
+// encoded.
+// exp_labels may be NULL with an output_dir: every layer is then labeled
+// into layer_labels and layers 2 and up read the previous one back from
+// its file (create_label_file), halving the memory per sector.
+// status, when set, follows the layer and node being labeled.
+// With set_layer_trees each layer labeled is also hashed into a SHA-256
+// Merkle tree as its labels become final, see layer_tree.h. The root is
+// printed and the tree written to output_dir next to the layer. A resumed
+// run rebuilds the trees missing for the layers already done.
+// With a data_path and an output_dir the unsealed data is encoded with the
+// last layer into replica_filename(output_dir) while that layer is
+// labeled, see replica_encode.h.
+int create_layers(const sector_config_t& config,
+                  uint32_t* parents_cache, uint8_t* replica_id,
+                  uint32_t* layer_labels,  uint32_t* exp_labels,
+                  size_t    num_layers,    const char* output_dir,
+                  uint32_t** final_labels = NULL,
+                  layers_progress_t* status = NULL,
+                  const char* data_path = NULL);
+
+int create_layers(const sector_config_t& config,
+                  const compact_parents& parents, uint8_t* replica_id,
+                  uint32_t* layer_labels,  uint32_t* exp_labels,
+                  size_t    num_layers,    const char* output_dir,
+                  uint32_t** final_labels = NULL,
+                  layers_progress_t* status = NULL,
+                  const char* data_path = NULL);
+
+// Layer file name used by lotus for layer (1 based)
+std::string layer_filename(const char* output_dir, size_t layer);
+
+#endif // __LAYER_PIPELINE_H__
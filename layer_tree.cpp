@@ -0,0 +1,218 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>          // uint*
+#include <cstdio>           // fprintf, rename
+#include <cstring>          // memcpy, strerror
+#include <algorithm>
+#include <fcntl.h>          // open
+#include <errno.h>
+#include <unistd.h>         // pwrite, usleep, fdatasync
+#include "layer_tree.h"
+#include "sha256_multi.h"
+
+static const uint32_t SHA256_INITIAL_DIGEST[8] = {
+  0x6a09e667U, 0xbb67ae85U, 0x3c6ef372U, 0xa54ff53aU,
+  0x510e527fU, 0x9b05688cU, 0x1f83d9abU, 0x5be0cd19U
+};
+
+// Padding block of a 64 byte message
+alignas(64) static const uint8_t SHA256_PAD_64[64] = {
+  0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0,    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0,    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0,    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0 // 512 bits
+};
+
+static std::atomic<bool> layer_trees(false);
+
+void set_layer_trees(bool enable) {
+  layer_trees = enable;
+}
+
+bool get_layer_trees() {
+  return layer_trees;
+}
+
+std::string layer_tree_filename(const char* output_dir, size_t layer) {
+  return std::string(output_dir) + "/sc-02-data-layer-" +
+         std::to_string(layer) + "-tree.dat";
+}
+
+void merkle_hash_pairs(const uint8_t* children, uint8_t* parents,
+                       size_t count) {
+  uint32_t       state[SHA256_MULTI_MAX_LANES][8];
+  uint32_t*      h[SHA256_MULTI_MAX_LANES];
+  const uint8_t* in[SHA256_MULTI_MAX_LANES];
+  for (size_t i = 0; i < count; i += SHA256_MULTI_MAX_LANES) {
+    size_t lanes = std::min(SHA256_MULTI_MAX_LANES, count - i);
+    for (size_t l = 0; l < lanes; l++) {
+      std::memcpy(state[l], SHA256_INITIAL_DIGEST, sizeof(state[l]));
+      h[l]  = state[l];
+      in[l] = children + (i + l) * 2 * NODE_SIZE;
+    }
+    sha256_block_multi(h, in, 1, lanes);
+    for (size_t l = 0; l < lanes; l++) {
+      in[l] = SHA256_PAD_64;
+    }
+    sha256_block_multi(h, in, 1, lanes);
+    for (size_t l = 0; l < lanes; l++) {
+      uint8_t* parent = parents + (i + l) * NODE_SIZE;
+      blst_sha256_emit(parent, state[l]);
+      parent[NODE_SIZE - 1] &= 0x3F; // Strip last two bits to fit in Fr
+    }
+  }
+}
+
+layer_tree::layer_tree()
+  : progress(0), source(&progress), labels(NULL), num_nodes(0), fd(-1),
+    stopping(false), error(0) {
+  std::memset(tree_root, 0, sizeof(tree_root));
+}
+
+layer_tree::~layer_tree() {
+  cancel();
+}
+
+int layer_tree::start(const uint32_t* layer_labels, uint64_t nodes,
+                      const char* file_path, uint64_t start_node,
+                      std::atomic<uint64_t>* progress_source) {
+  if (nodes < 2 || (nodes & (nodes - 1)) != 0) {
+    fprintf(stderr, "ERROR - layer tree needs a power of two nodes, not %ld\n",
+            nodes);
+    return 1;
+  }
+  source    = progress_source != NULL ? progress_source : &progress;
+  labels    = layer_labels;
+  num_nodes = nodes;
+  path      = file_path != NULL ? file_path : "";
+  error     = 0;
+  stopping.store(false);
+  std::memset(tree_root, 0, sizeof(tree_root));
+
+  // Level i has num_nodes >> i nodes and follows the levels below it
+  level_offsets.assign(2, 0);
+  for (size_t i = 1; (num_nodes >> i) > 1; i++) {
+    level_offsets.push_back(level_offsets[i] + (num_nodes >> i) * NODE_SIZE);
+  }
+  fd = -1;
+  if (!path.empty()) {
+    std::string tmp_path = path + ".tmp";
+    fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      fprintf(stderr, "open %s failed err %s\n",
+              tmp_path.c_str(), strerror(errno));
+      return 1;
+    }
+  }
+  scratch.resize(std::min(LAYER_TREE_CHUNK, num_nodes) * NODE_SIZE);
+
+  source->store(start_node);
+  thread = std::thread([this]() { run(); });
+  return 0;
+}
+
+int layer_tree::finish() {
+  if (thread.joinable()) {
+    thread.join();
+  }
+  return error;
+}
+
+void layer_tree::cancel() {
+  stopping.store(true);
+  finish();
+}
+
+int layer_tree::write_level(size_t level, uint64_t index,
+                            const uint8_t* nodes, uint64_t count) {
+  if (fd < 0) {
+    return 0;
+  }
+  size_t   len    = count * NODE_SIZE;
+  uint64_t offset = level_offsets[level] + index * NODE_SIZE;
+  for (size_t done = 0; done < len;) {
+    ssize_t ret = pwrite(fd, nodes + done, len - done, offset + done);
+    if (ret <= 0) {
+      fprintf(stderr, "write %s failed err %s\n", path.c_str(),
+              ret < 0 ? strerror(errno) : "short write");
+      return 1;
+    }
+    done += ret;
+  }
+  return 0;
+}
+
+void layer_tree::hash_subtree(uint64_t first, uint64_t count,
+                              uint8_t* root) {
+  const uint8_t* children = (const uint8_t*)(labels + first * NODE_WORDS);
+  uint8_t*       out      = scratch.data();
+  size_t         level    = 1;
+  for (uint64_t n = count / 2; n > 0; n /= 2, level++) {
+    merkle_hash_pairs(children, out, n);
+    error |= write_level(level, first >> level, out, n);
+    children = out;
+    out     += n * NODE_SIZE;
+  }
+  std::memcpy(root, children, NODE_SIZE);
+}
+
+void layer_tree::run() {
+  const uint64_t chunk  = std::min(LAYER_TREE_CHUNK, num_nodes);
+  const uint64_t chunks = num_nodes / chunk;
+  std::vector<uint8_t> roots(chunks * NODE_SIZE);
+
+  for (uint64_t c = 0; c < chunks && error == 0; c++) {
+    // Labels below progress are final
+    while (source->load(std::memory_order_acquire) < (c + 1) * chunk) {
+      if (stopping.load()) {
+        error = 1;
+        break;
+      }
+      usleep(1000);
+    }
+    if (error != 0) {
+      break;
+    }
+    hash_subtree(c * chunk, chunk, &roots[c * NODE_SIZE]);
+  }
+
+  // The chunk roots are level log2(chunk), hash them up to the root
+  size_t level = __builtin_ctzll(chunk);
+  std::vector<uint8_t> next;
+  for (uint64_t n = chunks / 2; n > 0 && error == 0; n /= 2) {
+    next.resize(n * NODE_SIZE);
+    merkle_hash_pairs(roots.data(), next.data(), n);
+    level++;
+    error |= write_level(level, 0, next.data(), n);
+    roots.swap(next);
+  }
+  if (error == 0) {
+    std::memcpy(tree_root, roots.data(), NODE_SIZE);
+  }
+
+  if (fd >= 0) {
+    // Durable before the rename, a resumed run trusts a complete tree
+    std::string tmp_path = path + ".tmp";
+    if (error == 0 && fdatasync(fd) != 0) {
+      fprintf(stderr, "sync %s failed err %s\n",
+              tmp_path.c_str(), strerror(errno));
+      error = 1;
+    }
+    if (close(fd) != 0) {
+      fprintf(stderr, "close %s failed err %s\n",
+              tmp_path.c_str(), strerror(errno));
+      error = 1;
+    }
+    fd = -1;
+    if (error == 0 && rename(tmp_path.c_str(), path.c_str()) != 0) {
+      fprintf(stderr, "rename %s failed err %s\n",
+              path.c_str(), strerror(errno));
+      error = 1;
+    }
+    if (error != 0) {
+      unlink(tmp_path.c_str());
+    }
+  }
+}
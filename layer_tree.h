@@ -0,0 +1,89 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __LAYER_TREE_H__
+#define __LAYER_TREE_H__
+
+#include <cstdint>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "create_labels.h"
+
+// Binary SHA-256 Merkle tree of a layer, built while it is labeled
+//
+// Parents are SHA-256 of left || right with the two top bits of the last
+// byte cleared, the same truncation as the labels and the filecoin sha256
+// hasher. A background thread follows the labeling progress and hashes
+// each LAYER_TREE_CHUNK node subtree once its labels are final, while they
+// are still in cache, 16 pairs at a time on the multi-buffer SHA-256
+// kernels. The levels above the chunk roots are hashed when the layer is
+// done.
+
+// Leaves per subtree hashed at once
+const uint64_t LAYER_TREE_CHUNK = 1 << 16;
+
+// Hash count pairs of 32 byte nodes in children into count parents
+void merkle_hash_pairs(const uint8_t* children, uint8_t* parents,
+                       size_t count);
+
+class layer_tree {
+public:
+  layer_tree();
+  ~layer_tree();
+
+  // Start the hashing thread for 'labels', which will be filled up to
+  // num_nodes (a power of two). Labels below the count published to source
+  // are final, the progress member is used when source is NULL and reset
+  // to start_node. With a path all levels above the leaves are written
+  // there, level 1 first and the root last, otherwise only the root is
+  // kept.
+  int start(const uint32_t* labels, uint64_t num_nodes,
+            const char* path = NULL, uint64_t start_node = 0,
+            std::atomic<uint64_t>* source = NULL);
+
+  // Wait for the root. Returns non-zero on I/O errors. Safe to call when
+  // nothing was started.
+  int finish();
+  // Stop waiting for labels that will not come, e.g. after a labeling
+  // error. The tree file is not written.
+  void cancel();
+
+  // Valid after finish
+  const uint8_t* root() const { return tree_root; }
+
+  std::atomic<uint64_t> progress;
+
+private:
+  void run();
+  // Hash the subtree of leaves [first, first + count) into its levels and
+  // write them, returns its root
+  void hash_subtree(uint64_t first, uint64_t count, uint8_t* root);
+  int  write_level(size_t level, uint64_t index, const uint8_t* nodes,
+                   uint64_t count);
+
+  std::string            path;
+  std::atomic<uint64_t>* source;
+  const uint32_t*        labels;
+  uint64_t               num_nodes;
+  int                    fd;
+  std::vector<uint64_t>  level_offsets;   // File offset of level i
+  std::vector<uint8_t>   scratch;         // Levels of one subtree
+  std::thread            thread;
+  std::atomic<bool>      stopping;
+  int                    error;
+  uint8_t                tree_root[NODE_SIZE];
+};
+
+// Build a layer_tree for each layer in create_layers, process wide like the
+// set_label_* tunables. Applies to layers started after the call. Off by
+// default.
+void set_layer_trees(bool enable);
+bool get_layer_trees();
+
+// Tree file of a layer next to its layer file
+std::string layer_tree_filename(const char* output_dir, size_t layer);
+
+#endif // __LAYER_TREE_H__
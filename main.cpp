@@ -2,14 +2,277 @@
 // Licensed under the Apache License, Version 2.0, see LICENSE for details.
 // SPDX-License-Identifier: Apache-2.0
 
-// g++ -Wall -Wextra -Werror -march=native -O3 create_labels.cpp memory_handling.cpp main.cpp -I../../blst/src ../../blst/libblst.a
+// g++ -Wall -Wextra -Werror -march=native -O3 create_labels.cpp sha256_multi.cpp sha256_dispatch.cpp memory_handling.cpp parents_cache.cpp compact_parents.cpp topology.cpp async_io.cpp layer_gather.cpp checkpoint.cpp layer_pipeline.cpp layer_tree.cpp replica_encode.cpp label_verify.cpp label_context.cpp label_tune.cpp label_metrics.cpp perf_counters.cpp main.cpp -I../../blst/src ../../blst/libblst.a
 
 #include <cstdint>          // uint*
 #include <iostream>         // printing
+#include <cstdlib>          // strtoul
+#include <cstring>          // strcmp
+#include <string>
+#include <sys/stat.h>       // mkdir
 #include "create_labels.h"
+#include "compact_parents.h"
+#include "sha256_multi.h"
+#include "layer_pipeline.h"
+#include "layer_tree.h"
+#include "label_context.h"
+#include "label_tune.h"
+#include "label_verify.h"
+#include "label_metrics.h"
+#include "perf_counters.h"
 #include <gperftools/profiler.h>
 
-int main() {
+// SDR_SECTORS=N labels N sectors at once through label_scheduler, all
+// sharing one parents cache. Sector i uses replica_id with its last byte
+// xored with i and is written to output_dir/sector-i. SDR_CORES limits the
+// cores the scheduler hands out (default all).
+static int run_sectors(const sector_config_t& config, uint8_t* replica_id,
+                       size_t num_sectors, size_t num_layers,
+                       const char* output_dir, const char* compact_file,
+                       bool low_ram, const char* encode_path) {
+  parents_handle parents;
+  int ret = compact_file != NULL ?
+            parents.open_compact(config, compact_file) :
+            parents.open(config);
+  if (ret != 0) {
+    return ret;
+  }
+
+  const char* cores     = getenv("SDR_CORES");
+  size_t      max_cores = cores != NULL ? strtoul(cores, NULL, 0) : 0;
+  label_scheduler scheduler(parents, max_cores, 0, getenv("SDR_PIN") != NULL);
+  printf("Labeling %ld sectors, %ld at a time\n", num_sectors,
+         scheduler.max_concurrent());
+  for (size_t i = 0; i < num_sectors; i++) {
+    label_job_t job;
+    std::memcpy(job.replica_id, replica_id, sizeof(job.replica_id));
+    job.replica_id[31] ^= (uint8_t)i;
+    job.num_layers = num_layers;
+    job.low_ram    = low_ram;
+    if (output_dir != NULL) {
+      job.output_dir = std::string(output_dir) + "/sector-" +
+                       std::to_string(i);
+      job.data_path  = encode_path != NULL ? encode_path : "";
+      mkdir(job.output_dir.c_str(), 0755);
+    }
+    job.done = [i](int job_ret, const uint32_t* labels) {
+      printf("sector %ld done ret %d first label word %08x\n", i, job_ret,
+             labels != NULL ? labels[0] : 0);
+    };
+    if (scheduler.submit(job) != 0) {
+      return 1;
+    }
+  }
+  size_t failed = scheduler.wait();
+  printf("%ld sectors failed, at most %ld ran at once\n", failed,
+         scheduler.peak_running());
+  return failed != 0;
+}
+
+// SDR_VERIFY=<nodes> checks the layers in output_dir instead of labeling
+// them, recomputing a random sample of nodes per layer on all cores, or
+// every node with 0 or "all"
+static int run_verify(const sector_config_t& config, uint8_t* replica_id,
+                      size_t num_layers, const char* output_dir,
+                      const char* compact_file, uint64_t sample) {
+  parents_handle parents;
+  int ret = compact_file != NULL ?
+            parents.open_compact(config, compact_file) :
+            parents.open(config);
+  if (ret != 0) {
+    return ret;
+  }
+  int failed = parents.compact() != NULL ?
+    verify_layers(config, *parents.compact(), replica_id, num_layers,
+                  output_dir, sample) :
+    verify_layers(config, parents.flat(), replica_id, num_layers,
+                  output_dir, sample);
+  return failed != 0;
+}
+
+// Label layers 1 and 2 of lanes sectors in lockstep and compare each lane
+// with the same sector labeled on its own. Returns the mismatching lanes.
+template<typename PARENTS>
+static size_t check_lanes(const sector_config_t& config,
+                          const PARENTS& parents, uint8_t* replica_id,
+                          size_t lanes, uint32_t* const* single) {
+  uint8_t   ids[SHA256_MULTI_MAX_LANES][32];
+  uint8_t*  id_ptrs[SHA256_MULTI_MAX_LANES];
+  uint32_t* layers[2][SHA256_MULTI_MAX_LANES] = {};
+  bool      ok = true;
+  for (size_t l = 0; l < lanes; l++) {
+    std::memcpy(ids[l], replica_id, 32);
+    ids[l][31] ^= (uint8_t)l;
+    id_ptrs[l]   = ids[l];
+    layers[0][l] = allocate_layer(config.sector_size);
+    layers[1][l] = allocate_layer(config.sector_size);
+    ok = ok && layers[0][l] != NULL && layers[1][l] != NULL;
+  }
+  ok = ok &&
+    create_label_multi(config, parents, id_ptrs, layers[0], NULL, lanes,
+                       config.node_count, 1) == 0 &&
+    create_label_multi(config, parents, id_ptrs, layers[1], layers[0],
+                       lanes, config.node_count, 2) == 0;
+  size_t failed = ok ? 0 : lanes;
+  for (size_t l = 0; ok && l < lanes; l++) {
+    if (create_label(config, parents, id_ptrs[l], single[0], NULL,
+                     config.node_count, 1) != 0 ||
+        create_label(config, parents, id_ptrs[l], single[1], single[0],
+                     config.node_count, 2) != 0 ||
+        std::memcmp(single[0], layers[0][l], config.sector_size) != 0 ||
+        std::memcmp(single[1], layers[1][l], config.sector_size) != 0) {
+      failed++;
+    }
+  }
+
+  for (size_t l = 0; l < lanes; l++) {
+    for (uint32_t* layer : { layers[0][l], layers[1][l] }) {
+      if (layer != NULL) {
+        free_layer(layer, config.sector_size);
+      }
+    }
+  }
+  return failed;
+}
+
+// SDR_CHECK_LANES checks create_label_multi against create_label for 4, 8
+// and 16 lanes instead of labeling, lanes use replica_id with the last byte
+// xored by the lane. Needs 2 * (lanes + 1) layers of memory.
+static int run_lanes_check(const sector_config_t& config, uint8_t* replica_id,
+                           const char* compact_file) {
+  parents_handle parents;
+  int ret = compact_file != NULL ?
+            parents.open_compact(config, compact_file) :
+            parents.open(config);
+  if (ret != 0) {
+    return ret;
+  }
+  uint32_t* single[2] = { allocate_layer(config.sector_size),
+                          allocate_layer(config.sector_size) };
+  size_t failed = 0;
+  if (single[0] == NULL || single[1] == NULL) {
+    failed = 1;
+  }
+  for (size_t lanes = 4; failed == 0 && lanes <= SHA256_MULTI_MAX_LANES;
+       lanes *= 2) {
+    size_t lanes_failed = parents.compact() != NULL ?
+      check_lanes(config, *parents.compact(), replica_id, lanes, single) :
+      check_lanes(config, parents.flat(), replica_id, lanes, single);
+    printf("%ld lanes: %ld differ from single lane labeling\n", lanes,
+           lanes_failed);
+    failed += lanes_failed;
+  }
+  for (uint32_t* layer : single) {
+    if (layer != NULL) {
+      free_layer(layer, config.sector_size);
+    }
+  }
+  return failed != 0;
+}
+
+// Labels lotus bench wrote for the replica_id in main with the lotus 512M
+// V1_0 parents cache (/tmp/.tmpNuyVpu), as the words the debug build prints
+struct lotus_label_t {
+  size_t   sector_size;
+  size_t   layer;
+  uint64_t node;
+  uint32_t words[NODE_WORDS];
+};
+
+static const lotus_label_t LOTUS_LABELS[] = {
+  { SECTOR_SIZE_512M, 1, 0,
+    { 0x2c715ed2, 0x96858021, 0xad6d7f5c, 0x22b16ce1,
+      0xe9b2357d, 0xbc0a2c33, 0x9454aec1, 0x22982162 } },
+  { SECTOR_SIZE_512M, 2, SECTOR_SIZE_512M / NODE_SIZE - 1,
+    { 0xe532d96e, 0xa035e581, 0xfcc40169, 0x2ef9079c,
+      0x7196bb22, 0xf06fc8af, 0x6f50982c, 0x3d2ad045 } }
+};
+
+// Label layers 1 and 2 and compare them with LOTUS_LABELS. Returns the
+// mismatching labels.
+template<typename PARENTS>
+static size_t check_lotus(const sector_config_t& config,
+                          const PARENTS& parents, uint8_t* replica_id,
+                          uint32_t* const* layers) {
+  if (create_label(config, parents, replica_id, layers[0], NULL,
+                   config.node_count, 1) != 0 ||
+      create_label(config, parents, replica_id, layers[1], layers[0],
+                   config.node_count, 2) != 0) {
+    return 1;
+  }
+  size_t failed = 0;
+  for (const lotus_label_t& label : LOTUS_LABELS) {
+    if (label.sector_size != config.sector_size) {
+      continue;
+    }
+    const uint32_t* words = layers[label.layer - 1] + label.node * NODE_WORDS;
+    bool match = std::memcmp(words, label.words, sizeof(label.words)) == 0;
+    printf("layer %ld node %ld %s lotus\n", label.layer, label.node,
+           match ? "matches" : "differs from");
+    failed += !match;
+  }
+  return failed;
+}
+
+// SDR_CHECK_LOTUS checks the labels of layers 1 and 2 against LOTUS_LABELS
+// instead of labeling, so a parents cache (or the generator when there is
+// no cache file) can be checked against lotus end to end
+static int run_lotus_check(const sector_config_t& config,
+                           uint8_t* replica_id, const char* compact_file) {
+  bool known = false;
+  for (const lotus_label_t& label : LOTUS_LABELS) {
+    known = known || label.sector_size == config.sector_size;
+  }
+  if (!known) {
+    printf("ERROR - no lotus labels for sector size %ld\n",
+           config.sector_size);
+    return 1;
+  }
+  parents_handle parents;
+  int ret = compact_file != NULL ?
+            parents.open_compact(config, compact_file) :
+            parents.open(config);
+  if (ret != 0) {
+    return ret;
+  }
+  uint32_t* layers[2] = { allocate_layer(config.sector_size),
+                          allocate_layer(config.sector_size) };
+  size_t failed = 1;
+  if (layers[0] != NULL && layers[1] != NULL) {
+    failed = parents.compact() != NULL ?
+      check_lotus(config, *parents.compact(), replica_id, layers) :
+      check_lotus(config, parents.flat(), replica_id, layers);
+  }
+  for (uint32_t* layer : layers) {
+    if (layer != NULL) {
+      free_layer(layer, config.sector_size);
+    }
+  }
+  return failed != 0;
+}
+
+// Usage: ./test_debug [sector_size] [num_layers] [output_dir]
+// Defaults to 512M and LAYER_COUNT layers, layers are only written to disk
+// when output_dir is given.
+int main(int argc, char** argv) {
+  size_t      sector_size = SECTOR_SIZE_512M;
+  size_t      num_layers  = LAYER_COUNT;
+  const char* output_dir  = NULL;
+  if (argc > 1) {
+    sector_size = strtoul(argv[1], NULL, 0);
+  }
+  if (argc > 2) {
+    num_layers = strtoul(argv[2], NULL, 0);
+  }
+  if (argc > 3) {
+    output_dir = argv[3];
+  }
+  const sector_config_t* config = get_sector_config(sector_size);
+  if (config == NULL) {
+    std::cout << "ERROR - unsupported sector size " << sector_size << std::endl;
+    return 1;
+  }
+
   // From captured vector
   // /tmp/.tmpNuyVpu
   // 0x1f98037e0e7f19137fdeb0bf98a3c2779da16730f1bb7c5443f69373d6b3aef3
@@ -20,48 +283,176 @@ int main() {
      19,  25, 127,  14, 126,   3, 152,  31
   };
 
+  // SDR_PIN pins the labeling threads to cores sharing a cache and binds
+  // the layers to their NUMA node
+  std::vector<label_placement_t> placements;
+  int numa_node = -1;
+  if (getenv("SDR_PIN") != NULL) {
+    cpu_topology_t topo;
+    if (load_cpu_topology(topo) == 0) {
+      plan_label_placement(topo, 1, 2, placements);
+      set_label_placement(&placements[0]);
+      numa_node = placements[0].numa_node;
+    }
+  }
+
+  // SDR_HUGEPAGES=2M or 1G backs the layers and parents cache with huge pages
+  const char* huge_pages = getenv("SDR_HUGEPAGES");
+  if (huge_pages != NULL) {
+    set_huge_page_size(strcmp(huge_pages, "1G") == 0 ? PAGE_SIZE_1G :
+                                                       PAGE_SIZE_2M);
+  }
+
+  // SDR_SHM_PARENTS=<dir> shares one copy of the parents cache between
+  // processes, e.g. /dev/shm or a hugetlbfs mount
+  const char* shm_dir = getenv("SDR_SHM_PARENTS");
+  if (shm_dir != NULL) {
+    set_parent_cache_shm_dir(shm_dir);
+  }
+
+  // SDR_TREES builds a SHA-256 Merkle tree of every layer while labeling
+  set_layer_trees(getenv("SDR_TREES") != NULL);
+
   uint32_t* parents_cache = nullptr;
   uint32_t* layer_labels  = nullptr;
   uint32_t* exp_labels    = nullptr;
 
-  if (setup_create_label_memory(&parents_cache, &layer_labels, &exp_labels)) {
-    return 1;
-  }
+  // SDR_LOW_RAM keeps a single layer in memory, layers 2 and up read the
+  // previous layer back from output_dir
+  bool low_ram = getenv("SDR_LOW_RAM") != NULL && output_dir != NULL;
 
-  #ifndef NO_LAYER_1
-  //ProfilerStart("layer1.profile");
-    #ifdef PRINT_DIGEST_DEBUG
-      std::cout << std::endl << "Layer 1" << std::endl;
-    #endif
-    // Do layer 1.  Needs to be separate due to base only
-    create_label(parents_cache, replica_id, layer_labels, NULL,
-                 NODE_COUNT, 1);
-    //ProfilerStop();
+  // SDR_COMPACT_PARENTS=<file> labels from a compact parents cache written
+  // by gen_parents_cache instead of the flat one
+  const char* compact_file = getenv("SDR_COMPACT_PARENTS");
+
+  // SDR_ENCODE=<data file> encodes the unsealed data with the last layer
+  // into output_dir/sc-02-data-replica.dat while that layer is labeled
+  const char* encode_path = output_dir != NULL ? getenv("SDR_ENCODE") : NULL;
+
+  // NO_EXP_LAYER limits the run to layer 1, NO_LAYER_1 skips labeling
+  // layer 1 (see create_layers)
+  #ifdef NO_EXP_LAYER
+    num_layers = 1;
   #endif
 
-  #ifndef NO_EXP_LAYER
-    // Do the rest of the layers 2-n
-    // NOTE - only works for odd number of layers due to exp and layer swap
-    for (uint32_t layer = 2; layer <= LAYER_COUNT; layer += 2) {
-      printf("starting layer %d\n", layer);
-      #ifdef PRINT_DIGEST_DEBUG
-      std::cout << std::endl << "Layer " << layer << std::endl;
-      #endif
-      //ProfilerStart("exp.profile");
-      create_label(parents_cache, replica_id, exp_labels, layer_labels,
-                   NODE_COUNT, layer);
-      //ProfilerStop();
-  
-      #ifdef PRINT_DIGEST_DEBUG
-        std::cout << std::endl << "Layer " << layer + 1 << std::endl;
-      #endif
-      create_label(parents_cache, replica_id, layer_labels, exp_labels,
-                   NODE_COUNT, layer + 1);
+  // SDR_METRICS=<file> writes the per layer metrics of a -DLABEL_METRICS
+  // build, Prometheus text if the name ends in .prom, else JSON.
+  // SDR_METRICS_PERF adds hardware counters per layer.
+  const char* metrics_path = getenv("SDR_METRICS");
+  set_label_metrics_perf(getenv("SDR_METRICS_PERF") != NULL);
+  if (metrics_path != NULL && !label_metrics_enabled()) {
+    printf("SDR_METRICS needs a build with -DLABEL_METRICS\n");
+  }
+
+  const char* verify = getenv("SDR_VERIFY");
+  if (verify != NULL && output_dir != NULL) {
+    return run_verify(*config, replica_id, num_layers, output_dir,
+                      compact_file, strtoull(verify, NULL, 0));
+  }
+
+  if (getenv("SDR_CHECK_LOTUS") != NULL) {
+    return run_lotus_check(*config, replica_id, compact_file);
+  }
+
+  if (getenv("SDR_CHECK_LANES") != NULL) {
+    return run_lanes_check(*config, replica_id, compact_file);
+  }
+
+  const char* sectors = getenv("SDR_SECTORS");
+  if (sectors != NULL) {
+    int ret = run_sectors(*config, replica_id, strtoul(sectors, NULL, 0),
+                          num_layers, output_dir, compact_file, low_ram,
+                          encode_path);
+    if (metrics_path != NULL) {
+      write_label_metrics(metrics_path);
     }
-  #endif
+    return ret;
+  }
+  compact_parents compact;
+  if (compact_file != NULL) {
+    if (compact.load(compact_file) != 0) {
+      return 1;
+    }
+    if (compact.node_count() != config->node_count) {
+      printf("ERROR - %s is for a different sector size\n", compact_file);
+      return 1;
+    }
+    printf("Compact parents cache %.2f bytes per node (flat %ld)\n",
+           (double)compact.size() / config->node_count,
+           PARENT_COUNT * PARENT_SIZE);
+    layer_labels = allocate_layer(config->sector_size, numa_node);
+    if (!low_ram) {
+      exp_labels = allocate_layer(config->sector_size, numa_node);
+    }
+    if (layer_labels == NULL || (!low_ram && exp_labels == NULL)) {
+      return 1;
+    }
+  } else if (setup_create_label_memory(*config, &parents_cache, &layer_labels,
+                                       low_ram ? NULL : &exp_labels,
+                                       numa_node)) {
+    return 1;
+  }
+
+  // SDR_LABEL_PARAMS=lookahead,producers,stride[:lookahead,producers,stride]
+  // sets the layer 1 and layers 2+ parameters, SDR_TUNE=1 (or a cache file
+  // path) calibrates them for this host instead, see label_tune.h
+  const char* params_env = getenv("SDR_LABEL_PARAMS");
+  for (bool layer1 : { true, false }) {
+    label_params_t params;
+    if (params_env != NULL &&
+        sscanf(params_env, "%zu,%zu,%zu", &params.lookahead,
+               &params.num_producers, &params.producer_stride) == 3) {
+      set_label_params(layer1, params);
+      params_env = strchr(params_env, ':');
+      params_env = params_env != NULL ? params_env + 1 : NULL;
+    }
+  }
+  const char* tune = getenv("SDR_TUNE");
+  if (tune != NULL) {
+    const char* cache_path = strcmp(tune, "1") == 0 ? LABEL_TUNE_CACHE : tune;
+    int tune_ret = compact_file != NULL ?
+      auto_tune_label_params(*config, compact, layer_labels, exp_labels,
+                             cache_path) :
+      auto_tune_label_params(*config, parents_cache, layer_labels, exp_labels,
+                             cache_path);
+    if (tune_ret != 0) {
+      return 1;
+    }
+  }
+
+  // Hardware counters of the labeling threads, compare dTLB misses with and
+  // without huge pages
+  perf_counters counters;
+  counters.start();
 
-  cleanup_create_label_memory();
+  //ProfilerStart("layers.profile");
+  int ret;
+  if (compact_file != NULL) {
+    ret = create_layers(*config, compact, replica_id, layer_labels,
+                        exp_labels, num_layers, output_dir, NULL, NULL,
+                        encode_path);
+  } else {
+    ret = create_layers(*config, parents_cache, replica_id, layer_labels,
+                        exp_labels, num_layers, output_dir, NULL, NULL,
+                        encode_path);
+  }
+  //ProfilerStop();
+
+  counters.stop();
+  counters.print("Labeling");
+  if (metrics_path != NULL) {
+    write_label_metrics(metrics_path);
+  }
+
+  if (compact_file != NULL) {
+    free_layer(layer_labels, config->sector_size);
+    if (exp_labels != nullptr) {
+      free_layer(exp_labels, config->sector_size);
+    }
+  } else {
+    cleanup_create_label_memory();
+  }
 
-  return 0;
+  return ret;
 }
 
@@ -4,97 +4,460 @@
 
 #include <iostream>         // printing
 #include <fstream>          // file read
+#include <string>
+#include <thread>
+#include <system_error>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <algorithm>
 #include "create_labels.h"
+#include "parents_cache.h"
+#include "topology.h"
 #include <fcntl.h>          // mmap
 #include <sys/mman.h>       // mmap
+#include <sys/file.h>       // flock
+#include <sys/stat.h>       // fstat
+#include <sys/vfs.h>        // fstatfs
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 
+// Single sector state behind setup_create_label_memory, label_context
+// (label_context.h) holds its own
 static void* parents_cache_alloc = nullptr;
-static int   parants_cache_fd    = 0;
 static void* layer_labels_alloc  = nullptr;
 static void* exp_labels_alloc    = nullptr;
+static const sector_config_t* alloc_config = nullptr;
 
-uint32_t *allocate_layer() {
-  uint32_t *layer = (uint32_t *)mmap(NULL, SECTOR_SIZE, PROT_READ | PROT_WRITE,
-                                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_LOCKED, -1, 0);
-  if (layer == (void *)-1) {
-    printf("mmap layer failed err %s\n", strerror(errno));
-    exit(1);
+// Requested page size for layers and the parents cache, 0 for the default.
+// Process wide, read once per allocation.
+static std::atomic<size_t> huge_page_size(0);
+// Directory of the cross process parents cache segments, NULL for none
+static std::atomic<const char*> parent_cache_shm_dir(nullptr);
+
+// Parents cache bytes read and locked by one thread at a time
+const size_t PARENTS_LOAD_CHUNK = (1UL << 20) * 64;
+// Nodes of a loaded cache file checked against the graph
+const uint64_t PARENTS_CHECK_INTERVAL = 1 << 12;
+
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+static const sector_config_t SECTOR_CONFIGS[] = {
+  { SECTOR_SIZE_2K,   SECTOR_SIZE_2K / NODE_SIZE,
+    SECTOR_SIZE_2K / NODE_SIZE * PARENT_COUNT * PARENT_SIZE,
+    "/var/tmp/filecoin-parents/v28-sdr-parent-3894e5db3e22e371be947bd27e5c6e8e7da3ca81c6bd8005e42504ff101796f1.cache" },
+  { SECTOR_SIZE_8M,   SECTOR_SIZE_8M / NODE_SIZE,
+    SECTOR_SIZE_8M / NODE_SIZE * PARENT_COUNT * PARENT_SIZE,
+    NULL },
+  { SECTOR_SIZE_512M, SECTOR_SIZE_512M / NODE_SIZE,
+    SECTOR_SIZE_512M / NODE_SIZE * PARENT_COUNT * PARENT_SIZE,
+    "/var/tmp/filecoin-parents/v28-sdr-parent-b9440d6f444972abcd5ebc48231d93b92e7d1c132968170ae29c44d68fa04d04.cache" },
+  { SECTOR_SIZE_32G,  SECTOR_SIZE_32G / NODE_SIZE,
+    SECTOR_SIZE_32G / NODE_SIZE * PARENT_COUNT * PARENT_SIZE,
+    "/var/tmp/filecoin-parents/v28-sdr-parent-d5500bc0dddadb609f867d94da1471ecbaac3fe6f8ac68a4705cebde04a765b8.cache" },
+  { SECTOR_SIZE_64G,  SECTOR_SIZE_64G / NODE_SIZE,
+    SECTOR_SIZE_64G / NODE_SIZE * PARENT_COUNT * PARENT_SIZE,
+    NULL }
+};
+
+const sector_config_t* get_sector_config(size_t sector_size) {
+  for (const sector_config_t& config : SECTOR_CONFIGS) {
+    if (config.sector_size == sector_size) {
+      return &config;
+    }
+  }
+  return NULL;
+}
+
+void set_huge_page_size(size_t page_size) {
+  huge_page_size = page_size;
+}
+
+void set_parent_cache_shm_dir(const char* dir) {
+  parent_cache_shm_dir = dir;
+}
+
+// Anonymous mapping on the configured huge pages. Falls back to 2M and then
+// to regular pages when the pool is empty or size is not a multiple of the
+// page size (munmap of a hugetlb mapping needs whole pages). Returns NULL
+// on failure.
+static void *map_anonymous(size_t size, int flags, const char *name) {
+  size_t page_size = huge_page_size;
+  while (page_size > PAGE_SIZE_4K) {
+    if (size % page_size == 0) {
+      int page_shift = __builtin_ctzl(page_size);
+      void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        flags | MAP_ANONYMOUS | MAP_HUGETLB |
+                        (page_shift << MAP_HUGE_SHIFT), -1, 0);
+      if (addr != MAP_FAILED) {
+        return addr;
+      }
+      fprintf(stderr, "%s: no %ldM huge pages available, falling back\n", name,
+              page_size >> 20);
+    }
+    page_size = page_size == PAGE_SIZE_1G ? PAGE_SIZE_2M : PAGE_SIZE_4K;
+  }
+
+  void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_ANONYMOUS,
+                    -1, 0);
+  if (addr == MAP_FAILED) {
+    fprintf(stderr, "mmap %s failed err %s\n", name, strerror(errno));
+    return NULL;
+  }
+  return addr;
+}
+
+uint32_t *allocate_layer(size_t sector_size, int numa_node) {
+  // With a node the pages are bound before mlock faults them in
+  int flags = MAP_PRIVATE | (numa_node < 0 ? MAP_LOCKED : 0);
+  uint32_t *layer = (uint32_t *)map_anonymous(sector_size, flags, "layer");
+  if (layer == NULL) {
+    return NULL;
+  }
+  if (numa_node >= 0) {
+    bind_memory_to_node(layer, sector_size, numa_node);
   }
   if (((uintptr_t)layer & 0x3F) != 0) {
-    printf("ERROR - layer not aligned\n");
-    exit(1);
+    fprintf(stderr, "ERROR - layer not aligned\n");
+    munmap(layer, sector_size);
+    return NULL;
   }
-  if (mlock(layer, PARENTS_SIZE) != 0) {
-    printf("mlock layer failed err %s\n", strerror(errno));
-    exit(1);
+  if (mlock(layer, sector_size) != 0) {
+    fprintf(stderr, "mlock layer failed err %s\n", strerror(errno));
+    munmap(layer, sector_size);
+    return NULL;
   }
   return layer;
 }
 
-uint32_t *map_parent_cache() {
-  const char *parents_cache_filename;
-  if (SECTOR_SIZE == 2048) {             // 2KB parents cache file
-    parents_cache_filename = "/var/tmp/filecoin-parents/v28-sdr-parent-3894e5db3e22e371be947bd27e5c6e8e7da3ca81c6bd8005e42504ff101796f1.cache";
-  } else if (SECTOR_SIZE == 536870912) { // 512M parents cache file
-    parents_cache_filename = "/var/tmp/filecoin-parents/v28-sdr-parent-b9440d6f444972abcd5ebc48231d93b92e7d1c132968170ae29c44d68fa04d04.cache";
-  } else if (SECTOR_SIZE == 34359738368) { // 32G parents cache file
-    parents_cache_filename = "/var/tmp/filecoin-parents/v28-sdr-parent-d5500bc0dddadb609f867d94da1471ecbaac3fe6f8ac68a4705cebde04a765b8.cache";
-  } else {
-    std::cout << "ERROR - non supported parent cache sector size" << std::endl;
+void free_layer(uint32_t *layer, size_t sector_size) {
+  if (munmap(layer, sector_size) != 0) {
+    fprintf(stderr, "munmap layer failed err %s\n", strerror(errno));
+  }
+}
+
+// Generate the parents cache straight into a locked anonymous mapping,
+// used when no cache file is available for this sector size
+uint32_t *generate_parent_cache_mapping(const sector_config_t& config) {
+  uint32_t *parents = (uint32_t *)map_anonymous(config.parents_size,
+                                                MAP_SHARED | MAP_LOCKED,
+                                                "parents");
+  if (parents == NULL) {
+    return NULL;
+  }
+  if (generate_parent_cache(parents, config.sector_size, SDR_API_V1_0,
+                            0) != 0) {
+    munmap(parents, config.parents_size);
+    return NULL;
+  }
+  if (mprotect(parents, config.parents_size, PROT_READ) != 0) {
+    fprintf(stderr, "mprotect parents failed err %s\n", strerror(errno));
+    munmap(parents, config.parents_size);
+    return NULL;
+  }
+  return parents;
+}
+
+// Read (when fd is set) and lock [addr, addr + size) in PARENTS_LOAD_CHUNK
+// pieces on all cores, rather than faulting it in on one thread. Returns
+// non-zero if a read or mlock failed.
+static int parallel_load(uint8_t *addr, size_t size, int fd) {
+  size_t num_threads = std::max(std::thread::hardware_concurrency(), 1U);
+  std::atomic<size_t> next(0);
+  std::atomic<int> error(0);
+  auto work = [&]() {
+    while (error == 0) {
+      size_t offset = next.fetch_add(PARENTS_LOAD_CHUNK);
+      if (offset >= size) {
+        break;
+      }
+      size_t len = std::min(PARENTS_LOAD_CHUNK, size - offset);
+      for (size_t done = 0; fd >= 0 && done < len;) {
+        ssize_t ret = pread(fd, addr + offset + done, len - done,
+                            offset + done);
+        if (ret <= 0) {
+          fprintf(stderr, "read parents failed err %s\n",
+                  ret < 0 ? strerror(errno) : "short file");
+          error = 1;
+          return;
+        }
+        done += ret;
+      }
+      if (mlock(addr + offset, len) != 0) {
+        fprintf(stderr, "mlock parents failed err %s\n", strerror(errno));
+        error = 1;
+        return;
+      }
+    }
+  };
+  // Out of threads the calling thread finishes with those started
+  std::vector<std::thread> threads;
+  threads.reserve(num_threads);
+  try {
+    for (size_t t = 0; t < num_threads; t++) {
+      threads.emplace_back(work);
+    }
+  } catch (const std::system_error&) {
+    work();
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  return error;
+}
+
+static int check_parent_cache(const sector_config_t& config,
+                              const uint32_t *parents) {
+  if (check_parent_cache_sample(parents, config.sector_size,
+                                PARENTS_CHECK_INTERVAL, 0) != 0) {
+    fprintf(stderr, "ERROR - %s is corrupt, regenerate it\n",
+            config.parents_cache_filename);
+    return 1;
+  }
+  return 0;
+}
+
+static std::string shared_parent_cache_path(const sector_config_t& config,
+                                            const char *shm_dir) {
+  const char *name = strrchr(config.parents_cache_filename, '/');
+  return std::string(shm_dir) + "/sdr-" +
+         (name != NULL ? name + 1 : config.parents_cache_filename);
+}
+
+// Copy the cache file into a new segment under parent_cache_shm_dir. Built
+// under a temporary name and renamed once checked, so attaching processes
+// never see a partial cache.
+static int create_shared_parent_cache(const sector_config_t& config,
+                                      const std::string& path, int file_fd) {
+  std::string tmp_path = path + ".tmp";
+  int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "open %s failed err %s\n", tmp_path.c_str(),
+            strerror(errno));
+    return 1;
+  }
+  // hugetlbfs only maps whole pages
+  struct statfs fs;
+  if (fstatfs(fd, &fs) == 0 && (uint32_t)fs.f_type == HUGETLBFS_MAGIC &&
+      config.parents_size % fs.f_bsize != 0) {
+    fprintf(stderr, "parents cache is not a multiple of %ldM huge pages\n",
+            (size_t)fs.f_bsize >> 20);
+    close(fd);
+    unlink(tmp_path.c_str());
+    return 1;
+  }
+  if (ftruncate(fd, config.parents_size) != 0) {
+    fprintf(stderr, "ftruncate %s failed err %s\n", tmp_path.c_str(),
+            strerror(errno));
+    close(fd);
+    unlink(tmp_path.c_str());
+    return 1;
+  }
+  uint8_t *segment = (uint8_t *)mmap(NULL, config.parents_size,
+                                     PROT_READ | PROT_WRITE, MAP_SHARED,
+                                     fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) {
+    fprintf(stderr, "mmap %s failed err %s\n", tmp_path.c_str(),
+            strerror(errno));
+    unlink(tmp_path.c_str());
+    return 1;
+  }
+  int failed = parallel_load(segment, config.parents_size, file_fd) != 0 ||
+               check_parent_cache(config, (const uint32_t *)segment) != 0;
+  munmap(segment, config.parents_size);
+  if (failed) {
+    unlink(tmp_path.c_str());
+    return 1;
+  }
+
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    fprintf(stderr, "rename %s failed err %s\n", path.c_str(), strerror(errno));
+    unlink(tmp_path.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+// Attach to the shared copy of the cache, creating it on first use. The
+// creator holds an flock on <path>.lock so concurrent first users load it
+// once. Returns NULL to fall back to a private mapping.
+static uint32_t *map_shared_parent_cache(const sector_config_t& config,
+                                         const char *shm_dir, int file_fd) {
+  std::string path = shared_parent_cache_path(config, shm_dir);
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::string lock_path = path + ".lock";
+    int lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX) != 0) {
+      fprintf(stderr, "lock %s failed err %s\n", lock_path.c_str(),
+              strerror(errno));
+      if (lock_fd >= 0) {
+        close(lock_fd);
+      }
+      return NULL;
+    }
+    // Another process may have finished it while we waited
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      std::cerr << "Loading parents cache into " << path << std::endl;
+      if (create_shared_parent_cache(config, path, file_fd) == 0) {
+        fd = open(path.c_str(), O_RDONLY);
+      }
+    }
+    close(lock_fd);   // Drops the lock
+    if (fd < 0) {
+      return NULL;
+    }
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size != config.parents_size) {
+    fprintf(stderr, "ERROR - %s has the wrong size, remove it\n", path.c_str());
+    close(fd);
+    return NULL;
+  }
+  uint32_t *parents = (uint32_t *)mmap(NULL, config.parents_size, PROT_READ,
+                                       MAP_SHARED, fd, 0);
+  close(fd);
+  if (parents == MAP_FAILED) {
+    fprintf(stderr, "mmap %s failed err %s\n", path.c_str(), strerror(errno));
     return NULL;
   }
-  
+  // The pages are resident already, this only fills the page tables
+  if (parallel_load((uint8_t *)parents, config.parents_size, -1) != 0) {
+    munmap(parents, config.parents_size);
+    return NULL;
+  }
+  return parents;
+}
+
+int remove_shared_parent_cache(const sector_config_t& config) {
+  const char *shm_dir = parent_cache_shm_dir;
+  if (shm_dir == NULL || config.parents_cache_filename == NULL) {
+    return 0;
+  }
+  std::string path = shared_parent_cache_path(config, shm_dir);
+  if (unlink(path.c_str()) != 0 && errno != ENOENT) {
+    fprintf(stderr, "unlink %s failed err %s\n", path.c_str(), strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+uint32_t *map_parent_cache(const sector_config_t& config) {
+  const char *parents_cache_filename = config.parents_cache_filename;
+  auto start = std::chrono::steady_clock::now();
+
   // Open the parent cache file
-  int fd = open(parents_cache_filename, O_RDONLY);
-  parants_cache_fd = fd;
-  
-  uint32_t *parents = (uint32_t *)mmap(NULL, PARENTS_SIZE, PROT_READ,
-                                       MAP_PRIVATE | MAP_LOCKED, fd, 0);
-  if (parents == (void *)-1) {
-    printf("mmap parents failed err %s\n", strerror(errno));
-    exit(1);
+  int fd = -1;
+  if (parents_cache_filename != NULL) {
+    fd = open(parents_cache_filename, O_RDONLY);
   }
-  if (((uintptr_t)parents & 0x3F) != 0) {
-    printf("ERROR - parents not aligned\n");
-    exit(1);
+  if (fd < 0) {
+    std::cerr << "Parents cache file not found, generating" << std::endl;
+    return generate_parent_cache_mapping(config);
   }
-  if (mlock(parents, PARENTS_SIZE) != 0) {
-    printf("mlock parents failed err %s\n", strerror(errno));
-    exit(1);
+
+  uint32_t *parents = NULL;
+  const char *shm_dir = parent_cache_shm_dir;
+  if (shm_dir != NULL) {
+    parents = map_shared_parent_cache(config, shm_dir, fd);
+  }
+
+  int failed = 0;
+  if (parents == NULL && huge_page_size > PAGE_SIZE_4K) {
+    // Copy the file into a shared huge page region instead of mapping the
+    // 4K page cache pages
+    parents = (uint32_t *)map_anonymous(config.parents_size, MAP_SHARED,
+                                        "parents");
+    if (parents == NULL) {
+      close(fd);
+      return NULL;
+    }
+    failed = parallel_load((uint8_t *)parents, config.parents_size, fd);
+    if (failed == 0 &&
+        mprotect(parents, config.parents_size, PROT_READ) != 0) {
+      fprintf(stderr, "mprotect parents failed err %s\n", strerror(errno));
+      failed = 1;
+    }
+    failed = failed || check_parent_cache(config, parents) != 0;
+  } else if (parents == NULL) {
+    parents = (uint32_t *)mmap(NULL, config.parents_size, PROT_READ,
+                               MAP_PRIVATE, fd, 0);
+    if (parents == MAP_FAILED) {
+      fprintf(stderr, "mmap parents failed err %s\n", strerror(errno));
+      close(fd);
+      return NULL;
+    }
+    failed = parallel_load((uint8_t *)parents, config.parents_size, -1) != 0 ||
+             check_parent_cache(config, parents) != 0;
   }
+  close(fd);
 
+  if (failed == 0 && ((uintptr_t)parents & 0x3F) != 0) {
+    fprintf(stderr, "ERROR - parents not aligned\n");
+    failed = 1;
+  }
+  if (failed) {
+    munmap(parents, config.parents_size);
+    return NULL;
+  }
+
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+  fprintf(stderr, "Parents cache ready in %.3fs\n", elapsed.count());
   return parents;
 }
 
-int setup_create_label_memory(uint32_t** parents_cache,
+void unmap_parent_cache(const sector_config_t& config, uint32_t *parents) {
+  if (munmap(parents, config.parents_size) != 0) {
+    fprintf(stderr, "munmap parents failed err %s\n", strerror(errno));
+  }
+}
+
+int setup_create_label_memory(const sector_config_t& config,
+                              uint32_t** parents_cache,
                               uint32_t** layer_labels,
-                              uint32_t** exp_labels) {
-  *parents_cache = map_parent_cache();
-  *layer_labels = allocate_layer();
-  *exp_labels = allocate_layer();
+                              uint32_t** exp_labels,
+                              int numa_node) {
+  *parents_cache = map_parent_cache(config);
+  if (*parents_cache == NULL) {
+    return 1;
+  }
+  *layer_labels = allocate_layer(config.sector_size, numa_node);
+  if (*layer_labels == NULL) {
+    unmap_parent_cache(config, *parents_cache);
+    return 1;
+  }
+  if (exp_labels != NULL) {
+    *exp_labels = allocate_layer(config.sector_size, numa_node);
+    if (*exp_labels == NULL) {
+      unmap_parent_cache(config, *parents_cache);
+      free_layer(*layer_labels, config.sector_size);
+      return 1;
+    }
+  }
 
+  alloc_config        = &config;
   parents_cache_alloc = *parents_cache;
   layer_labels_alloc  = *layer_labels;
-  exp_labels_alloc    = *exp_labels;
+  exp_labels_alloc    = exp_labels != NULL ? *exp_labels : nullptr;
 
   return 0;
 }
 
 void cleanup_create_label_memory() {
-  if (munmap(parents_cache_alloc, PARENTS_SIZE) != 0) {
-    printf("munmap parents failed err %s\n", strerror(errno));
-    exit(1);
-  }
-  if (munmap(layer_labels_alloc, SECTOR_SIZE) != 0) {
-    printf("munmap parents failed err %s\n", strerror(errno));
-    exit(1);
-  }
-  if (munmap(exp_labels_alloc, SECTOR_SIZE) != 0) {
-    printf("munmap parents failed err %s\n", strerror(errno));
-    exit(1);
+  unmap_parent_cache(*alloc_config, (uint32_t *)parents_cache_alloc);
+  free_layer((uint32_t *)layer_labels_alloc, alloc_config->sector_size);
+  if (exp_labels_alloc != nullptr) {
+    free_layer((uint32_t *)exp_labels_alloc, alloc_config->sector_size);
   }
-  close(parants_cache_fd);
 }
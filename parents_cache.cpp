@@ -0,0 +1,405 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>       // uint*
+#include <cstring>       // memcpy
+#include <cstdio>        // fprintf
+#include <cmath>         // log2
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <byteswap.h>    // bswap_64
+#include "create_labels.h"
+#include "parents_cache.h"
+
+// Base graph (DRG) and expander graph parent generation, following the
+// BucketGraph and StackedGraph construction of rust-fil-proofs.
+
+const size_t PARENT_COUNT_BASE_M_PRIME = PARENT_COUNT_BASE - 1;
+const size_t FEISTEL_ROUNDS            = 3;
+
+static const char DRSAMPLE_DST[] = "Filecoin_DRSample";
+static const char FEISTEL_DST[]  = "Filecoin_Feistel";
+
+static const uint32_t SHA256_IV[8] = {
+  0x6a09e667U, 0xbb67ae85U, 0x3c6ef372U, 0xa54ff53aU,
+  0x510e527fU, 0x9b05688cU, 0x1f83d9abU, 0x5be0cd19U
+};
+
+// SHA-256 of a message short enough to fit in a single block
+static void sha256_short(uint8_t md[32], const uint8_t* msg, size_t len) {
+  uint8_t block[64] = {0};
+  std::memcpy(block, msg, len);
+  block[len] = 0x80;
+  uint64_t bits = bswap_64(len * 8);
+  std::memcpy(block + 56, &bits, 8);
+
+  uint32_t h[8];
+  std::memcpy(h, SHA256_IV, sizeof(h));
+  sha256_block(h, block, 1);
+  blst_sha256_emit(md, h);
+}
+
+// seed = SHA256(domain separation tag || porep_id)
+static void porep_domain_seed(uint8_t seed[32], const char* dst,
+                              const uint8_t porep_id[32]) {
+  uint8_t msg[55];
+  size_t dst_len = strlen(dst);
+  std::memcpy(msg, dst, dst_len);
+  std::memcpy(msg + dst_len, porep_id, 32);
+  sha256_short(seed, msg, dst_len + 32);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// ChaCha8 (rand_chacha::ChaCha8Rng) for base parent sampling
+/////////////////////////////////////////////////////////////////////////////
+
+#define CHACHA_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define CHACHA_QR(a, b, c, d)                         \
+  a += b; d ^= a; d = CHACHA_ROTL(d, 16);             \
+  c += d; b ^= c; b = CHACHA_ROTL(b, 12);             \
+  a += b; d ^= a; d = CHACHA_ROTL(d, 8);              \
+  c += d; b ^= c; b = CHACHA_ROTL(b, 7);
+
+struct chacha8_rng {
+  uint32_t key[8];
+  uint64_t counter;
+  uint32_t block[16];
+  size_t   index;
+
+  explicit chacha8_rng(const uint8_t seed[32]) : counter(0), index(16) {
+    std::memcpy(key, seed, 32); // Little endian words
+  }
+
+  void refill() {
+    uint32_t x[16] = {
+      0x61707865U, 0x3320646eU, 0x79622d32U, 0x6b206574U,
+      key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+      (uint32_t)counter, (uint32_t)(counter >> 32), 0, 0
+    };
+    uint32_t s[16];
+    std::memcpy(s, x, sizeof(s));
+    for (size_t r = 0; r < 8; r += 2) {
+      CHACHA_QR(x[0], x[4], x[ 8], x[12]);
+      CHACHA_QR(x[1], x[5], x[ 9], x[13]);
+      CHACHA_QR(x[2], x[6], x[10], x[14]);
+      CHACHA_QR(x[3], x[7], x[11], x[15]);
+      CHACHA_QR(x[0], x[5], x[10], x[15]);
+      CHACHA_QR(x[1], x[6], x[11], x[12]);
+      CHACHA_QR(x[2], x[7], x[ 8], x[13]);
+      CHACHA_QR(x[3], x[4], x[ 9], x[14]);
+    }
+    for (size_t i = 0; i < 16; i++) {
+      block[i] = x[i] + s[i];
+    }
+    counter++;
+    index = 0;
+  }
+
+  uint64_t next_u64() {
+    if (index >= 16) {
+      refill();
+    }
+    uint64_t lo = block[index];
+    uint64_t hi = block[index + 1];
+    index += 2;
+    return (hi << 32) | lo;
+  }
+};
+
+#undef CHACHA_QR
+#undef CHACHA_ROTL
+
+// Base DRG parents for node, predecessor placement depends on the api
+static void drg_parents(uint32_t* parents, uint32_t node,
+                        const uint8_t drg_seed[32], sdr_api_version api) {
+  if (node < 2) {
+    for (size_t k = 0; k < PARENT_COUNT_BASE; k++) {
+      parents[k] = 0;
+    }
+    return;
+  }
+
+  uint8_t seed[32];
+  std::memcpy(seed, drg_seed, 28);
+  std::memcpy(seed + 28, &node, 4);
+  chacha8_rng rng(seed);
+
+  uint64_t metagraph_node = (uint64_t)node * PARENT_COUNT_BASE_M_PRIME;
+  uint64_t n_buckets = (uint64_t)std::ceil(std::log2((double)metagraph_node));
+
+  size_t predecessor = api == SDR_API_V1_0 ? PARENT_COUNT_BASE_M_PRIME : 0;
+  uint32_t* other = api == SDR_API_V1_0 ? parents : parents + 1;
+
+  for (size_t k = 0; k < PARENT_COUNT_BASE_M_PRIME; k++) {
+    uint64_t bucket_index = (rng.next_u64() % n_buckets) + 1;
+    uint64_t largest  = std::min(metagraph_node, (uint64_t)1 << bucket_index);
+    uint64_t smallest = std::max((uint64_t)2, largest >> 1);
+    uint64_t n_distances = largest - smallest + 1;
+    uint64_t distance = smallest + (rng.next_u64() % n_distances);
+
+    uint32_t mapped = (uint32_t)((metagraph_node - distance) /
+                                 PARENT_COUNT_BASE_M_PRIME);
+    other[k] = mapped == node ? node - 1 : mapped;
+  }
+  parents[predecessor] = node - 1;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Feistel permutation over node * expansion degree for expander parents
+/////////////////////////////////////////////////////////////////////////////
+
+static const uint64_t BLAKE2B_IV[8] = {
+  0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+  0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+  0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+  0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint8_t BLAKE2B_SIGMA[12][16] = {
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+  { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+  { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+  {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+  {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+  {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+  { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+  { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+  {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+  { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+  { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+#define BLAKE2B_ROTR(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+#define BLAKE2B_G(a, b, c, d, x, y)                       \
+  a = a + b + x; d = BLAKE2B_ROTR(d ^ a, 32);             \
+  c = c + d;     b = BLAKE2B_ROTR(b ^ c, 24);             \
+  a = a + b + y; d = BLAKE2B_ROTR(d ^ a, 16);             \
+  c = c + d;     b = BLAKE2B_ROTR(b ^ c, 63);
+
+// Feistel round function: first 8 bytes of BLAKE2b-64(right_be || key_be),
+// read as a big endian integer.
+static inline uint64_t feistel_round(uint64_t right, uint64_t key) {
+  uint64_t m[16] = { bswap_64(right), bswap_64(key) };
+  uint64_t h0 = BLAKE2B_IV[0] ^ 0x01010008ULL; // No key, 8 byte digest
+  uint64_t v[16] = {
+    h0,            BLAKE2B_IV[1], BLAKE2B_IV[2], BLAKE2B_IV[3],
+    BLAKE2B_IV[4], BLAKE2B_IV[5], BLAKE2B_IV[6], BLAKE2B_IV[7],
+    BLAKE2B_IV[0], BLAKE2B_IV[1], BLAKE2B_IV[2], BLAKE2B_IV[3],
+    BLAKE2B_IV[4] ^ 16,       // Message length
+    BLAKE2B_IV[5],
+    ~BLAKE2B_IV[6],           // Final block
+    BLAKE2B_IV[7]
+  };
+  for (size_t r = 0; r < 12; r++) {
+    const uint8_t* s = BLAKE2B_SIGMA[r];
+    BLAKE2B_G(v[0], v[4], v[ 8], v[12], m[s[ 0]], m[s[ 1]]);
+    BLAKE2B_G(v[1], v[5], v[ 9], v[13], m[s[ 2]], m[s[ 3]]);
+    BLAKE2B_G(v[2], v[6], v[10], v[14], m[s[ 4]], m[s[ 5]]);
+    BLAKE2B_G(v[3], v[7], v[11], v[15], m[s[ 6]], m[s[ 7]]);
+    BLAKE2B_G(v[0], v[5], v[10], v[15], m[s[ 8]], m[s[ 9]]);
+    BLAKE2B_G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+    BLAKE2B_G(v[2], v[7], v[ 8], v[13], m[s[12]], m[s[13]]);
+    BLAKE2B_G(v[3], v[4], v[ 9], v[14], m[s[14]], m[s[15]]);
+  }
+  return bswap_64(h0 ^ v[0] ^ v[8]);
+}
+
+#undef BLAKE2B_G
+#undef BLAKE2B_ROTR
+
+feistel_params::feistel_params(uint64_t elements,
+                               const uint8_t feistel_seed[32])
+  : num_elements(elements) {
+  uint64_t next_pow4 = 4;
+  uint64_t log4 = 1;
+  while (next_pow4 < num_elements) {
+    next_pow4 *= 4;
+    log4++;
+  }
+  left_mask  = ((1ULL << log4) - 1) << log4;
+  right_mask = (1ULL << log4) - 1;
+  half_bits  = log4;
+  std::memcpy(keys, feistel_seed, 32); // Little endian words
+}
+
+uint64_t feistel_params::encode(uint64_t index) const {
+  uint64_t left  = (index & left_mask) >> half_bits;
+  uint64_t right = index & right_mask;
+  for (size_t i = 0; i < FEISTEL_ROUNDS; i++) {
+    uint64_t next_right = left ^ (feistel_round(right, keys[i]) & right_mask);
+    left  = right;
+    right = next_right;
+  }
+  return (left << half_bits) | right;
+}
+
+uint64_t feistel_params::permute(uint64_t index) const {
+  uint64_t u = encode(index);
+  while (u >= num_elements) {
+    u = encode(u);
+  }
+  return u;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Cache generation
+/////////////////////////////////////////////////////////////////////////////
+
+int sdr_porep_id(uint8_t porep_id[32], size_t sector_size,
+                 sdr_api_version api) {
+  uint64_t proof_id;
+  switch (sector_size) {
+  case SECTOR_SIZE_2K:   proof_id = 0; break; // StackedDrg2KiBV1
+  case SECTOR_SIZE_8M:   proof_id = 1; break; // StackedDrg8MiBV1
+  case SECTOR_SIZE_512M: proof_id = 2; break; // StackedDrg512MiBV1
+  case SECTOR_SIZE_32G:  proof_id = 3; break; // StackedDrg32GiBV1
+  case SECTOR_SIZE_64G:  proof_id = 4; break; // StackedDrg64GiBV1
+  default:
+    fprintf(stderr, "ERROR - no registered proof for sector size %ld\n",
+            sector_size);
+    return 1;
+  }
+  if (api == SDR_API_V1_1) {
+    proof_id += 5;                               // StackedDrg*V1_1
+  }
+  std::memset(porep_id, 0, 32);
+  std::memcpy(porep_id, &proof_id, 8);
+  return 0;
+}
+
+// seed = SHA256(dst || porep_id) for the sector size, zero if no proof is
+// registered for it
+static int graph_seed(uint8_t seed[32], const char* dst, size_t sector_size,
+                      sdr_api_version api) {
+  uint8_t porep_id[32];
+  if (sdr_porep_id(porep_id, sector_size, api) != 0) {
+    std::memset(seed, 0, 32);
+    return 1;
+  }
+  porep_domain_seed(seed, dst, porep_id);
+  return 0;
+}
+
+static feistel_params graph_feistel(size_t sector_size, sdr_api_version api) {
+  uint8_t feistel_seed[32];
+  graph_seed(feistel_seed, FEISTEL_DST, sector_size, api);
+  return feistel_params(sector_size / NODE_SIZE * PARENT_COUNT_EXP,
+                        feistel_seed);
+}
+
+sdr_graph::sdr_graph(size_t sector_size, sdr_api_version api_version)
+  : num_nodes(sector_size / NODE_SIZE), api(api_version),
+    feistel(graph_feistel(sector_size, api_version)) {
+  if (graph_seed(drg_seed, DRSAMPLE_DST, sector_size, api) != 0) {
+    num_nodes = 0;
+  }
+}
+
+void sdr_graph::base_parents(uint32_t* parents, uint64_t node) const {
+  drg_parents(parents, (uint32_t)node, drg_seed, api);
+}
+
+void sdr_graph::expander_parents(uint32_t* parents, uint64_t node) const {
+  uint64_t a = node * PARENT_COUNT_EXP;
+  for (size_t i = 0; i < PARENT_COUNT_EXP; i++) {
+    parents[i] = (uint32_t)(feistel.permute(a + i) / PARENT_COUNT_EXP);
+  }
+}
+
+void sdr_graph::parents(uint32_t* parents, uint64_t node) const {
+  base_parents(parents, node);
+  expander_parents(parents + PARENT_COUNT_BASE, node);
+}
+
+int generate_parent_cache(uint32_t* parents_cache, size_t sector_size,
+                          sdr_api_version api, size_t num_threads) {
+  sdr_graph graph(sector_size, api);
+  if (graph.num_nodes == 0) {
+    return 1;
+  }
+
+  parallel_nodes(graph.num_nodes, num_threads,
+                 [&](uint64_t first, uint64_t last) {
+    for (uint64_t node = first; node < last; node++) {
+      graph.parents(parents_cache + node * PARENT_COUNT, node);
+    }
+  });
+  return 0;
+}
+
+int verify_parent_cache(const uint32_t* parents_cache, size_t sector_size,
+                        sdr_api_version api, size_t num_threads) {
+  sdr_graph graph(sector_size, api);
+  uint64_t num_nodes = graph.num_nodes;
+  if (num_nodes == 0) {
+    return 1;
+  }
+
+  std::atomic<uint64_t> first_mismatch(num_nodes);
+  parallel_nodes(num_nodes, num_threads, [&](uint64_t first, uint64_t last) {
+    for (uint64_t node = first; node < last; node++) {
+      uint32_t parents[PARENT_COUNT];
+      graph.parents(parents, node);
+      if (std::memcmp(parents, parents_cache + node * PARENT_COUNT,
+                      sizeof(parents)) != 0) {
+        uint64_t cur = first_mismatch.load();
+        while (node < cur && !first_mismatch.compare_exchange_weak(cur, node));
+        break;
+      }
+    }
+  });
+
+  if (first_mismatch.load() != num_nodes) {
+    fprintf(stderr, "ERROR - parents cache mismatch at node %ld\n",
+            first_mismatch.load());
+    return 1;
+  }
+  return 0;
+}
+
+int check_parent_cache_sample(const uint32_t* parents_cache,
+                              size_t sector_size, uint64_t interval,
+                              size_t num_threads) {
+  sdr_graph graph(sector_size, SDR_API_V1_0);
+  uint64_t num_nodes = graph.num_nodes;
+  if (num_nodes == 0) {
+    return 1;
+  }
+  uint64_t last      = num_nodes - 1;
+
+  // The cache doesn't say which version it holds. V1_1 has its own porep_id
+  // and so different seeds and parents, the last node tells them apart.
+  uint32_t parents[PARENT_COUNT];
+  graph.parents(parents, last);
+  if (std::memcmp(parents, parents_cache + last * PARENT_COUNT,
+                  sizeof(parents)) != 0) {
+    graph = sdr_graph(sector_size, SDR_API_V1_1);
+  }
+
+  uint64_t step    = std::max(std::min(interval, num_nodes / 64), (uint64_t)1);
+  uint64_t samples = (num_nodes + step - 1) / step;
+  std::atomic<uint64_t> mismatch(num_nodes);
+  parallel_nodes(samples, num_threads, [&](uint64_t first, uint64_t end) {
+    for (uint64_t i = first; i < end; i++) {
+      uint64_t node = i * step;
+      uint32_t expected[PARENT_COUNT];
+      graph.parents(expected, node);
+      if (std::memcmp(expected, parents_cache + node * PARENT_COUNT,
+                      sizeof(expected)) != 0) {
+        mismatch.store(node);
+        break;
+      }
+    }
+  });
+
+  if (mismatch.load() != num_nodes) {
+    fprintf(stderr,
+            "ERROR - parents cache does not match the graph at node %ld\n",
+            mismatch.load());
+    return 1;
+  }
+  return 0;
+}
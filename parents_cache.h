@@ -0,0 +1,125 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __PARENTS_CACHE_H__
+#define __PARENTS_CACHE_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <system_error>
+#include <vector>
+
+// Position of the predecessor among the base parents changed between
+// proof versions. V1_0 stores it last, V1_1 first.
+enum sdr_api_version {
+  SDR_API_V1_0,
+  SDR_API_V1_1
+};
+
+// Build the porep_id for a sector size: the registered proof id as a little
+// endian u64, nonce zero, remaining bytes zero. Returns 1 if no proof is
+// registered for sector_size.
+int sdr_porep_id(uint8_t porep_id[32], size_t sector_size,
+                 sdr_api_version api);
+
+// Nodes handed to a thread at a time by parallel_nodes
+const uint64_t NODES_PER_WORK_ITEM = 1 << 14;
+
+// Feistel permutation over node * PARENT_COUNT_EXP behind the expander
+// parents
+struct feistel_params {
+  uint64_t num_elements;
+  uint64_t left_mask;
+  uint64_t right_mask;
+  uint64_t half_bits;
+  uint64_t keys[4];
+
+  feistel_params(uint64_t elements, const uint8_t feistel_seed[32]);
+
+  uint64_t encode(uint64_t index) const;
+  // Cycle walk until the result lands inside the domain
+  uint64_t permute(uint64_t index) const;
+};
+
+// Parent graph of one sector size and proof version. Computes the parents
+// of any node on its own, so callers can generate them in any order.
+// num_nodes is 0 if no proof is registered for the sector size.
+class sdr_graph {
+public:
+  sdr_graph(size_t sector_size, sdr_api_version api);
+
+  // PARENT_COUNT_BASE base DRG parents of node
+  void base_parents(uint32_t* parents, uint64_t node) const;
+  // PARENT_COUNT_EXP expander parents of node
+  void expander_parents(uint32_t* parents, uint64_t node) const;
+  // All PARENT_COUNT parents in cache order
+  void parents(uint32_t* parents, uint64_t node) const;
+
+  uint64_t        num_nodes;
+  sdr_api_version api;
+
+private:
+  uint8_t         drg_seed[32];
+  feistel_params  feistel;
+};
+
+// Run fn(first_node, last_node) over the node range on num_threads threads,
+// 0 means all cores. Work is handed out in chunks of NODES_PER_WORK_ITEM
+// since expander cost varies with cycle walks. If threads can't be started
+// the calling thread finishes the work with those that were.
+template<typename F>
+void parallel_nodes(uint64_t num_nodes, size_t num_threads, F fn) {
+  if (num_threads == 0) {
+    num_threads = std::thread::hardware_concurrency();
+  }
+  std::atomic<uint64_t> next_node(0);
+  auto work = [&]() {
+    while (true) {
+      uint64_t first = next_node.fetch_add(NODES_PER_WORK_ITEM);
+      if (first >= num_nodes) {
+        break;
+      }
+      uint64_t last = std::min(first + NODES_PER_WORK_ITEM, num_nodes);
+      fn(first, last);
+    }
+  };
+  std::vector<std::thread> threads;
+  threads.reserve(num_threads);
+  try {
+    for (size_t t = 0; t < num_threads; t++) {
+      threads.emplace_back(work);
+    }
+  } catch (const std::system_error&) {
+    work();
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+// Fill parents_cache (num_nodes * PARENT_COUNT entries) with the base DRG
+// parents followed by the expander parents of every node, in the layout of
+// the lotus v28 cache file. SDR_CHECK_LOTUS in test_debug checks the result
+// against labels lotus wrote. Work is split over num_threads threads, 0
+// means all cores.
+int generate_parent_cache(uint32_t* parents_cache, size_t sector_size,
+                          sdr_api_version api, size_t num_threads);
+
+// Regenerate the graph and compare it against parents_cache. Returns 0 if
+// every node matches, otherwise prints and returns 1.
+int verify_parent_cache(const uint32_t* parents_cache, size_t sector_size,
+                        sdr_api_version api, size_t num_threads);
+
+// Quick content check of a loaded cache: every interval-th node (more for
+// tiny sectors) is compared against the graph on num_threads threads. The
+// proof version is taken from the last node. Returns 0 if all samples
+// match, otherwise prints and returns 1.
+int check_parent_cache_sample(const uint32_t* parents_cache,
+                              size_t sector_size, uint64_t interval,
+                              size_t num_threads);
+
+#endif // __PARENTS_CACHE_H__
@@ -0,0 +1,119 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>          // uint*
+#include <cstdio>           // fprintf
+#include <cstring>          // memset
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "perf_counters.h"
+
+static const char* PERF_COUNTER_NAMES[PERF_COUNTER_COUNT] = {
+  "cycles",
+  "LLC-load-misses",
+  "dTLB-load-misses",
+  "dTLB-store-misses"
+};
+
+static const uint32_t PERF_COUNTER_TYPES[PERF_COUNTER_COUNT] = {
+  PERF_TYPE_HARDWARE,
+  PERF_TYPE_HW_CACHE,
+  PERF_TYPE_HW_CACHE,
+  PERF_TYPE_HW_CACHE
+};
+
+static const uint64_t PERF_COUNTER_CONFIGS[PERF_COUNTER_COUNT] = {
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_CACHE_LL |
+    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+  PERF_COUNT_HW_CACHE_DTLB |
+    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+  PERF_COUNT_HW_CACHE_DTLB |
+    (PERF_COUNT_HW_CACHE_OP_WRITE << 8) |
+    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+};
+
+perf_counters::perf_counters() {
+  for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+    fds[i] = -1;
+  }
+}
+
+perf_counters::~perf_counters() {
+  for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+}
+
+int perf_counters::start(bool quiet) {
+  int opened = 0;
+  for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (fds[i] < 0) {
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size           = sizeof(attr);
+      attr.type           = PERF_COUNTER_TYPES[i];
+      attr.config         = PERF_COUNTER_CONFIGS[i];
+      attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                            PERF_FORMAT_TOTAL_TIME_RUNNING;
+      attr.disabled       = 1;
+      attr.inherit        = 1;   // Count producer threads started later
+      attr.exclude_kernel = 1;
+      attr.exclude_hv     = 1;
+      fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    if (fds[i] >= 0) {
+      ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+      opened++;
+    }
+  }
+  if (opened == 0) {
+    if (quiet) {
+      return 1;
+    }
+    fprintf(stderr, "perf counters unavailable, check perf_event_paranoid\n");
+    return 1;
+  }
+  return 0;
+}
+
+void perf_counters::stop() {
+  for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (fds[i] >= 0) {
+      ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+}
+
+uint64_t perf_counters::read(perf_counter_t counter) const {
+  // value, time enabled, time running
+  uint64_t values[3] = { 0, 0, 0 };
+  if (fds[counter] < 0 ||
+      ::read(fds[counter], values, sizeof(values)) != sizeof(values)) {
+    return 0;
+  }
+  if (values[2] != 0 && values[2] < values[1]) {
+    return (uint64_t)((double)values[0] * values[1] / values[2]);
+  }
+  return values[0];
+}
+
+const char* perf_counters::name(perf_counter_t counter) {
+  return PERF_COUNTER_NAMES[counter];
+}
+
+void perf_counters::print(const char* label) const {
+  fprintf(stderr, "%s:", label);
+  for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+    fprintf(stderr, " %s %ld", PERF_COUNTER_NAMES[i], read((perf_counter_t)i));
+  }
+  fprintf(stderr, "\n");
+}
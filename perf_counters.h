@@ -0,0 +1,43 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __PERF_COUNTERS_H__
+#define __PERF_COUNTERS_H__
+
+#include <cstdint>
+
+// Hardware events counted by perf_counters
+enum perf_counter_t {
+  PERF_CYCLES,
+  PERF_LLC_LOAD_MISSES,
+  PERF_DTLB_LOAD_MISSES,
+  PERF_DTLB_STORE_MISSES,
+  PERF_COUNTER_COUNT
+};
+
+// Hardware counters for the calling thread and every thread it starts
+// after start(), through perf_event_open. Events the CPU or the
+// perf_event_paranoid setting do not allow read as zero. Counts are scaled
+// up when the kernel multiplexes more events than the PMU has counters.
+class perf_counters {
+public:
+  perf_counters();
+  ~perf_counters();
+
+  // Open and reset the counters, returns non-zero if none could be opened.
+  // quiet skips the message when none could.
+  int start(bool quiet = false);
+  void stop();
+
+  uint64_t read(perf_counter_t counter) const;
+  static const char* name(perf_counter_t counter);
+
+  // Print all counters with a label to stderr
+  void print(const char* label) const;
+
+private:
+  int fds[PERF_COUNTER_COUNT];
+};
+
+#endif // __PERF_COUNTERS_H__
@@ -0,0 +1,216 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>          // uint*
+#include <cstdio>           // fprintf, rename
+#include <cstring>          // strerror
+#include <cstdlib>          // posix_memalign
+#include <algorithm>
+#include <fcntl.h>          // open
+#include <errno.h>
+#include <unistd.h>         // pread, pwrite, usleep, fdatasync
+#include <sys/stat.h>       // fstat
+#include "replica_encode.h"
+
+extern "C" {
+  // From blst.h, the BLS12-381 scalar field as 4 little endian limbs.
+  // Addition is the same in and out of Montgomery form, so the labels and
+  // data elements are added as they are.
+  typedef struct { uint64_t l[4]; } blst_fr;
+  void blst_fr_add(blst_fr* ret, const blst_fr* a, const blst_fr* b);
+}
+
+std::string replica_filename(const char* output_dir) {
+  return std::string(output_dir) + "/sc-02-data-replica.dat";
+}
+
+replica_encoder::replica_encoder()
+  : progress(0), source(&progress), key(NULL), num_nodes(0), data_fd(-1),
+    replica_fd(-1), next_chunk(0), stopping(false), error(0) {
+}
+
+replica_encoder::~replica_encoder() {
+  cancel();
+}
+
+// O_DIRECT needs block aligned lengths, the 2K sector is too small for it.
+// Some filesystems (tmpfs) refuse O_DIRECT, fall back to buffered I/O.
+static int open_direct(const char* file_path, int flags, bool direct) {
+  int fd = -1;
+  if (direct) {
+    fd = open(file_path, flags | O_DIRECT, 0644);
+  }
+  if (fd < 0) {
+    fd = open(file_path, flags, 0644);
+  }
+  if (fd < 0) {
+    fprintf(stderr, "open %s failed err %s\n", file_path, strerror(errno));
+  }
+  return fd;
+}
+
+int replica_encoder::start(const char* data_file, const char* replica_path,
+                           const uint32_t* key_labels, uint64_t nodes,
+                           uint64_t start_node,
+                           std::atomic<uint64_t>* progress_source,
+                           size_t threads) {
+  source    = progress_source != NULL ? progress_source : &progress;
+  key       = key_labels;
+  num_nodes = nodes;
+  path      = replica_path;
+  data_path = data_file;
+  error     = 0;
+  stopping.store(false);
+  next_chunk.store(0);
+
+  const size_t total  = num_nodes * NODE_SIZE;
+  const bool   direct = total % 4096 == 0;
+  data_fd = open_direct(data_file, O_RDONLY, direct);
+  if (data_fd < 0) {
+    return 1;
+  }
+  struct stat st;
+  if (fstat(data_fd, &st) != 0 || (size_t)st.st_size < total) {
+    fprintf(stderr, "ERROR - %s is shorter than the sector\n", data_file);
+    close_files();
+    return 1;
+  }
+  std::string tmp_path = path + ".tmp";
+  replica_fd = open_direct(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                           direct);
+  if (replica_fd < 0) {
+    close_files();
+    return 1;
+  }
+
+  if (threads == 0) {
+    threads = std::max(std::thread::hardware_concurrency(), 1U);
+  }
+  threads = std::min(threads, (total + ENCODE_CHUNK - 1) / ENCODE_CHUNK);
+  source->store(start_node);
+  for (size_t i = 0; i < threads; i++) {
+    workers.emplace_back([this]() { run(); });
+  }
+  return 0;
+}
+
+void replica_encoder::close_files() {
+  if (data_fd >= 0) {
+    close(data_fd);
+    data_fd = -1;
+  }
+  if (replica_fd >= 0) {
+    // Durable before the rename, a resumed run trusts a complete replica
+    std::string tmp_path = path + ".tmp";
+    if (error == 0 && fdatasync(replica_fd) != 0) {
+      fprintf(stderr, "sync %s failed err %s\n",
+              tmp_path.c_str(), strerror(errno));
+      error = 1;
+    }
+    if (close(replica_fd) != 0) {
+      fprintf(stderr, "close %s failed err %s\n",
+              tmp_path.c_str(), strerror(errno));
+      error = 1;
+    }
+    replica_fd = -1;
+    if (error == 0 && rename(tmp_path.c_str(), path.c_str()) != 0) {
+      fprintf(stderr, "rename %s failed err %s\n",
+              path.c_str(), strerror(errno));
+      error = 1;
+    }
+    if (error != 0) {
+      unlink(tmp_path.c_str());
+    }
+  }
+}
+
+int replica_encoder::finish() {
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  workers.clear();
+  close_files();
+  return error;
+}
+
+void replica_encoder::cancel() {
+  stopping.store(true);
+  error = 1;
+  finish();
+}
+
+// A worker: claims chunks in order, reads the data ahead of the labeling,
+// then waits for the key and writes the sum
+void replica_encoder::run() {
+  const size_t total = num_nodes * NODE_SIZE;
+  uint8_t* buf = NULL;
+  if (posix_memalign((void**)&buf, 4096, ENCODE_CHUNK) != 0) {
+    fprintf(stderr, "ERROR - encode buffer allocation failed\n");
+    error = 1;
+    return;
+  }
+
+  while (error == 0) {
+    size_t offset = next_chunk.fetch_add(1) * ENCODE_CHUNK;
+    if (offset >= total) {
+      break;
+    }
+    size_t len = std::min(ENCODE_CHUNK, total - offset);
+
+    for (size_t done = 0; done < len;) {
+      ssize_t ret = pread(data_fd, buf + done, len - done, offset + done);
+      if (ret <= 0) {
+        fprintf(stderr, "read %s failed err %s\n", data_path.c_str(),
+                ret < 0 ? strerror(errno) : "short file");
+        error = 1;
+        break;
+      }
+      done += ret;
+    }
+
+    // Labels below progress are final
+    while (error == 0 &&
+           source->load(std::memory_order_acquire) * NODE_SIZE <
+           offset + len) {
+      if (stopping.load()) {
+        error = 1;
+        break;
+      }
+      usleep(1000);
+    }
+    if (error != 0) {
+      break;
+    }
+
+    blst_fr*       data   = (blst_fr*)buf;
+    const blst_fr* labels = (const blst_fr*)((const uint8_t*)key + offset);
+    for (size_t i = 0; i < len / NODE_SIZE; i++) {
+      blst_fr_add(&data[i], &data[i], &labels[i]);
+    }
+
+    for (size_t done = 0; done < len;) {
+      ssize_t ret = pwrite(replica_fd, buf + done, len - done,
+                           offset + done);
+      if (ret <= 0) {
+        fprintf(stderr, "write %s failed err %s\n", path.c_str(),
+                ret < 0 ? strerror(errno) : "short write");
+        error = 1;
+        break;
+      }
+      done += ret;
+    }
+  }
+  free(buf);
+}
+
+int encode_replica(const char* data_path, const char* replica_path,
+                   const uint32_t* key, uint64_t num_nodes, size_t threads) {
+  replica_encoder encoder;
+  // Every label is final from the start
+  if (encoder.start(data_path, replica_path, key, num_nodes, num_nodes,
+                    NULL, threads) != 0) {
+    return 1;
+  }
+  return encoder.finish();
+}
@@ -0,0 +1,77 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __REPLICA_ENCODE_H__
+#define __REPLICA_ENCODE_H__
+
+#include <cstdint>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "create_labels.h"
+
+// Replica encoding
+//
+// The replica is the unsealed data plus the last layer, element by element
+// in the BLS12-381 scalar field. Labels are already below 2^254 and so are
+// the Fr32 padded data elements, blst_fr_add does the modular addition.
+// Worker threads on every core stream the data file in ENCODE_CHUNK
+// O_DIRECT reads, add the key in place and write the chunk to the replica
+// file. Following the labeling progress, a chunk is encoded as soon as its
+// labels are final, so the last layer is encoded while it is labeled and
+// is never read back.
+
+// Bytes per read and write
+const size_t ENCODE_CHUNK = (1UL << 20) * 16;
+
+class replica_encoder {
+public:
+  replica_encoder();
+  ~replica_encoder();
+
+  // Start encoding data_path with key, the last layer, which will be
+  // filled up to num_nodes. Labels below the count published to source
+  // are final, the progress member is used when source is NULL and reset
+  // to start_node. The replica is written to replica_path once complete.
+  // threads 0 uses every core.
+  int start(const char* data_path, const char* replica_path,
+            const uint32_t* key, uint64_t num_nodes, uint64_t start_node = 0,
+            std::atomic<uint64_t>* source = NULL, size_t threads = 0);
+
+  // Wait for the replica. Returns non-zero on I/O errors. Safe to call when
+  // nothing was started.
+  int finish();
+  // Stop waiting for labels that will not come, e.g. after a labeling
+  // error. The replica file is not written.
+  void cancel();
+
+  std::atomic<uint64_t> progress;
+
+private:
+  void run();
+  void close_files();
+
+  std::string              path;
+  std::string              data_path;
+  std::atomic<uint64_t>*   source;
+  const uint32_t*          key;
+  uint64_t                 num_nodes;
+  int                      data_fd;
+  int                      replica_fd;
+  std::atomic<uint64_t>    next_chunk;
+  std::vector<std::thread> workers;
+  std::atomic<bool>        stopping;
+  std::atomic<int>         error;
+};
+
+// Encode a finished last layer in one pass, returns non-zero on errors
+int encode_replica(const char* data_path, const char* replica_path,
+                   const uint32_t* key, uint64_t num_nodes,
+                   size_t threads = 0);
+
+// Replica file create_layers writes next to the layers
+std::string replica_filename(const char* output_dir);
+
+#endif // __REPLICA_ENCODE_H__
@@ -1,3 +1,3 @@
 #!/bin/bash
 
-taskset -c 4,5,6 sudo ./bench --benchmark_filter=CreateLabelsExp --benchmark_repetitions=1
+sudo SDR_PIN=1 SDR_SECTOR_SIZE=${SDR_SECTOR_SIZE:-536870912} ./bench --benchmark_filter=CreateLabelsExp --benchmark_repetitions=1
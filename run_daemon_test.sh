@@ -0,0 +1,69 @@
+#!/bin/bash
+
+# End to end check of sdr_daemon: label 2K sectors through sdr_client and
+# compare the layer files with those of test_debug. Run after build.sh.
+
+REPLICA_ID=f3aeb3d67393f643547cbbf13067a19d77c2a398bfb0de7f13197f0e7e03981f
+LAYERS=11
+
+DIR=$(mktemp -d)
+export SDR_SOCKET=$DIR/sdr.sock
+DAEMON=
+
+cleanup() {
+  if [ -n "$DAEMON" ]; then
+    kill $DAEMON 2> /dev/null
+    wait $DAEMON 2> /dev/null
+  fi
+  rm -rf $DIR
+}
+trap cleanup EXIT
+
+fail() {
+  echo "FAIL: $*"
+  exit 1
+}
+
+mkdir $DIR/ref
+./test_debug 2048 $LAYERS $DIR/ref > $DIR/ref.log || fail "test_debug"
+
+./sdr_daemon 2048 $SDR_SOCKET > $DIR/daemon.log &
+DAEMON=$!
+for i in $(seq 100); do
+  [ -S $SDR_SOCKET ] && break
+  sleep 0.1
+done
+[ -S $SDR_SOCKET ] || fail "daemon did not start"
+
+# A second daemon must not take over the socket of a running one
+./sdr_daemon 2048 $SDR_SOCKET > /dev/null && fail "second daemon started"
+./sdr_client list > /dev/null || fail "socket replaced"
+
+# Only hex digits make a replica_id
+./sdr_client submit 2048 -1${REPLICA_ID:2} $LAYERS $DIR/bad > /dev/null &&
+  fail "signed replica_id accepted"
+
+JOBS=
+for j in 1 2 3; do
+  reply=$(./sdr_client submit 2048 $REPLICA_ID $LAYERS $DIR/job$j) ||
+    fail "submit: $reply"
+  JOBS="$JOBS ${reply#ok }"
+done
+
+for id in $JOBS; do
+  reply=$(./sdr_client wait $id) || fail "job $id: $reply"
+  # Reported jobs are forgotten
+  ./sdr_client status $id > /dev/null && fail "job $id still listed"
+done
+
+for j in 1 2 3; do
+  for l in $(seq $LAYERS); do
+    f=sc-02-data-layer-$l.dat
+    cmp -s $DIR/ref/$f $DIR/job$j/$f || fail "job $j layer $l differs"
+  done
+done
+
+./sdr_client shutdown > /dev/null || fail "shutdown"
+wait $DAEMON || fail "daemon exit status"
+DAEMON=
+echo "PASS: $LAYERS layers of 3 daemon jobs match test_debug"
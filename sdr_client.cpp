@@ -0,0 +1,63 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+// Send one request to sdr_daemon and print the reply, see label_daemon.h.
+//
+//   ./sdr_client submit 536870912 <replica_id hex> 11 /path/to/cache
+//   ./sdr_client wait 1
+//
+// SDR_SOCKET overrides LABEL_DAEMON_SOCKET. Exits non-zero on errors and
+// failed jobs.
+
+#include <cstdio>           // printf
+#include <cstdlib>          // getenv
+#include <cstring>          // strerror
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <unistd.h>
+#include "label_daemon.h"
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    printf("Usage: %s <submit|status|wait|list|metrics|shutdown> [args...]\n",
+           argv[0]);
+    return 1;
+  }
+  std::string request = argv[1];
+  for (int i = 2; i < argc; i++) {
+    request += std::string(" ") + argv[i];
+  }
+  request += "\n";
+
+  const char* socket_path = getenv("SDR_SOCKET");
+  if (socket_path == NULL) {
+    socket_path = LABEL_DAEMON_SOCKET;
+  }
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+    printf("connect %s failed err %s\n", socket_path, strerror(errno));
+    return 1;
+  }
+  if (write(fd, request.data(), request.size()) != (ssize_t)request.size()) {
+    printf("write failed err %s\n", strerror(errno));
+    return 1;
+  }
+
+  std::string reply;
+  char buf[4096];
+  ssize_t ret;
+  while ((ret = read(fd, buf, sizeof(buf))) > 0) {
+    reply.append(buf, ret);
+  }
+  close(fd);
+  printf("%s", reply.c_str());
+
+  return reply.compare(0, 5, "error") == 0 ||
+         reply.find(" failed ") != std::string::npos;
+}
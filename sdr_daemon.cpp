@@ -0,0 +1,61 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+// Resident labeling service, see label_daemon.h for the protocol.
+//
+//   ./sdr_daemon [sector_size[,sector_size...]] [socket_path]
+//
+// Serves 512M sectors on LABEL_DAEMON_SOCKET by default. SDR_CORES limits
+// the cores used per sector size, SDR_PIN pins the labeling threads,
+// SDR_SHM_PARENTS, SDR_HUGEPAGES and SDR_TREES work as in test_debug.
+// Built with -DLABEL_METRICS, "metrics" requests export the per layer
+// metrics and SDR_METRICS_PERF adds hardware counters to them.
+
+#include <cstdint>          // uint*
+#include <cstdio>           // printf
+#include <cstdlib>          // strtoul
+#include <cstring>          // strcmp
+#include <signal.h>
+#include "label_daemon.h"
+#include "label_metrics.h"
+#include "layer_tree.h"
+
+int main(int argc, char** argv) {
+  std::vector<size_t> sector_sizes;
+  const char* sizes = argc > 1 ? argv[1] : NULL;
+  while (sizes != NULL && *sizes != '\0') {
+    char* end;
+    sector_sizes.push_back(strtoul(sizes, &end, 0));
+    sizes = *end == ',' ? end + 1 : end;
+  }
+  if (sector_sizes.empty()) {
+    sector_sizes.push_back(SECTOR_SIZE_512M);
+  }
+  const char* socket_path = argc > 2 ? argv[2] : LABEL_DAEMON_SOCKET;
+
+  const char* huge_pages = getenv("SDR_HUGEPAGES");
+  if (huge_pages != NULL) {
+    set_huge_page_size(strcmp(huge_pages, "1G") == 0 ? PAGE_SIZE_1G :
+                                                       PAGE_SIZE_2M);
+  }
+  const char* shm_dir = getenv("SDR_SHM_PARENTS");
+  if (shm_dir != NULL) {
+    set_parent_cache_shm_dir(shm_dir);
+  }
+  set_layer_trees(getenv("SDR_TREES") != NULL);
+  const char* cores = getenv("SDR_CORES");
+  set_label_metrics_perf(getenv("SDR_METRICS_PERF") != NULL);
+
+  // Clients that go away must not kill the daemon
+  signal(SIGPIPE, SIG_IGN);
+
+  label_daemon daemon;
+  if (daemon.start(socket_path, sector_sizes,
+                   cores != NULL ? strtoul(cores, NULL, 0) : 0,
+                   getenv("SDR_PIN") != NULL) != 0) {
+    return 1;
+  }
+  daemon.serve();
+  return 0;
+}
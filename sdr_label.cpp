@@ -0,0 +1,255 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>          // uint*
+#include <cstring>          // memcpy
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <new>              // std::nothrow, std::bad_alloc
+#include <string>
+#include <system_error>
+#include <thread>
+#include "sdr_label.h"
+#include "create_labels.h"
+#include "label_context.h"
+
+// Interval between progress callbacks
+const std::chrono::milliseconds SDR_LABEL_PROGRESS_INTERVAL(100);
+
+struct sdr_parents {
+  sector_config_t config;    // With the cache path of this handle
+  std::string     path;
+  parents_handle  handle;
+};
+
+struct sdr_sector {
+  sdr_parents_t*    parents;
+  uint32_t*         layers[2];
+  bool              owned[2];  // Allocated by the library
+  std::atomic<bool> cancel;
+};
+
+uint32_t sdr_label_abi_version(void) {
+  return SDR_LABEL_ABI_VERSION;
+}
+
+const char* sdr_label_strerror(int err) {
+  switch (err) {
+  case SDR_LABEL_OK:            return "success";
+  case SDR_LABEL_ERR_INVALID:   return "invalid argument";
+  case SDR_LABEL_ERR_PARENTS:   return "parents cache could not be loaded";
+  case SDR_LABEL_ERR_NOMEM:     return "out of memory or threads";
+  case SDR_LABEL_ERR_LABEL:     return "labeling failed";
+  case SDR_LABEL_ERR_CANCELLED: return "cancelled";
+  default:                      return "unknown error";
+  }
+}
+
+// Exceptions never cross the C interface. Map the one being handled:
+// allocation and thread creation failures to SDR_LABEL_ERR_NOMEM, anything
+// else to SDR_LABEL_ERR_LABEL.
+static int exception_error() {
+  try {
+    throw;
+  } catch (const std::bad_alloc&) {
+    return SDR_LABEL_ERR_NOMEM;
+  } catch (const std::system_error&) {
+    return SDR_LABEL_ERR_NOMEM;
+  } catch (...) {
+    return SDR_LABEL_ERR_LABEL;
+  }
+}
+
+static int parents_open(uint64_t sector_size, const char* path, bool compact,
+                        sdr_parents_t** parents) {
+  if (parents == NULL || (compact && path == NULL)) {
+    return SDR_LABEL_ERR_INVALID;
+  }
+  *parents = NULL;
+  const sector_config_t* config = get_sector_config(sector_size);
+  if (config == NULL) {
+    return SDR_LABEL_ERR_INVALID;
+  }
+
+  sdr_parents_t* p = new (std::nothrow) sdr_parents_t();
+  if (p == NULL) {
+    return SDR_LABEL_ERR_NOMEM;
+  }
+  int ret;
+  try {
+    p->config = *config;
+    if (path != NULL) {
+      p->path = path;
+      p->config.parents_cache_filename = p->path.c_str();
+    }
+    ret = compact ? p->handle.open_compact(p->config, path) :
+                    p->handle.open(p->config);
+  } catch (...) {
+    delete p;
+    return exception_error();
+  }
+  if (ret != 0) {
+    delete p;
+    return SDR_LABEL_ERR_PARENTS;
+  }
+  *parents = p;
+  return SDR_LABEL_OK;
+}
+
+int sdr_parents_open(uint64_t sector_size, const char* path,
+                     sdr_parents_t** parents) {
+  return parents_open(sector_size, path, false, parents);
+}
+
+int sdr_parents_open_compact(uint64_t sector_size, const char* path,
+                             sdr_parents_t** parents) {
+  return parents_open(sector_size, path, true, parents);
+}
+
+void sdr_parents_close(sdr_parents_t* parents) {
+  delete parents;
+}
+
+int sdr_sector_create(sdr_parents_t* parents, uint32_t* layer0,
+                      uint32_t* layer1, sdr_sector_t** sector) {
+  if (parents == NULL || sector == NULL ||
+      ((uintptr_t)layer0 & 0x3F) != 0 || ((uintptr_t)layer1 & 0x3F) != 0) {
+    return SDR_LABEL_ERR_INVALID;
+  }
+  *sector = NULL;
+  sdr_sector_t* s = new (std::nothrow) sdr_sector_t();
+  if (s == NULL) {
+    return SDR_LABEL_ERR_NOMEM;
+  }
+  s->parents = parents;
+  s->cancel  = false;
+  uint32_t* buffers[2] = { layer0, layer1 };
+  for (size_t i = 0; i < 2; i++) {
+    s->owned[i] = buffers[i] == NULL;
+    try {
+      s->layers[i] = s->owned[i] ?
+                     allocate_layer(parents->config.sector_size) : buffers[i];
+    } catch (...) {
+      sdr_sector_destroy(s);
+      return exception_error();
+    }
+    if (s->layers[i] == NULL) {
+      sdr_sector_destroy(s);
+      return SDR_LABEL_ERR_NOMEM;
+    }
+  }
+  *sector = s;
+  return SDR_LABEL_OK;
+}
+
+void sdr_sector_destroy(sdr_sector_t* sector) {
+  if (sector == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < 2; i++) {
+    if (sector->owned[i] && sector->layers[i] != NULL) {
+      free_layer(sector->layers[i], sector->parents->config.sector_size);
+    }
+  }
+  delete sector;
+}
+
+uint32_t* sdr_sector_layer(sdr_sector_t* sector, uint32_t layer) {
+  if (sector == NULL || layer == 0) {
+    return NULL;
+  }
+  return sector->layers[(layer - 1) % 2];
+}
+
+void sdr_sector_cancel(sdr_sector_t* sector) {
+  if (sector != NULL) {
+    sector->cancel.store(true);
+  }
+}
+
+int sdr_label_layer(sdr_sector_t* sector, const uint8_t replica_id[32],
+                    uint32_t layer, uint64_t start_node,
+                    sdr_label_progress_fn progress, void* user_data) {
+  if (sector == NULL || replica_id == NULL || layer == 0) {
+    return SDR_LABEL_ERR_INVALID;
+  }
+  const sector_config_t& config     = sector->parents->config;
+  const parents_handle&  parents    = sector->parents->handle;
+  const uint64_t         node_count = config.node_count;
+  if (start_node > node_count) {
+    return SDR_LABEL_ERR_INVALID;
+  }
+  uint8_t id[32];
+  std::memcpy(id, replica_id, sizeof(id));
+  uint32_t* layer_labels = sector->layers[(layer - 1) % 2];
+  uint32_t* exp_labels   = layer == 1 ? NULL : sector->layers[layer % 2];
+
+  // Report from a separate thread so the consumer never calls out
+  std::atomic<uint64_t>   nodes(start_node);
+  std::mutex              lock;
+  std::condition_variable wake;
+  bool                    done = false;
+  std::thread reporter;
+  if (progress != NULL) {
+    try {
+      reporter = std::thread([&]() {
+        uint64_t reported = start_node;
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+          bool finished = wake.wait_for(guard, SDR_LABEL_PROGRESS_INTERVAL,
+                                        [&]() { return done; });
+          uint64_t count = nodes.load(std::memory_order_acquire);
+          if (count != reported || finished) {
+            guard.unlock();
+            progress(user_data, count, node_count);
+            guard.lock();
+            reported = count;
+          }
+          if (finished) {
+            break;
+          }
+        }
+      });
+    } catch (...) {
+      return exception_error();
+    }
+  }
+
+  // The reporter has to be stopped and the cancel flag dropped whatever
+  // labeling does
+  int ret;
+  int err = SDR_LABEL_OK;
+  set_label_cancel(&sector->cancel);
+  try {
+    ret = parents.compact() != NULL ?
+      create_label(config, *parents.compact(), id, layer_labels, exp_labels,
+                   node_count, layer, &nodes, start_node) :
+      create_label(config, parents.flat(), id, layer_labels, exp_labels,
+                   node_count, layer, &nodes, start_node);
+  } catch (...) {
+    err = exception_error();
+    ret = 1;
+  }
+  set_label_cancel(NULL);
+
+  if (progress != NULL) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      done = true;
+    }
+    wake.notify_one();
+    reporter.join();
+  }
+
+  if (err != SDR_LABEL_OK) {
+    return err;
+  }
+  if (ret == LABEL_CANCELLED) {
+    sector->cancel.store(false);
+    return SDR_LABEL_ERR_CANCELLED;
+  }
+  return ret == 0 ? SDR_LABEL_OK : SDR_LABEL_ERR_LABEL;
+}
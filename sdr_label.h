@@ -0,0 +1,110 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __SDR_LABEL_H__
+#define __SDR_LABEL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// C ABI of libsdrlabel.so
+//
+// For embedding the labeler in other languages. A parents cache is opened
+// once per sector size and shared read-only by any number of sectors. A
+// sector owns two layer buffers, either the caller's or allocated by the
+// library, and labels layer N into buffer (N - 1) % 2 reading layer N - 1
+// from the other one. Labels stay in those buffers, callers read (and may
+// fill, e.g. to resume from layer files) them in place.
+//
+// Sectors are independent: each can be labeled on its own thread
+// concurrently with the others. Calls on one sector must not overlap,
+// except sdr_sector_cancel. Functions returning int return SDR_LABEL_OK or
+// one of the error codes below, nothing in the library exits the process
+// or throws to the caller. The library writes nothing to stdout, failures
+// are described on stderr.
+//
+// The ABI version changes whenever a declaration here changes
+// incompatibly. Compare sdr_label_abi_version() with SDR_LABEL_ABI_VERSION
+// before the first call. The soname carries the same number.
+
+#define SDR_LABEL_ABI_VERSION 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define SDR_LABEL_API __attribute__((visibility("default")))
+#else
+#define SDR_LABEL_API
+#endif
+
+enum {
+  SDR_LABEL_OK            = 0,
+  SDR_LABEL_ERR_INVALID   = 1,  // Bad argument or unsupported sector size
+  SDR_LABEL_ERR_PARENTS   = 2,  // Parents cache could not be loaded
+  SDR_LABEL_ERR_NOMEM     = 3,  // Memory or thread allocation failed
+  SDR_LABEL_ERR_LABEL     = 4,  // Labeling failed
+  SDR_LABEL_ERR_CANCELLED = 5   // Stopped by sdr_sector_cancel
+};
+
+typedef struct sdr_parents sdr_parents_t;
+typedef struct sdr_sector  sdr_sector_t;
+
+// Called while a layer is labeled with the count of final labels, from a
+// library thread. The last call, with the count reached, happens before
+// sdr_label_layer returns.
+typedef void (*sdr_label_progress_fn)(void* user_data, uint64_t nodes_done,
+                                      uint64_t node_count);
+
+SDR_LABEL_API uint32_t sdr_label_abi_version(void);
+
+// Short description of an error code
+SDR_LABEL_API const char* sdr_label_strerror(int err);
+
+// Open the flat parents cache of sector_size at path, the lotus cache file
+// when path is NULL. The cache is generated when there is no file.
+SDR_LABEL_API int sdr_parents_open(uint64_t sector_size, const char* path,
+                                   sdr_parents_t** parents);
+// Open a compact parents cache written by gen_parents_cache
+SDR_LABEL_API int sdr_parents_open_compact(uint64_t sector_size,
+                                           const char* path,
+                                           sdr_parents_t** parents);
+// The sectors using parents have to be destroyed first
+SDR_LABEL_API void sdr_parents_close(sdr_parents_t* parents);
+
+// Create a sector labeled against parents. layer0 and layer1 are sector
+// size buffers, 64 byte aligned, which stay owned by the caller and have
+// to outlive the sector. NULL has the library allocate (and lock) that
+// buffer instead.
+SDR_LABEL_API int sdr_sector_create(sdr_parents_t* parents, uint32_t* layer0,
+                                    uint32_t* layer1, sdr_sector_t** sector);
+SDR_LABEL_API void sdr_sector_destroy(sdr_sector_t* sector);
+
+// Buffer holding layer, (layer - 1) % 2, NULL for layer 0
+SDR_LABEL_API uint32_t* sdr_sector_layer(sdr_sector_t* sector,
+                                         uint32_t layer);
+
+// Label layer (1 based) of the sector with replica_id on the calling
+// thread, which becomes the consumer. Layers above 1 need the previous
+// layer in the other buffer. Labels below start_node have to be final
+// already, e.g. after a cancel, 0 labels the whole layer. progress may be
+// NULL.
+SDR_LABEL_API int sdr_label_layer(sdr_sector_t* sector,
+                                  const uint8_t replica_id[32],
+                                  uint32_t layer, uint64_t start_node,
+                                  sdr_label_progress_fn progress,
+                                  void* user_data);
+
+// Stop the running sdr_label_layer of sector, or the next one, from any
+// thread. It returns SDR_LABEL_ERR_CANCELLED after a last progress call,
+// the labels below that count are final and the layer can be resumed
+// from there.
+SDR_LABEL_API void sdr_sector_cancel(sdr_sector_t* sector);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __SDR_LABEL_H__
@@ -0,0 +1,205 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>       // uint*
+#include <cstdio>        // fprintf
+#include <cstdlib>       // getenv
+#include <string>
+#include "sha256_dispatch.h"
+#include "sha256_multi.h"
+
+#if defined(__x86_64__) || defined(__x86_64) || defined(_M_X64)
+#define SHA256_X86
+#include <cpuid.h>
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// CPU feature checks
+static bool cpu_any() {
+  return true;
+}
+
+#ifdef SHA256_X86
+static bool cpuid_bit(unsigned leaf, int reg, unsigned bit) {
+  unsigned r[4];
+  if (!__get_cpuid_count(leaf, 0, &r[0], &r[1], &r[2], &r[3])) {
+    return false;
+  }
+  return (r[reg] >> bit) & 1;
+}
+
+// Register state the OS saves on context switches
+static uint64_t xgetbv0() {
+  uint32_t eax, edx;
+  __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  return ((uint64_t)edx << 32) | eax;
+}
+
+static const int EBX = 1, ECX = 2;
+
+static bool cpu_avx() {
+  return cpuid_bit(1, ECX, 27) &&         // OSXSAVE
+         cpuid_bit(1, ECX, 28) &&         // AVX
+         cpuid_bit(1, ECX, 9) &&          // SSSE3
+         (xgetbv0() & 0x6) == 0x6;        // XMM and YMM state
+}
+
+static bool cpu_avx2() {
+  return cpu_avx() && cpuid_bit(7, EBX, 5);
+}
+
+static bool cpu_avx512() {
+  return cpu_avx2() && cpuid_bit(7, EBX, 16) &&  // AVX512F
+         (xgetbv0() & 0xe6) == 0xe6;             // Opmask and ZMM state
+}
+
+static bool cpu_shani() {
+  return cpuid_bit(7, EBX, 29) &&         // SHA
+         cpuid_bit(1, ECX, 19) &&         // SSE4.1
+         cpuid_bit(1, ECX, 9);            // SSSE3
+}
+#elif defined(__aarch64__)
+static bool cpu_armv8() {
+  return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+}
+#endif
+
+const sha256_backend_t SHA256_BACKENDS[] = {
+#ifdef SHA256_X86
+  { "shani",      1,  cpu_shani,  blst_sha256_block_data_order_shaext, NULL },
+  { "avx",        1,  cpu_avx,    blst_sha256_block_data_order_avx,    NULL },
+#elif defined(__aarch64__)
+  { "armv8",      1,  cpu_armv8,  blst_sha256_block_armv8,             NULL },
+#endif
+  { "scalar",     1,  cpu_any,    blst_sha256_block_data_order,        NULL },
+#ifdef SHA256_X86
+  { "avx512_x16", 16, cpu_avx512, NULL, sha256_block_x16_avx512 },
+  { "avx2_x8",    8,  cpu_avx2,   NULL, sha256_block_x8_avx2 },
+#endif
+  { "x4",         4,  cpu_any,    NULL, sha256_block_x4 }
+};
+
+const size_t SHA256_BACKEND_COUNT =
+  sizeof(SHA256_BACKENDS) / sizeof(SHA256_BACKENDS[0]);
+
+static const sha256_backend_t* single_backend = NULL;
+// Indexed by log2(lanes) - 2: 4, 8 and 16 lane kernels
+static const sha256_backend_t* multi_backends[3] = { NULL, NULL, NULL };
+
+// Pick the fastest supported backends, multi-buffer kernels no wider than
+// max_lanes
+static void select_backends(const sha256_backend_t* single,
+                            size_t max_lanes) {
+  single_backend = single;
+  for (size_t i = 0; i < 3; i++) {
+    multi_backends[i] = NULL;
+  }
+  for (size_t i = 0; i < SHA256_BACKEND_COUNT; i++) {
+    const sha256_backend_t& backend = SHA256_BACKENDS[i];
+    if (!backend.supported()) {
+      continue;
+    }
+    if (backend.lanes == 1) {
+      if (single_backend == NULL) {
+        single_backend = &backend;
+      }
+    } else if (backend.lanes <= max_lanes) {
+      size_t slot = __builtin_ctzl(backend.lanes) - 2;
+      if (multi_backends[slot] == NULL) {
+        multi_backends[slot] = &backend;
+      }
+    }
+  }
+  sha256_block_active.store(single_backend->block,
+                            std::memory_order_release);
+}
+
+static const sha256_backend_t* find_backend(const std::string& name) {
+  for (size_t i = 0; i < SHA256_BACKEND_COUNT; i++) {
+    if (name == SHA256_BACKENDS[i].name) {
+      return &SHA256_BACKENDS[i];
+    }
+  }
+  return NULL;
+}
+
+static int force_backends(const char* names) {
+  const sha256_backend_t* single = NULL;
+  size_t max_lanes = SHA256_MULTI_MAX_LANES;
+
+  std::string list(names);
+  size_t pos = 0;
+  while (pos <= list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    std::string name = list.substr(pos, end - pos);
+    pos = end + 1;
+    if (name.empty() || name == "auto") {
+      continue;
+    }
+
+    const sha256_backend_t* backend = find_backend(name);
+    if (backend == NULL) {
+      fprintf(stderr, "ERROR - unknown SHA-256 backend %s\n", name.c_str());
+      return 1;
+    }
+    if (!backend->supported()) {
+      fprintf(stderr, "ERROR - SHA-256 backend %s not supported by this CPU\n",
+              name.c_str());
+      return 1;
+    }
+    if (backend->lanes == 1) {
+      single = backend;
+    } else {
+      max_lanes = backend->lanes;
+    }
+  }
+
+  select_backends(single, max_lanes);
+  return 0;
+}
+
+// Selected once, on the first hash or query
+static void sha256_dispatch_init() {
+  static const bool initialized = []() {
+    select_backends(NULL, SHA256_MULTI_MAX_LANES);
+    const char* env = getenv("SDR_SHA256");
+    if (env != NULL && force_backends(env) != 0) {
+      fprintf(stderr, "Ignoring SDR_SHA256=%s\n", env);
+    }
+    return true;
+  }();
+  (void)initialized;
+}
+
+int sha256_force_backend(const char* names) {
+  sha256_dispatch_init();
+  return force_backends(names);
+}
+
+static void sha256_block_first(uint32_t* h, const void* in, size_t blocks) {
+  sha256_dispatch_init();
+  sha256_block(h, in, blocks);
+}
+
+std::atomic<sha256_block_fn_t> sha256_block_active(sha256_block_first);
+
+const sha256_backend_t* sha256_single_backend() {
+  sha256_dispatch_init();
+  return single_backend;
+}
+
+const sha256_backend_t* sha256_multi_backend(size_t lanes) {
+  sha256_dispatch_init();
+  switch (lanes) {
+  case 4:  return multi_backends[0];
+  case 8:  return multi_backends[1];
+  case 16: return multi_backends[2];
+  default: return NULL;
+  }
+}
@@ -0,0 +1,64 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __SHA256_DISPATCH_H__
+#define __SHA256_DISPATCH_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+
+extern "C" {
+  void blst_sha256_block_data_order(uint32_t* h, const void* in, size_t blocks);
+#if defined(__x86_64__) || defined(__x86_64) || defined(_M_X64)
+  void blst_sha256_block_data_order_avx(uint32_t* h, const void* in,
+                                        size_t blocks);
+  void blst_sha256_block_data_order_shaext(uint32_t* h, const void* in,
+                                           size_t blocks);
+#elif defined(__aarch64__)
+  void blst_sha256_block_armv8(uint32_t* h, const void* in, size_t blocks);
+#endif
+  void blst_sha256_emit(uint8_t* md, const uint32_t* h);
+}
+
+typedef void (*sha256_block_fn_t)(uint32_t* h, const void* in, size_t blocks);
+typedef void (*sha256_multi_fn_t)(uint32_t* const* h, const uint8_t* const* in,
+                                  size_t blocks);
+
+// A SHA-256 block function. Single stream backends have lanes == 1 and
+// 'block', multi-buffer backends hash 'lanes' streams with 'block_multi'.
+struct sha256_backend_t {
+  const char*       name;
+  size_t            lanes;
+  bool            (*supported)();   // Runtime CPU check
+  sha256_block_fn_t block;
+  sha256_multi_fn_t block_multi;
+};
+
+// Every backend compiled into this binary, fastest first for each lane
+// count. The best supported ones are picked on first use from cpuid or
+// hwcaps, SDR_SHA256 (see sha256_force_backend) overrides.
+extern const sha256_backend_t SHA256_BACKENDS[];
+extern const size_t           SHA256_BACKEND_COUNT;
+
+// Single stream function in use. Atomic since sha256_force_backend may
+// swap it while other threads hash.
+extern std::atomic<sha256_block_fn_t> sha256_block_active;
+
+inline void sha256_block(uint32_t* h, const void* in, size_t blocks) {
+  sha256_block_active.load(std::memory_order_acquire)(h, in, blocks);
+}
+
+// Force backends for benchmarking, a comma separated list of names. A
+// single stream name replaces the single stream backend, a multi-buffer
+// name caps the kernel width at its lane count. "auto" restores the CPU
+// based choice. Returns non-zero for unknown or unsupported names.
+int sha256_force_backend(const char* names);
+
+// Backend in use for single streams, and for groups of 'lanes' (4, 8 or
+// 16) streams, NULL if groups of that width are not hashed together
+const sha256_backend_t* sha256_single_backend();
+const sha256_backend_t* sha256_multi_backend(size_t lanes);
+
+#endif // __SHA256_DISPATCH_H__
@@ -0,0 +1,146 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>       // uint*
+#include <cstring>       // memcpy
+#include <byteswap.h>    // bswap_32
+#include "sha256_dispatch.h"
+#include "sha256_multi.h"
+
+static const uint32_t SHA256_K[64] = {
+  0x428a2f98U, 0x71374491U, 0xb5c0fbcfU, 0xe9b5dba5U,
+  0x3956c25bU, 0x59f111f1U, 0x923f82a4U, 0xab1c5ed5U,
+  0xd807aa98U, 0x12835b01U, 0x243185beU, 0x550c7dc3U,
+  0x72be5d74U, 0x80deb1feU, 0x9bdc06a7U, 0xc19bf174U,
+  0xe49b69c1U, 0xefbe4786U, 0x0fc19dc6U, 0x240ca1ccU,
+  0x2de92c6fU, 0x4a7484aaU, 0x5cb0a9dcU, 0x76f988daU,
+  0x983e5152U, 0xa831c66dU, 0xb00327c8U, 0xbf597fc7U,
+  0xc6e00bf3U, 0xd5a79147U, 0x06ca6351U, 0x14292967U,
+  0x27b70a85U, 0x2e1b2138U, 0x4d2c6dfcU, 0x53380d13U,
+  0x650a7354U, 0x766a0abbU, 0x81c2c92eU, 0x92722c85U,
+  0xa2bfe8a1U, 0xa81a664bU, 0xc24b8b70U, 0xc76c51a3U,
+  0xd192e819U, 0xd6990624U, 0xf40e3585U, 0x106aa070U,
+  0x19a4c116U, 0x1e376c08U, 0x2748774cU, 0x34b0bcb5U,
+  0x391c0cb3U, 0x4ed8aa4aU, 0x5b9cca4fU, 0x682e6ff3U,
+  0x748f82eeU, 0x78a5636fU, 0x84c87814U, 0x8cc70208U,
+  0x90befffaU, 0xa4506cebU, 0xbef9a3f7U, 0xc67178f2U
+};
+
+// The kernel is written with GCC vector extensions so the same source maps
+// onto SSE (4 lanes), AVX2 (8 lanes) and AVX-512 (16 lanes) registers. Each
+// vector element holds the same state word for a different stream.
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+template<size_t LANES> struct sha256_vec;
+template<> struct sha256_vec<4> {
+  typedef uint32_t type __attribute__((vector_size(16)));
+};
+template<> struct sha256_vec<8> {
+  typedef uint32_t type __attribute__((vector_size(32)));
+};
+template<> struct sha256_vec<16> {
+  typedef uint32_t type __attribute__((vector_size(64)));
+};
+
+// Always inlined so each kernel below is compiled for its own target
+template<size_t LANES>
+__attribute__((always_inline))
+static inline void sha256_block_lanes(uint32_t* const* h,
+                                      const uint8_t* const* in,
+                                      size_t blocks) {
+  typedef typename sha256_vec<LANES>::type vec_t;
+
+  vec_t state[8];
+  for (size_t j = 0; j < 8; j++) {
+    for (size_t l = 0; l < LANES; l++) {
+      state[j][l] = h[l][j];
+    }
+  }
+
+  for (size_t b = 0; b < blocks; b++) {
+    // Transpose the message words into lane order
+    vec_t w[16];
+    for (size_t j = 0; j < 16; j++) {
+      for (size_t l = 0; l < LANES; l++) {
+        uint32_t word;
+        std::memcpy(&word, in[l] + b * 64 + j * 4, 4);
+        w[j][l] = bswap_32(word);
+      }
+    }
+
+    vec_t a = state[0], bb = state[1], c = state[2], d = state[3];
+    vec_t e = state[4], f = state[5], g = state[6], hh = state[7];
+
+    for (size_t i = 0; i < 64; i++) {
+      if (i >= 16) {
+        vec_t w15 = w[(i - 15) & 15];
+        vec_t w2  = w[(i - 2) & 15];
+        vec_t s0  = ROTR(w15, 7) ^ ROTR(w15, 18) ^ (w15 >> 3);
+        vec_t s1  = ROTR(w2, 17) ^ ROTR(w2, 19) ^ (w2 >> 10);
+        w[i & 15] += s0 + w[(i - 7) & 15] + s1;
+      }
+      vec_t t1 = hh + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) +
+                 ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i & 15];
+      vec_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) +
+                 ((a & bb) ^ (a & c) ^ (bb & c));
+      hh = g;
+      g  = f;
+      f  = e;
+      e  = d + t1;
+      d  = c;
+      c  = bb;
+      bb = a;
+      a  = t1 + t2;
+    }
+
+    state[0] += a;  state[1] += bb; state[2] += c; state[3] += d;
+    state[4] += e;  state[5] += f;  state[6] += g; state[7] += hh;
+  }
+
+  for (size_t j = 0; j < 8; j++) {
+    for (size_t l = 0; l < LANES; l++) {
+      h[l][j] = state[j][l];
+    }
+  }
+}
+
+#undef ROTR
+
+void sha256_block_x4(uint32_t* const* h, const uint8_t* const* in,
+                     size_t blocks) {
+  sha256_block_lanes<4>(h, in, blocks);
+}
+
+#if defined(__x86_64__) || defined(__x86_64) || defined(_M_X64)
+__attribute__((target("avx2")))
+void sha256_block_x8_avx2(uint32_t* const* h, const uint8_t* const* in,
+                          size_t blocks) {
+  sha256_block_lanes<8>(h, in, blocks);
+}
+
+__attribute__((target("avx512f")))
+void sha256_block_x16_avx512(uint32_t* const* h, const uint8_t* const* in,
+                             size_t blocks) {
+  sha256_block_lanes<16>(h, in, blocks);
+}
+#endif
+
+void sha256_block_multi(uint32_t* const* h, const uint8_t* const* in,
+                        size_t blocks, size_t lanes) {
+  // Widest first, a width without a kernel is split into narrower groups
+  size_t l = 0;
+  for (size_t width = SHA256_MULTI_MAX_LANES; width >= 4; width /= 2) {
+    const sha256_backend_t* backend = sha256_multi_backend(width);
+    if (backend == NULL) {
+      continue;
+    }
+    while (lanes - l >= width) {
+      backend->block_multi(h + l, in + l, blocks);
+      l += width;
+    }
+  }
+  for (; l < lanes; l++) {
+    sha256_block(h[l], in[l], blocks);
+  }
+}
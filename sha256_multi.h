@@ -0,0 +1,34 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __SHA256_MULTI_H__
+#define __SHA256_MULTI_H__
+
+#include <cstdint>
+#include <cstddef>
+
+// Widest lane count handled by a single kernel invocation (AVX-512)
+const size_t SHA256_MULTI_MAX_LANES = 16;
+
+// Kernels for exactly 4, 8 or 16 streams. The wider ones are compiled for
+// AVX2 and AVX-512 regardless of the build flags, sha256_dispatch only uses
+// them when the CPU supports it.
+void sha256_block_x4(uint32_t* const* h, const uint8_t* const* in,
+                     size_t blocks);
+#if defined(__x86_64__) || defined(__x86_64) || defined(_M_X64)
+void sha256_block_x8_avx2(uint32_t* const* h, const uint8_t* const* in,
+                          size_t blocks);
+void sha256_block_x16_avx512(uint32_t* const* h, const uint8_t* const* in,
+                             size_t blocks);
+#endif
+
+// Multi-buffer SHA-256 block function. Compresses 'blocks' 64 byte blocks
+// for each of 'lanes' independent streams. Semantics per lane match
+// blst_sha256_block: h[l] is the native endian state, in[l] the message.
+// Lanes are processed 16, 8 or 4 wide with the widest kernels the CPU
+// supports, any remainder falls back to the single stream block function.
+void sha256_block_multi(uint32_t* const* h, const uint8_t* const* in,
+                        size_t blocks, size_t lanes);
+
+#endif // __SHA256_MULTI_H__
@@ -0,0 +1,239 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>          // uint*
+#include <cstdio>           // fprintf
+#include <cstring>          // strerror
+#include <fstream>          // file read
+#include <string>
+#include <map>
+#include <tuple>
+#include <algorithm>        // sort
+#include <sched.h>          // sched_setaffinity
+#include <cstdlib>          // atoi
+#include <errno.h>
+#include <unistd.h>         // syscall
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "topology.h"
+
+static const char* SYSFS_CPU  = "/sys/devices/system/cpu";
+static const char* SYSFS_NODE = "/sys/devices/system/node";
+
+static bool read_line(const std::string& path, std::string& line) {
+  std::ifstream file(path);
+  return (bool)std::getline(file, line);
+}
+
+static int read_int(const std::string& path, int fallback) {
+  std::string line;
+  if (!read_line(path, line)) {
+    return fallback;
+  }
+  return atoi(line.c_str());
+}
+
+// Parse a sysfs cpu list such as "0-3,8-11"
+static std::vector<int> parse_cpu_list(const std::string& list) {
+  std::vector<int> cpus;
+  size_t pos = 0;
+  while (pos < list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    std::string range = list.substr(pos, end - pos);
+    size_t dash = range.find('-');
+    if (!range.empty()) {
+      int first = atoi(range.c_str());
+      int last  = dash == std::string::npos ? first :
+                                              atoi(range.c_str() + dash + 1);
+      for (int cpu = first; cpu <= last; cpu++) {
+        cpus.push_back(cpu);
+      }
+    }
+    pos = end + 1;
+  }
+  return cpus;
+}
+
+int load_cpu_topology(cpu_topology_t& topo) {
+  topo.cpus.clear();
+  topo.num_nodes = 1;
+
+  std::string line;
+  if (!read_line(std::string(SYSFS_CPU) + "/online", line)) {
+    fprintf(stderr, "ERROR - can not read %s/online\n", SYSFS_CPU);
+    return 1;
+  }
+  std::vector<int> online = parse_cpu_list(line);
+
+  // CPU to NUMA node
+  std::map<int, int> cpu_node;
+  if (read_line(std::string(SYSFS_NODE) + "/online", line)) {
+    std::vector<int> nodes = parse_cpu_list(line);
+    topo.num_nodes = nodes.empty() ? 1 : nodes.back() + 1;
+    for (int node : nodes) {
+      std::string cpulist;
+      if (read_line(std::string(SYSFS_NODE) + "/node" +
+                    std::to_string(node) + "/cpulist", cpulist)) {
+        for (int cpu : parse_cpu_list(cpulist)) {
+          cpu_node[cpu] = node;
+        }
+      }
+    }
+  }
+
+  for (int cpu : online) {
+    std::string dir = std::string(SYSFS_CPU) + "/cpu" + std::to_string(cpu);
+    cpu_info_t info;
+    info.cpu       = cpu;
+    info.package   = read_int(dir + "/topology/physical_package_id", 0);
+    info.core      = read_int(dir + "/topology/core_id", cpu);
+    info.numa_node = cpu_node.count(cpu) ? cpu_node[cpu] : 0;
+    info.l2_id     = -1;
+    info.l3_id     = -1;
+
+    for (int index = 0; ; index++) {
+      std::string cache = dir + "/cache/index" + std::to_string(index);
+      std::string type, shared;
+      if (!read_line(cache + "/type", type)) {
+        break;
+      }
+      if (type == "Instruction" ||
+          !read_line(cache + "/shared_cpu_list", shared)) {
+        continue;
+      }
+      std::vector<int> sharing = parse_cpu_list(shared);
+      int id = sharing.empty() ? cpu : sharing.front();
+      int level = read_int(cache + "/level", 0);
+      if (level == 2) {
+        info.l2_id = id;
+      } else if (level == 3) {
+        info.l3_id = id;
+      }
+    }
+    // Without cache information assume a private L2 and a shared L3 per
+    // package. Offset package ids so they can't clash with cpu numbers.
+    if (info.l2_id < 0) {
+      info.l2_id = cpu;
+    }
+    if (info.l3_id < 0) {
+      info.l3_id = -1 - info.package;
+    }
+    topo.cpus.push_back(info);
+  }
+  return 0;
+}
+
+int plan_label_placement(const cpu_topology_t& topo, size_t num_sectors,
+                         size_t num_producers,
+                         std::vector<label_placement_t>& placements) {
+  // Physical cores, grouped into L3 domains ordered by node and socket
+  typedef std::tuple<int, int, int> domain_key_t;  // node, package, l3
+  std::map<domain_key_t, std::map<int, std::vector<int>>> domains;
+  for (const cpu_info_t& info : topo.cpus) {
+    domain_key_t key(info.numa_node, info.package, info.l3_id);
+    domains[key][info.core].push_back(info.cpu);
+  }
+
+  placements.clear();
+  if (num_sectors == 0) {
+    return 0;
+  }
+  for (auto& domain : domains) {
+    // Whole cores are handed out so sectors never share a core
+    std::vector<std::vector<int>> cores;
+    for (auto& core : domain.second) {
+      cores.push_back(core.second);
+    }
+    size_t next_core = 0;
+    while (placements.size() < num_sectors && next_core < cores.size()) {
+      label_placement_t placement;
+      placement.numa_node    = std::get<0>(domain.first);
+      placement.consumer_cpu = cores[next_core][0];
+
+      // Sibling threads first, then the next cores in the same cache
+      size_t core = next_core;
+      size_t thread = 1;
+      while (placement.producer_cpus.size() < num_producers &&
+             core < cores.size()) {
+        if (thread < cores[core].size()) {
+          placement.producer_cpus.push_back(cores[core][thread++]);
+        } else {
+          core++;
+          thread = 0;
+        }
+      }
+      if (placement.producer_cpus.size() < num_producers) {
+        break;   // Domain is full, try the next one
+      }
+      placements.push_back(placement);
+      next_core = core + 1;
+    }
+    if (placements.size() == num_sectors) {
+      return 0;
+    }
+  }
+
+  if (placements.empty()) {
+    // Fewer CPUs in every domain than one sector needs, share the first
+    label_placement_t placement;
+    placement.numa_node    = topo.cpus.empty() ? 0 : topo.cpus[0].numa_node;
+    placement.consumer_cpu = topo.cpus.empty() ? 0 : topo.cpus[0].cpu;
+    for (size_t i = 0; i < num_producers && !topo.cpus.empty(); i++) {
+      placement.producer_cpus.push_back(
+        topo.cpus[(i + 1) % topo.cpus.size()].cpu);
+    }
+    placements.push_back(placement);
+  }
+  size_t fitted = placements.size();
+  fprintf(stderr, "WARNING - CPUs for %ld of %ld sectors, sharing cores\n",
+          fitted, num_sectors);
+  for (size_t i = fitted; i < num_sectors; i++) {
+    placements.push_back(placements[i % fitted]);
+  }
+  return 1;
+}
+
+int pin_thread_to_cpu(int cpu, cpu_set_t* saved) {
+  if (saved != NULL && sched_getaffinity(0, sizeof(*saved), saved) != 0) {
+    fprintf(stderr, "sched_getaffinity failed err %s\n", strerror(errno));
+    return 1;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+    fprintf(stderr, "sched_setaffinity %d failed err %s\n", cpu,
+            strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+int restore_thread_affinity(const cpu_set_t& saved) {
+  if (sched_setaffinity(0, sizeof(saved), &saved) != 0) {
+    fprintf(stderr, "sched_setaffinity failed err %s\n", strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+int bind_memory_to_node(void* addr, size_t len, int numa_node) {
+  const size_t mask_bits = sizeof(unsigned long) * 8;
+  unsigned long nodemask[16] = {0};
+  if (numa_node < 0 || (size_t)numa_node >= sizeof(nodemask) * 8) {
+    return 1;
+  }
+  nodemask[numa_node / mask_bits] = 1UL << (numa_node % mask_bits);
+
+  if (syscall(SYS_mbind, addr, len, MPOL_BIND, nodemask,
+              sizeof(nodemask) * 8, MPOL_MF_MOVE) != 0) {
+    fprintf(stderr, "mbind node %d failed err %s\n", numa_node,
+            strerror(errno));
+    return 1;
+  }
+  return 0;
+}
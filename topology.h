@@ -0,0 +1,57 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __TOPOLOGY_H__
+#define __TOPOLOGY_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <sched.h>          // cpu_set_t
+
+// One logical CPU as described by sysfs
+struct cpu_info_t {
+  int cpu;
+  int package;     // Socket
+  int core;        // Physical core, unique within the package
+  int numa_node;
+  int l2_id;       // Lowest CPU sharing the L2, identifies the cache
+  int l3_id;       // Lowest CPU sharing the L3 (or package without L3 info)
+};
+
+struct cpu_topology_t {
+  std::vector<cpu_info_t> cpus;  // Online CPUs ordered by cpu number
+  int num_nodes;
+};
+
+// Read the online CPUs, their caches and NUMA nodes from
+// /sys/devices/system. Missing information falls back to one node, one
+// cache per package.
+int load_cpu_topology(cpu_topology_t& topo);
+
+// Where to run the threads of one sector and keep its memory
+struct label_placement_t {
+  int              numa_node;
+  int              consumer_cpu;
+  std::vector<int> producer_cpus;
+};
+
+// Place num_sectors sectors of 1 consumer + num_producers producer threads.
+// The consumer gets a physical core, producers take its hyperthread sibling
+// first and then neighbouring cores under the same L3. Sectors are packed
+// into as few L3 domains and sockets as possible. Returns non-zero if
+// there are not enough CPUs, placements are then reused round robin.
+int plan_label_placement(const cpu_topology_t& topo, size_t num_sectors,
+                         size_t num_producers,
+                         std::vector<label_placement_t>& placements);
+
+// Pin the calling thread. The previous affinity is stored in 'saved' when
+// it is not NULL, restore_thread_affinity puts it back.
+int pin_thread_to_cpu(int cpu, cpu_set_t* saved = NULL);
+int restore_thread_affinity(const cpu_set_t& saved);
+
+// Bind memory to a NUMA node, pages already present are migrated
+int bind_memory_to_node(void* addr, size_t len, int numa_node);
+
+#endif // __TOPOLOGY_H__
@@ -0,0 +1,94 @@
+// Copyright Supranational LLC
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef __WAIT_POLICY_H__
+#define __WAIT_POLICY_H__
+
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <unistd.h>          // usleep, syscall
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
+
+// How labeling threads wait on each other's progress counters
+enum label_wait_policy_t {
+  WAIT_POLICY_SLEEP,     // Poll with usleep(10)
+  WAIT_POLICY_SPIN,      // Poll with a pause instruction, never yield the core
+  WAIT_POLICY_ADAPTIVE   // Spin, then yield, then block on a futex
+};
+
+// Adaptive policy limits
+const unsigned WAIT_SPIN_COUNT  = 512;
+const unsigned WAIT_YIELD_COUNT = 64;
+// Upper bound on a single futex sleep, guards against a missed wake
+const long     WAIT_FUTEX_NS    = 1000000;
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield" ::: "memory");
+#endif
+}
+
+// futex operates on 32 bits, use the low half of the counter. It changes
+// on every increment so it works as the futex value.
+inline uint32_t* futex_word(std::atomic<uint64_t>& counter) {
+  static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t),
+                "atomic counter must be lock free");
+  return (uint32_t*)&counter;   // Little endian
+}
+
+// A counter that other threads wait on. sleepers counts threads blocked in
+// the futex so the common case wake is a single load.
+struct wait_counter_t {
+  std::atomic<uint64_t>* counter;
+  std::atomic<uint32_t>  sleepers;
+};
+
+inline void wait_wake(wait_counter_t& wc) {
+  if (wc.sleepers.load() != 0) {
+    syscall(SYS_futex, futex_word(*wc.counter), FUTEX_WAKE_PRIVATE, INT32_MAX,
+            NULL, NULL, 0);
+  }
+}
+
+// Wait until ready(counter value) holds. Returns true if the caller had to
+// wait at all.
+template<class READY>
+inline bool wait_until(wait_counter_t& wc, label_wait_policy_t policy,
+                       READY ready) {
+  uint64_t val = wc.counter->load();
+  if (ready(val)) {
+    return false;
+  }
+
+  unsigned iter = 0;
+  while (!ready(val = wc.counter->load())) {
+    if (policy == WAIT_POLICY_SLEEP) {
+      usleep(10);
+    } else if (policy == WAIT_POLICY_SPIN || iter < WAIT_SPIN_COUNT) {
+      cpu_relax();
+    } else if (iter < WAIT_SPIN_COUNT + WAIT_YIELD_COUNT) {
+      std::this_thread::yield();
+    } else {
+      // Register before the final check so a concurrent update either is
+      // seen here or sees the sleeper and wakes us
+      wc.sleepers.fetch_add(1);
+      val = wc.counter->load();
+      if (!ready(val)) {
+        timespec timeout = { 0, WAIT_FUTEX_NS };
+        syscall(SYS_futex, futex_word(*wc.counter), FUTEX_WAIT_PRIVATE,
+                (uint32_t)val, &timeout, NULL, 0);
+      }
+      wc.sleepers.fetch_sub(1);
+    }
+    iter++;
+  }
+  return true;
+}
+
+#endif // __WAIT_POLICY_H__